@@ -0,0 +1,421 @@
+#include "BufferLog.hpp"
+#include <coco/align.hpp>
+#include <coco/bits.hpp>
+
+
+namespace coco {
+
+// sector header: sequence number (4 bytes), magic (2 bytes) and checksum (2 bytes), little endian
+constexpr int SECTOR_HEADER_SIZE = 8;
+constexpr uint8_t SECTOR_MAGIC[] = {'L', 'G'};
+
+// record header: size (2 bytes) and checksum of size and data (2 bytes), little endian. The data follows and the
+// record is aligned to the block size
+constexpr int RECORD_HEADER_SIZE = 4;
+
+// size of an erased record header which marks the end of the records in a sector
+constexpr int RECORD_END = 0xffff;
+
+
+BufferLog::BufferLog(const Info &info, Buffer &buffer)
+    : info(info), buffer(buffer), semaphore(1)
+{
+    assert(info.blockSize >= 1 && firstBit(info.blockSize) == info.blockSize);
+    assert(info.pageSize >= 1 && firstBit(info.pageSize) == info.pageSize);
+    assert(info.sectorSize >= 1 && info.sectorSize % info.pageSize == 0);
+    assert(info.sectorCount >= 2);
+
+    this->headerSize = align(SECTOR_HEADER_SIZE, info.blockSize);
+    this->maxSize = std::min(info.sectorSize - this->headerSize - RECORD_HEADER_SIZE, RECORD_END - 1);
+    assert(buffer.capacity() >= this->headerSize && this->maxSize > 0);
+
+    this->sectors = new Sector[info.sectorCount];
+    for (int i = 0; i < info.sectorCount; ++i) {
+        this->sectors[i] = {0, SectorState::DIRTY};
+    }
+}
+
+BufferLog::~BufferLog() {
+    delete [] this->sectors;
+}
+
+AwaitableCoroutine BufferLog::mount(int &result) {
+    auto &buffer = this->buffer;
+
+    // acquire semaphore
+    co_await this->semaphore.untilAcquired();
+    Semaphore::Guard guard(this->semaphore);
+
+    this->stat = State::BUSY;
+    co_await buffer.acquire();
+
+    // read header of all sectors, sectors without valid header get erased before they are used as an erase may have
+    // been interrupted
+    this->head = -1;
+    for (int i = 0; i < this->info.sectorCount; ++i) {
+        auto &sector = this->sectors[i];
+        setOffset(i * this->info.sectorSize, Command::READ);
+        co_await buffer.read(SECTOR_HEADER_SIZE);
+        if (buffer.size() < SECTOR_HEADER_SIZE) {
+            // something went wrong
+            result = Result::FATAL_ERROR;
+            this->stat = State::NOT_MOUNTED;
+            co_return;
+        }
+        const uint8_t *h = buffer.data();
+        uint16_t crc = h[6] | (h[7] << 8);
+        if (h[4] == SECTOR_MAGIC[0] && h[5] == SECTOR_MAGIC[1] && crc == BufferStorage::crc16(h, 6)) {
+            sector = {uint32_t(h[0] | (h[1] << 8) | (h[2] << 16) | (h[3] << 24)), SectorState::USED};
+            if (this->head == -1 || sector.sequence > this->sectors[this->head].sequence)
+                this->head = i;
+        } else {
+            sector = {0, SectorState::DIRTY};
+        }
+    }
+
+    // find end of records in the newest sector
+    if (this->head >= 0) {
+        this->sequence = this->sectors[this->head].sequence + 1;
+        co_await detectEnd(this->writeOffset);
+    } else {
+        this->sequence = 0;
+    }
+
+    result = Result::OK;
+    this->stat = State::READY;
+}
+
+AwaitableCoroutine BufferLog::clear(int &result) {
+    // acquire semaphore
+    co_await this->semaphore.untilAcquired();
+    Semaphore::Guard guard(this->semaphore);
+
+    this->stat = State::BUSY;
+    co_await this->buffer.acquire();
+
+    // erase all sectors
+    for (int i = 0; i < this->info.sectorCount; ++i) {
+        co_await eraseSector(i);
+        this->sectors[i] = {0, SectorState::EMPTY};
+    }
+    this->head = -1;
+    this->sequence = 0;
+
+    result = Result::OK;
+    this->stat = State::READY;
+}
+
+AwaitableCoroutine BufferLog::append(const void *data, int size, int &result) {
+    auto &buffer = this->buffer;
+    auto src = reinterpret_cast<const uint8_t *>(data);
+
+    // acquire semaphore
+    co_await this->semaphore.untilAcquired();
+    Semaphore::Guard guard(this->semaphore);
+
+    // check state
+    if (this->stat != State::READY) {
+        assert(false);
+        result = Result::NOT_READY;
+        co_return;
+    }
+
+    // check size
+    if (size < 1 || size > this->maxSize) {
+        result = Result::WRITE_SIZE_EXCEEDED;
+        co_return;
+    }
+    this->stat = State::BUSY;
+
+    // open next sector if the record does not fit into the newest sector
+    int recordSize = align(RECORD_HEADER_SIZE + size, this->info.blockSize);
+    if (this->head < 0 || this->writeOffset + recordSize > this->info.sectorSize) {
+        co_await openSector();
+        if (this->head < 0) {
+            // something went wrong
+            result = Result::FATAL_ERROR;
+            this->stat = State::READY;
+            co_return;
+        }
+    }
+
+    // record header with checksum of size and data
+    uint8_t header[RECORD_HEADER_SIZE] = {uint8_t(size), uint8_t(size >> 8)};
+    uint16_t crc = BufferStorage::crc16(src, size, BufferStorage::crc16(header, 2));
+    header[2] = crc;
+    header[3] = crc >> 8;
+
+    // write header and data in chunks, the last chunk is padded to the block size
+    int offset = this->head * this->info.sectorSize + this->writeOffset;
+    int total = RECORD_HEADER_SIZE + size;
+    int position = 0;
+    while (position < total) {
+        int capacity = buffer.capacity() & ~(this->info.blockSize - 1);
+        int toWrite = std::min(total - position, capacity);
+        uint8_t *dst = buffer.data();
+        for (int i = position; i < position + toWrite; ++i) {
+            *dst++ = i < RECORD_HEADER_SIZE ? header[i] : src[i - RECORD_HEADER_SIZE];
+        }
+        int aligned = align(toWrite, this->info.blockSize);
+        std::fill(dst, buffer.data() + aligned, 0xff);
+
+        setOffset(offset + position, Command::WRITE);
+        co_await buffer.write(aligned);
+        position += toWrite;
+    }
+    this->writeOffset += recordSize;
+
+    result = size;
+    this->stat = State::READY;
+}
+
+AwaitableCoroutine BufferLog::readFrom(Cursor &cursor, void *data, int size, int &result) {
+    auto &buffer = this->buffer;
+    auto dst = reinterpret_cast<uint8_t *>(data);
+
+    // acquire semaphore
+    co_await this->semaphore.untilAcquired();
+    Semaphore::Guard guard(this->semaphore);
+
+    // check state
+    if (this->stat != State::READY) {
+        assert(false);
+        result = Result::NOT_READY;
+        co_return;
+    }
+    this->stat = State::BUSY;
+
+    result = 0;
+    uint32_t sequence = cursor >> 32;
+    int offset = std::max(int(cursor & 0xffffffff), this->headerSize);
+    while (true) {
+        // find sector of the cursor or the next sector if the records at the cursor were dropped
+        int index = findSector(sequence);
+        if (index < 0)
+            break;
+        if (this->sectors[index].sequence != sequence) {
+            sequence = this->sectors[index].sequence;
+            offset = this->headerSize;
+        }
+        int sectorOffset = index * this->info.sectorSize;
+
+        // check for end of records
+        if (index == this->head && offset >= this->writeOffset) {
+            cursor = (Cursor(sequence) << 32) | offset;
+            break;
+        }
+        int recordSize = 0;
+        if (offset + RECORD_HEADER_SIZE <= this->info.sectorSize) {
+            setOffset(sectorOffset + offset, Command::READ);
+            co_await buffer.read(RECORD_HEADER_SIZE);
+            if (buffer.size() < RECORD_HEADER_SIZE) {
+                // something went wrong
+                result = Result::FATAL_ERROR;
+                break;
+            }
+            recordSize = buffer[0] | (buffer[1] << 8);
+        }
+        int total = RECORD_HEADER_SIZE + recordSize;
+        if (recordSize == 0 || recordSize == RECORD_END || offset + total > this->info.sectorSize) {
+            // end of sector (or invalid size which means that writing the record was interrupted): continue with the
+            // next sector
+            ++sequence;
+            offset = this->headerSize;
+            continue;
+        }
+        uint16_t crc = buffer[2] | (buffer[3] << 8);
+
+        // read data in chunks and calculate checksum
+        uint16_t c = BufferStorage::crc16(buffer.data(), 2);
+        int position = 0;
+        while (position < recordSize) {
+            int toRead = std::min(recordSize - position, buffer.capacity());
+            setOffset(sectorOffset + offset + RECORD_HEADER_SIZE + position, Command::READ);
+            co_await buffer.read(toRead);
+            if (buffer.size() < toRead) {
+                // something went wrong
+                result = Result::FATAL_ERROR;
+                this->stat = State::READY;
+                co_return;
+            }
+            c = BufferStorage::crc16(buffer.data(), toRead, c);
+            if (position < size)
+                std::copy(buffer.data(), buffer.data() + std::min(toRead, size - position), dst + position);
+            position += toRead;
+        }
+
+        // advance cursor to the next record
+        cursor = (Cursor(sequence) << 32) | (offset + align(total, this->info.blockSize));
+        result = c == crc ? recordSize : int(Result::CHECKSUM_ERROR);
+        break;
+    }
+
+    this->stat = State::READY;
+}
+
+AwaitableCoroutine BufferLog::truncateBefore(Cursor cursor, int &result) {
+    // acquire semaphore
+    co_await this->semaphore.untilAcquired();
+    Semaphore::Guard guard(this->semaphore);
+
+    // check state
+    if (this->stat != State::READY) {
+        assert(false);
+        result = Result::NOT_READY;
+        co_return;
+    }
+    this->stat = State::BUSY;
+
+    // erase all sectors that are older than the sector of the cursor, but not the newest sector
+    uint32_t sequence = cursor >> 32;
+    result = 0;
+    for (int i = 0; i < this->info.sectorCount; ++i) {
+        auto &sector = this->sectors[i];
+        if (sector.state == SectorState::USED && sector.sequence < sequence && i != this->head) {
+            co_await eraseSector(i);
+            sector.state = SectorState::EMPTY;
+            ++result;
+        }
+    }
+
+    this->stat = State::READY;
+}
+
+BufferLog::Cursor BufferLog::begin() {
+    int index = findSector(0);
+    if (index < 0)
+        return end();
+    return (Cursor(this->sectors[index].sequence) << 32) | this->headerSize;
+}
+
+BufferLog::Cursor BufferLog::end() {
+    if (this->head < 0)
+        return Cursor(this->sequence) << 32;
+    return (Cursor(this->sectors[this->head].sequence) << 32) | this->writeOffset;
+}
+
+void BufferLog::setOffset(uint32_t offset, Command command) {
+    offset += this->info.address;
+    switch (this->info.type) {
+    case Type::MEM_4N:
+    case Type::FLASH_4N:
+        this->buffer.header<uint32_t>() = offset;
+        break;
+    case Type::MEM_1C2B:
+    case Type::FLASH_1C2B:
+        {
+            uint8_t *header = this->buffer.headerData();
+            header[0] = this->info.commands[int(command)];
+            header[1] = offset >> 8;
+            header[2] = offset;
+        }
+        break;
+    }
+}
+
+int BufferLog::findSector(uint32_t sequence) {
+    int index = -1;
+    for (int i = 0; i < this->info.sectorCount; ++i) {
+        auto &sector = this->sectors[i];
+        if (sector.state == SectorState::USED && sector.sequence >= sequence
+            && (index == -1 || sector.sequence < this->sectors[index].sequence))
+        {
+            index = i;
+        }
+    }
+    return index;
+}
+
+AwaitableCoroutine BufferLog::detectEnd(int &writeOffset) {
+    auto &buffer = this->buffer;
+    int sectorOffset = this->head * this->info.sectorSize;
+
+    // follow the records until the record header is erased
+    int offset = this->headerSize;
+    while (offset + RECORD_HEADER_SIZE <= this->info.sectorSize) {
+        // read the first block of the record
+        int toRead = std::min(align(RECORD_HEADER_SIZE, this->info.blockSize), this->info.sectorSize - offset);
+        setOffset(sectorOffset + offset, Command::READ);
+        co_await buffer.read(toRead);
+        if (buffer.size() < toRead)
+            break;
+        int recordSize = buffer[0] | (buffer[1] << 8);
+        if (recordSize == RECORD_END) {
+            // end of records if the whole block is erased, otherwise writing of the record was interrupted and the
+            // sector can't be used for appending
+            bool erased = true;
+            for (int i = 0; i < toRead; ++i) {
+                if (buffer[i] != 0xff)
+                    erased = false;
+            }
+            writeOffset = erased ? offset : this->info.sectorSize;
+            co_return;
+        }
+        int total = align(RECORD_HEADER_SIZE + recordSize, this->info.blockSize);
+        if (recordSize == 0 || offset + total > this->info.sectorSize)
+            break;
+        offset += total;
+    }
+
+    // sector is full or contains an invalid record
+    writeOffset = this->info.sectorSize;
+}
+
+AwaitableCoroutine BufferLog::openSector() {
+    auto &buffer = this->buffer;
+
+    // use the next sector in ring order, drop its records if it contains the oldest records
+    int index = this->head < 0 ? 0 : (this->head + 1) % this->info.sectorCount;
+    if (this->sectors[index].state != SectorState::EMPTY)
+        co_await eraseSector(index);
+
+    // write sector header
+    uint32_t sequence = this->sequence;
+    uint8_t *h = buffer.data();
+    h[0] = sequence;
+    h[1] = sequence >> 8;
+    h[2] = sequence >> 16;
+    h[3] = sequence >> 24;
+    h[4] = SECTOR_MAGIC[0];
+    h[5] = SECTOR_MAGIC[1];
+    uint16_t crc = BufferStorage::crc16(h, 6);
+    h[6] = crc;
+    h[7] = crc >> 8;
+    std::fill(h + SECTOR_HEADER_SIZE, h + this->headerSize, 0xff);
+    setOffset(index * this->info.sectorSize, Command::WRITE);
+    co_await buffer.write(this->headerSize);
+
+    this->sectors[index] = {sequence, SectorState::USED};
+    ++this->sequence;
+    this->head = index;
+    this->writeOffset = this->headerSize;
+}
+
+AwaitableCoroutine BufferLog::eraseSector(int index) {
+    auto &buffer = this->buffer;
+    int sectorOffset = index * this->info.sectorSize;
+
+    if (this->info.type < Type::FLASH_4N) {
+        // generic memory: explicitly fill with 0xff
+        int s = this->info.sectorSize;
+        int offset = sectorOffset;
+        while (s > 0) {
+            int capacity = buffer.capacity() & ~(this->info.blockSize - 1);
+            int toWrite = std::min(s, capacity);
+
+            std::fill(buffer.data(), buffer.data() + capacity, 0xff);
+            setOffset(offset, Command::WRITE);
+            co_await buffer.write(toWrite);
+            offset += toWrite;
+            s -= toWrite;
+        }
+    } else {
+        // flash: use page erase
+        for (int offset = 0; offset < this->info.sectorSize; offset += this->info.pageSize) {
+            setOffset(sectorOffset + offset, Command::ERASE);
+            co_await buffer.erase();
+        }
+    }
+}
+
+} // namespace coco
@@ -0,0 +1,137 @@
+#pragma once
+
+#include "BufferStorage.hpp"
+
+
+namespace coco {
+
+/// @brief Append-only log of records working on a buffer with address header such as internal or external flash, e.g.
+/// for high-rate event logging. The records are packed densely into a ring of sectors, each record has a checksum.
+/// When all sectors are full, the oldest sector gets erased and its records are dropped, nothing gets copied. Uses the
+/// same memory info and buffer as BufferStorage but needs its own sectors (e.g. behind the sectors of a storage).
+/// Multiple coroutines can use it at the same time, a semaphore makes sure that only one operation is done at a time.
+class BufferLog {
+public:
+    using Info = BufferStorage::Info;
+    using Type = BufferStorage::Type;
+    using Command = BufferStorage::Command;
+    using State = Storage::State;
+    using Result = Storage::Result;
+
+    /// Position of a record in the log, sequence number of the sector in the upper and offset in the sector in the lower
+    /// 32 bits. Cursors of newer records are larger
+    using Cursor = uint64_t;
+
+    /// @brief Constructor.
+    /// @param info Memory info, wideEntries is ignored and mapped is not used
+    /// @param buffer Buffer to operate on. Header capacity must match the memory type.
+    BufferLog(const Info &info, Buffer &buffer);
+
+    ~BufferLog();
+
+    /// @brief Current state of the log.
+    ///
+    const State &state() {return this->stat;}
+
+    /// @brief Mount the log and find the end of the newest sector where new records get appended.
+    /// @param result result, see Storage::Result
+    /// @return use co_await on return value to await completion
+    [[nodiscard]] AwaitableCoroutine mount(int &result);
+
+    /// @brief Remove all records. Calling mount() is not necessary after clear.
+    /// @param result result, see Storage::Result
+    /// @return use co_await on return value to await completion
+    [[nodiscard]] AwaitableCoroutine clear(int &result);
+
+    /// @brief Append a record to the log. If the newest sector is full, the next sector gets opened and if it contains
+    /// the oldest records, they get dropped.
+    /// @param data data of the record
+    /// @param size size of the record, 1 to maxRecordSize()
+    /// @param result size of the record or negative on error (see Storage::Result)
+    /// @return use co_await on return value to await completion
+    [[nodiscard]] AwaitableCoroutine append(const void *data, int size, int &result);
+
+    /// @brief Read the record at the cursor or the oldest record if the records at the cursor were dropped, then
+    /// advance the cursor to the next record.
+    /// @param cursor position of the record to read, e.g. begin() for the oldest record
+    /// @param data data to read into
+    /// @param size number of bytes to read
+    /// @param result size of the record (only up to size bytes are read), 0 if there are no more records or negative on
+    /// error (see Storage::Result). The cursor gets advanced on CHECKSUM_ERROR so that reading can continue
+    /// @return use co_await on return value to await completion
+    [[nodiscard]] AwaitableCoroutine readFrom(Cursor &cursor, void *data, int size, int &result);
+
+    /// @brief Remove the records before the cursor, e.g. after they were transmitted. Only whole sectors get erased,
+    /// therefore records in the sector of the cursor are kept.
+    /// @param cursor position of the oldest record that has to be kept
+    /// @param result number of erased sectors or negative on error (see Storage::Result)
+    /// @return use co_await on return value to await completion
+    [[nodiscard]] AwaitableCoroutine truncateBefore(Cursor cursor, int &result);
+
+    /// @brief Get the position of the oldest record.
+    /// @return cursor of oldest record, equal to end() if the log is empty
+    Cursor begin();
+
+    /// @brief Get the position behind the newest record where the next record gets appended.
+    /// @return cursor behind newest record
+    Cursor end();
+
+    /// @brief Get the maximum size of a record that fits into a sector.
+    /// @return maximum record size
+    int maxRecordSize() {return this->maxSize;}
+
+protected:
+    enum SectorState : uint8_t {
+        // erased sector
+        EMPTY,
+
+        // sector that has to be erased before it can be used (e.g. partially erased)
+        DIRTY,
+
+        // sector that contains records
+        USED
+    };
+
+    // state of a sector
+    struct Sector {
+        // sequence number of the sector, stored in the sector header
+        uint32_t sequence;
+
+        SectorState state;
+    };
+
+    // set offset and command in the header of the buffer
+    void setOffset(uint32_t offset, Command command);
+
+    // find the sector with the smallest sequence number that is at least the given sequence number
+    int findSector(uint32_t sequence);
+
+    // find the end of the records in the newest sector
+    AwaitableCoroutine detectEnd(int &writeOffset);
+
+    // open the next sector in ring order, erases the sector if necessary
+    AwaitableCoroutine openSector();
+
+    // erase a sector
+    AwaitableCoroutine eraseSector(int index);
+
+
+    Info info;
+    Buffer &buffer;
+    Semaphore semaphore;
+    State stat = State::NOT_MOUNTED;
+
+    // aligned size of the sector header and maximum size of a record
+    int headerSize;
+    int maxSize;
+
+    // state of the sectors
+    Sector *sectors;
+
+    // newest sector (-1 if all sectors are empty), write offset in the newest sector and next sequence number
+    int head = -1;
+    int writeOffset;
+    uint32_t sequence = 0;
+};
+
+} // namespace coco
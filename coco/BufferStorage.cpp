@@ -2,6 +2,7 @@
 #include <coco/align.hpp>
 #include <coco/bits.hpp>
 #include <coco/debug.hpp>
+#include <bit>
 
 
 // todo: check if an entry has the same content when writing
@@ -12,22 +13,309 @@ namespace coco {
 constexpr int SMALL_SIZE = 3;
 constexpr int SMALL_FLAG = 0x80;
 
+// kind of small entries, stored in bits 5 and 6 of the size byte
+constexpr int SMALL_KIND_MASK = 0x60;
+constexpr int SMALL_DATA = 0x60;
+constexpr int SMALL_RANGE = 0x20;
+constexpr int SMALL_HEADER = 0x00;
+
+// id that gets added to the bloom filter of a sector that contains range entries (not a valid id of an element)
+constexpr int RANGE_FILTER_ID = 0x10000;
+
+// maximum size of data of entries that are not small
+constexpr int SIZE_MASK = 0xffff;
+constexpr int WIDE_SIZE_MASK = 0x7fffffff; // wide entry format with 16 more bits in sizeHigh
+
+// kind of data of entries that are not small, the tag of the kind gets xored onto the checksum so that the size field
+// keeps all 16 bits and entries of kind PLAIN are the same as entries that were written before kinds were introduced.
+// The checksum of an entry matches the tag of exactly one kind
+constexpr uint16_t KIND_TAGS[] = {0x0000, 0x5555, 0xaaaa, 0xffff};
+enum Kind {
+    // data is stored as is
+    PLAIN = 0,
+
+    // data is run length compressed and starts with the uncompressed size (COMPRESSED_HEADER_SIZE bytes)
+    COMPRESSED = 1,
+
+    // data is a patch of an older element and starts with the offset in the element (PATCH_HEADER_SIZE bytes)
+    PATCH = 2,
+
+    // data is a counter, starts with the base value (COUNTER_BASE_SIZE bytes aligned to block size) followed by a run
+    // of blocks that get programmed one by one on each increment, or whose bits get cleared one by one starting at the
+    // lowest bit of the first byte on generic memory
+    COUNTER = 3
+};
+
+// kind of a close entry whose sector has all entries sorted by id so that they can be searched using binary search
+constexpr int SORTED = 1;
+
+// header of compressed data
+constexpr int COMPRESSED_HEADER_SIZE = 2;
+
+// header of patch data
+constexpr int PATCH_HEADER_SIZE = 2;
+
+// markers for requests of readMany() that are not resolved yet or need to be read separately because of patches
+constexpr int PENDING = -0x10000;
+constexpr int PATCHED = -0x10001;
+
+// size of chunks when folding an element and its patches
+constexpr int FOLD_CHUNK_SIZE = 64;
+
+// size of base value of counters
+constexpr int COUNTER_BASE_SIZE = 4;
+
+// maximum number of blocks in the run of a counter
+constexpr int MAX_COUNTER_RUN_LENGTH = 64;
+
+// minimum size of bloom filter of the ids in a sector
+constexpr int MIN_FILTER_SIZE = 16;
+
+// multipliers for the hash functions of the bloom filter
+constexpr uint32_t FILTER_HASHES[] = {0x9e3779b1, 0x85ebca77, 0xc2b2ae3d};
+
+// sequence number in the close entries of sectors that were closed before sequence numbers were introduced
+constexpr int LEGACY_SEQUENCE = 0xffff;
+
+// maximum age of the oldest sector (difference of sequence numbers) in GREEDY mode, the oldest sector gets reclaimed
+// when it is reached so that the sequence numbers stay comparable and static data moves from time to time
+constexpr int MAX_SEQUENCE_AGE = 0x4000;
+
+/*
+    Snapshot of exportAll() and importAll(), all numbers are little endian
+    Header: magic (4 bytes)
+    Record for each element: id (2 bytes), kind (2 bytes), size (4 bytes), data (size bytes), CRC-16 of the record (2 bytes)
+    End record: id 0, kind SNAPSHOT_END, number of element records as size, CRC-16 of the record (2 bytes)
+*/
+constexpr uint8_t SNAPSHOT_MAGIC[] = {'C', 'S', 'S', 1};
+constexpr int SNAPSHOT_RECORD_SIZE = 8;
+constexpr int SNAPSHOT_CRC_SIZE = 2;
+constexpr int SNAPSHOT_END = 0xffff;
+
+
+/*
+    Run length encoder and decoder (PackBits, https://en.wikipedia.org/wiki/PackBits)
+    Control byte n in range 0 to 127: n + 1 literal bytes follow
+    Control byte n in range 129 to 255: next byte is repeated 257 - n times
+*/
+
+// encoder that can be called repeatedly to encode into chunks of a buffer
+class PackBitsEncoder {
+public:
+    PackBitsEncoder(const uint8_t *data, int size) : it(data), end(data + size) {}
+
+    // encode into dst, returns number of bytes written (or that would be written if dst is nullptr)
+    int encode(uint8_t *dst, int capacity) {
+        int n = 0;
+        while (n < capacity) {
+            if (this->tokenPos >= this->tokenSize) {
+                // next token
+                if (this->it >= this->end)
+                    break;
+                nextToken();
+            }
+            int toCopy = std::min(this->tokenSize - this->tokenPos, capacity - n);
+            if (dst != nullptr) {
+                for (int i = 0; i < toCopy; ++i) {
+                    int pos = this->tokenPos + i;
+                    dst[n + i] = pos == 0 ? this->control : this->token[pos - 1];
+                }
+            }
+            this->tokenPos += toCopy;
+            n += toCopy;
+        }
+        return n;
+    }
+
+protected:
+    // get length of run at given position, up to 128
+    int run(const uint8_t *p) {
+        int max = std::min(int(this->end - p), 128);
+        int i = 1;
+        while (i < max && p[i] == p[0])
+            ++i;
+        return i;
+    }
+
+    void nextToken() {
+        this->token = this->it;
+        this->tokenPos = 0;
+        int r = run(this->it);
+        if (r >= 3) {
+            // repeated byte
+            this->control = 257 - r;
+            this->tokenSize = 2;
+            this->it += r;
+        } else {
+            // literal bytes up to next run of at least 3 bytes
+            auto p = this->it + r;
+            while (p < this->end && p - this->it < 128 && run(p) < 3)
+                ++p;
+            int count = std::min(int(p - this->it), 128);
+            this->control = count - 1;
+            this->tokenSize = 1 + count;
+            this->it += count;
+        }
+    }
+
+    const uint8_t *it;
+    const uint8_t *end;
+
+    // current token (control byte followed by literal bytes or the repeated byte)
+    uint8_t control;
+    const uint8_t *token;
+    int tokenSize = 0;
+    int tokenPos = 0;
+};
+
+// decoder that can be called repeatedly with chunks of encoded data
+class PackBitsDecoder {
+public:
+    PackBitsDecoder(uint8_t *data, int size) : it(data), end(data + size) {}
+
+    // set destination, decoding continues where the last call to decode() stopped
+    void setDestination(uint8_t *data, int size) {
+        this->it = data;
+        this->end = data + size;
+    }
+
+    // check if the destination is full
+    bool full() {return this->it >= this->end;}
+
+    // decode a chunk of data until the destination is full, returns the number of bytes consumed from src
+    int decode(const uint8_t *src, int size) {
+        int i = 0;
+        while (this->it < this->end) {
+            if (this->count == 0) {
+                // control byte
+                if (i >= size)
+                    break;
+                uint8_t b = src[i++];
+                if (b < 128) {
+                    this->count = b + 1;
+                    this->state = LITERAL;
+                } else if (b > 128) {
+                    this->count = 257 - b;
+                    this->state = REPEAT_VALUE;
+                }
+            } else if (this->state == REPEAT_VALUE) {
+                // value to repeat
+                if (i >= size)
+                    break;
+                this->value = src[i++];
+                this->state = REPEAT;
+            } else if (this->state == REPEAT) {
+                int toFill = std::min(this->count, int(this->end - this->it));
+                std::fill(this->it, this->it + toFill, this->value);
+                this->it += toFill;
+                this->count -= toFill;
+            } else {
+                // literal
+                if (i >= size)
+                    break;
+                *this->it++ = src[i++];
+                --this->count;
+            }
+        }
+        return i;
+    }
+
+protected:
+    enum State : uint8_t {
+        LITERAL,
+        REPEAT_VALUE,
+        REPEAT
+    };
+
+    uint8_t *it;
+    uint8_t *end;
+
+    // remaining number of literal bytes or repeat count
+    int count = 0;
+    State state;
+    uint8_t value;
+};
+
+
 BufferStorage::BufferStorage(const Info &info, Buffer &buffer)
-    : info(info), buffer(buffer), semaphore(1)
+    : BufferStorage(info, buffer, Options{})
+{
+}
+
+BufferStorage::BufferStorage(const Info &info, Buffer &buffer, const Options &options)
+    : BufferStorage(info, buffer, options, nullptr, options.frameCount, nullptr)
+{
+}
+
+BufferStorage::BufferStorage(const Info &info, Buffer &buffer, const Options &options, Sector *sectors,
+    int frameCount, uint8_t *frames)
+    : info(info), buffer(buffer), compression(options.compression), gcMode(options.gcMode),
+    spareCount(options.spareCount), semaphore(1)
 {
     assert(info.blockSize >= 1 && firstBit(info.blockSize) == info.blockSize);
     assert(info.pageSize >= 1 && firstBit(info.pageSize) == info.pageSize);
-    assert(info.sectorSize >= 1 && info.sectorSize % info.pageSize == 0 && info.sectorSize <= 32768 * info.blockSize);
-    assert(info.sectorCount >= 2);
+    assert(info.sectorSize >= 1 && info.sectorSize % info.pageSize == 0
+        && (info.wideEntries || info.sectorSize <= 32768 * info.blockSize));
+    assert(options.spareCount >= 1 && info.sectorCount >= (options.hotCold ? 2 : 1) + options.spareCount);
 
     // align size of allocation table entry to flash block size
-    this->entrySize = int(sizeof(Entry) + info.blockSize - 1) & ~(info.blockSize - 1);
+    this->rawEntrySize = info.wideEntries ? 12 : 8;
+    this->entrySize = (this->rawEntrySize + info.blockSize - 1) & ~(info.blockSize - 1);
+
+    // small entries store inline data also in the padding of the entry (or sizeHigh and offsetHigh)
+    this->smallSize = std::min(SMALL_SIZE + this->entrySize - 8, MAX_SMALL_SIZE);
+    this->rawEntrySize = std::max(this->rawEntrySize, 8 + this->smallSize - SMALL_SIZE);
+    assert(buffer.capacity() >= int(sizeof(Entry)));
 
     // calc offset shift
     this->offsetShift = 0;
     for (int i = 1; i < info.blockSize; i <<= 1)
         ++this->offsetShift;
 
+    // one head for all elements or two heads for hot and cold elements, then each sector starts with a header entry
+    this->headCount = options.hotCold ? 2 : 1;
+    this->firstEntryOffset = options.hotCold ? this->entrySize * 2 : this->entrySize;
+
+    // size of bloom filter (power of two), one byte for each 128 bytes of sector size
+    this->filterSize = MIN_FILTER_SIZE;
+    while (this->filterSize < MAX_FILTER_SIZE && this->filterSize * 128 < info.sectorSize
+        && this->filterSize * 2 <= buffer.capacity())
+    {
+        this->filterSize <<= 1;
+    }
+    this->filterShift = 32 - 3;
+    for (int i = 1; i < this->filterSize; i <<= 1)
+        --this->filterShift;
+
+    // heads get opened by mount()
+    for (auto &head : this->heads) {
+        head.sectorIndex = -1;
+        std::fill(head.filter, head.filter + this->filterSize, 0);
+    }
+    rotateRecentFilters();
+    rotateRecentFilters();
+
+    // number of blocks in the run of a counter, a counter should occupy at most 1/8 of a sector
+    this->counterRunLength = std::max(std::min(MAX_COUNTER_RUN_LENGTH,
+        (info.sectorSize / 8 - align(COUNTER_BASE_SIZE, info.blockSize)) >> this->offsetShift), 1);
+    this->counterBits = info.type == Type::MEM_4N || info.type == Type::MEM_1C2B;
+
+    // state of all sectors, gets detected by mount()
+    this->allocated = sectors == nullptr;
+    this->sectors = this->allocated ? new Sector[info.sectorCount] : sectors;
+    for (int i = 0; i < info.sectorCount; ++i) {
+        this->sectors[i] = {0, SectorState::EMPTY, 0};
+    }
+
+    // frame pool, all frames are free
+    this->frames = this->allocated && frameCount > 0 ? new uint8_t[frameCount * FRAME_SIZE] : frames;
+    this->freeFrames = nullptr;
+    for (int i = 0; i < frameCount; ++i) {
+        uint8_t *frame = this->frames + i * FRAME_SIZE;
+        *reinterpret_cast<uint8_t **>(frame) = this->freeFrames;
+        this->freeFrames = frame;
+    }
+
     // set header size of the buffer
     /*switch (info.type) {
     case Type::MEM_4N:
@@ -41,162 +329,361 @@ BufferStorage::BufferStorage(const Info &info, Buffer &buffer)
     }*/
 }
 
+BufferStorage::~BufferStorage() {
+    if (this->allocated) {
+        delete [] this->frames;
+        delete [] this->sectors;
+    }
+}
+
 const Storage::State &BufferStorage::state() {
     return this->stat;
 }
 
 AwaitableCoroutine BufferStorage::mount(int &result) {
+    return mount(POOL, result);
+}
+
+BufferStorage::PoolCoroutine BufferStorage::mount(Pool, int &result) {
+    trace(Operation::MOUNT, 0, 0);
+
+    // acquire semaphore
+    co_await this->semaphore.untilAcquired();
+    Semaphore::Guard guard(this->semaphore);
+
+    this->stat = State::BUSY;
+    co_await this->buffer.acquire();
+
+    // detect sectors and heads, then do the recovery
+    co_await detectSectors(result);
+    if (result == OK)
+        co_await recover(true, result);
+
+    commit();
+    this->stat = State::READY;
+}
+
+AwaitableCoroutine BufferStorage::mountLazy(int &result) {
+    return mountLazy(POOL, result);
+}
+
+BufferStorage::PoolCoroutine BufferStorage::mountLazy(Pool, int &result) {
+    trace(Operation::MOUNT_LAZY, 0, 0);
+
     // acquire semaphore
     co_await this->semaphore.untilAcquired();
     Semaphore::Guard guard(this->semaphore);
 
     this->stat = State::BUSY;
+    co_await this->buffer.acquire();
+
+    // detect sectors and heads, the storage is then ready for reading
+    co_await detectSectors(result);
+    if (result == OK)
+        recoverInBackground();
+
+    this->stat = State::READY;
+}
+
+BufferStorage::PoolCoroutine BufferStorage::detectSectors(int &result) {
     auto &buffer = this->buffer;
-    co_await buffer.acquire();
 
     /*
-        Cases for recovery of sector state
+        Recovery of sector state
         E = Empty
-         O = Open
-         C = Closed
-
-        Three sectors, first is head, last is tail but still empty
-         O E E
-         C E E (closed head)
-         C O E (new entry)
-
-        Three sectors, first is head, last is tail
-         O E C
-         C E C (closed head)
-         C O C (copied tail to empty sector)
-         C O E (erased tail)
-
-         Two sectors, first is head and tail, second is empty
-         O E
-         C E (closed head)
-         C O (copied tail to empty sector)
-         E O (erased tail)
+        O = Open
+        C = Closed (with sequence number)
+
+        The sectors are ordered by the sequence numbers in their close entries, the open sector is the newest
+
+        Typical case, one sector is open and there is an empty sector left for closing it
+         C0 C1 O2 E
+
+        Closed head, the next empty sector becomes the current sector
+         C0 C1 C2 E
+
+        Interrupted garbage collection, there is no empty sector left: garbage collect again. Entries that were
+        already copied are outdated in the reclaimed sector and don't get copied again
+         C0 C1 C2 O3
+
+        Interrupted erase, the erased part looks empty but is dirty and gets erased before it is used
+         D C1 C2 O3
+
+        Reclaimed sector that was not erased yet, it reappears as closed sector whose entries are all outdated and gets
+        reclaimed again
+         C0 C1 C2 O3 E
+
+        Sectors that were closed before sequence numbers were introduced all have sequence number 0xffff (L). They are
+        ordered by their position in the ring of sectors, the first one in front of the other sectors is the newest
+         L L O E
+         C0 L L O1 E
+
+        With hot/cold separation there are two open sectors, their sequence numbers and roles are stored in a header
+        entry behind the close entry
     */
 
-    // find the current sector
-    int lastI = this->info.sectorCount - 1;
-    SectorState lastState;
-    int head = 0;
-    bool foundEmpty = false;
-    auto foundState = SectorState::EMPTY;
-    for (int i = -1; i < this->info.sectorCount; ++i) {
-        // detect sector state
-        SectorState sectorState;
-        {
-            int sectorIndex = i == -1 ? lastI : i;
-            int sectorOffset = sectorIndex * this->info.sectorSize;
+    // the size of the live entries and data gets determined when it is needed
+    this->liveSize = -1;
 
-            // read close indicator at start of sector
-            setOffset(sectorOffset, Command::READ);
-            co_await buffer.read(sizeof(Entry));
-            if (buffer.size() < int(sizeof(Entry))) {
-                // something went wrong
-                result = Result::FATAL_ERROR;
-                this->stat = State::READY;
-                co_return;
-            }
-            if (buffer.value<Entry>().empty()) {
-                // sector is empty or open: read first data entry (second entry from start of sector)
-                setOffset(sectorOffset + this->entrySize, Command::READ);
-                co_await this->buffer.read(sizeof(Entry));
-                if (buffer.size() < int(sizeof(Entry))) {
-                    // something went wrong
-                    result = Result::FATAL_ERROR;
-                    this->stat = State::READY;
-                    co_return;
-                }
-                if (buffer.value<Entry>().empty()) {
-                    // sector is empty
-                    sectorState = SectorState::EMPTY;
-                } else {
-                    // sector is open
-                    sectorState = SectorState::OPEN;
-                }
-            } else {
-                // sector is closed
-                sectorState = SectorState::CLOSED;
-            }
+    // read state and sequence number of all sectors
+    int newest = -1;
+    int unclosed = -1;
+    int legacyCount = 0;
+    for (int i = 0; i < this->info.sectorCount; ++i) {
+        auto &sector = this->sectors[i];
+        int sectorOffset = i * this->info.sectorSize;
+        sector.liveSize = 0;
+        sector.legacy = false;
+
+        // read close entry at start of sector
+        setOffset(sectorOffset, Command::READ);
+        co_await buffer.read(this->rawEntrySize);
+        if (buffer.size() < this->rawEntrySize) {
+            // something went wrong
+            result = Result::FATAL_ERROR;
+            co_return;
         }
+        Entry entry = buffer.value<Entry>();
 
-        if (i >= 0) {
-            // if a non-empty sector is followed by an empty sector, the non-empty sector is head
-            if (lastState != SectorState::EMPTY && sectorState == SectorState::EMPTY) {
-                head = lastI;
-                foundEmpty = true;
-                foundState = lastState;
+        // read first entry behind the close entry (header entry if hot/cold separation is enabled)
+        setOffset(sectorOffset + this->entrySize, Command::READ);
+        co_await this->buffer.read(this->rawEntrySize);
+        if (buffer.size() < this->rawEntrySize) {
+            // something went wrong
+            result = Result::FATAL_ERROR;
+            co_return;
+        }
+        Entry first = buffer.value<Entry>();
+        bool header = isHeaderEntry(first);
+
+        if (isEmpty(entry)) {
+            if (isEmpty(first)) {
+                // sector is empty
+                sector.state = SectorState::EMPTY;
+                continue;
             }
 
-            // if a closed sector is followed by an open sector, the closed sector is head
-            if (!foundEmpty && lastState == SectorState::CLOSED && sectorState == SectorState::OPEN) {
-                head = lastI;
-                foundState = lastState;
+            // sector is open, the sequence number is known if there is a header entry
+            sector.state = SectorState::OPEN;
+            if (!header)
+                continue;
+            sector.sequence = first.id;
+        } else {
+            // sector is closed
+            sector.state = SectorState::CLOSED;
+            sector.lastEntry = LAST_ENTRY_UNKNOWN;
+            if (isCloseEntryValid(entry)) {
+                sector.sequence = entry.id;
+                sector.legacy = entry.id == LEGACY_SEQUENCE;
+                if (sector.legacy)
+                    ++legacyCount;
+                setLastEntry(sector, getOffset(entry), getSize(entry), getKind(entry) == SORTED);
+            } else if (header) {
+                // writing of close entry was interrupted, the header entry has the sequence number
+                sector.sequence = first.id;
+            } else {
+                // writing of close entry was interrupted
+                unclosed = i;
+                continue;
             }
-            lastI = i;
         }
-        lastState = sectorState;
+        if (newest == -1 || isNewer(i, newest))
+            newest = i;
     }
 
-    // make sure the next sector is empty which is not the case when copying of tail to empty sector was interrupted
-    int next = head + 1 == this->info.sectorCount ? 0 : head + 1;
-    co_await eraseSector(next);
+    if (legacyCount >= 2) {
+        // several sectors were closed before sequence numbers were introduced: give them new sequence numbers in
+        // ring order, going backwards from a sector that is not one of them (all other sectors are newer)
+        int index = 0;
+        for (int i = 0; i < this->info.sectorCount; ++i) {
+            if (!this->sectors[i].legacy)
+                index = i;
+        }
+        int newestLegacy = -1;
+        uint16_t sequence = LEGACY_SEQUENCE;
+        for (int i = 1; i < this->info.sectorCount; ++i) {
+            int j = (index + this->info.sectorCount - i) % this->info.sectorCount;
+            auto &sector = this->sectors[j];
+            if (!sector.legacy)
+                continue;
+            if (newestLegacy == -1)
+                newestLegacy = j;
+            sector.sequence = sequence--;
+        }
+        if (newest >= 0 && this->sectors[newest].legacy)
+            newest = newestLegacy;
+    } else {
+        // a single sector with sequence number 0xffff can't be confused with other sectors
+        for (int i = 0; i < this->info.sectorCount; ++i) {
+            this->sectors[i].legacy = false;
+        }
+    }
 
+    // a closed sector without valid close entry and header entry is the newest closed sector
+    if (unclosed >= 0) {
+        this->sectors[unclosed].sequence = newest >= 0 ? this->sectors[newest].sequence + 1 : 0;
+        newest = unclosed;
+    }
+    this->sequence = newest >= 0 ? this->sectors[newest].sequence : 0xffff;
 
-    switch (foundState) {
-    case SectorState::EMPTY:
-        // this happens if the flash is empty, make sure the sector is really empty
-        //flash.eraseSectorBlocking(head);
-        this->sectorIndex = head;
-        this->sectorOffset = this->sectorIndex * this->info.sectorSize;
+    // assign open sectors to the heads
+    for (auto &head : this->heads) {
+        head.sectorIndex = -1;
+    }
+    rotateRecentFilters();
+    rotateRecentFilters();
+    for (int i = 0; i < this->info.sectorCount; ++i) {
+        if (this->sectors[i].state != SectorState::OPEN)
+            continue;
+        int sectorOffset = i * this->info.sectorSize;
+
+        // get role from header entry
+        setOffset(sectorOffset + this->entrySize, Command::READ);
+        co_await buffer.read(this->rawEntrySize);
+        if (buffer.size() < this->rawEntrySize) {
+            // something went wrong
+            result = Result::FATAL_ERROR;
+            co_return;
+        }
+        Entry first = buffer.value<Entry>();
+        int role = HOT;
+        if (isHeaderEntry(first)) {
+            role = first.small.data[0];
+        } else {
+            // open sector without header entry is the newest sector
+            this->sectors[i].sequence = ++this->sequence;
+            newest = i;
+        }
+        if (role >= this->headCount || this->heads[role].sectorIndex >= 0) {
+            // use a free head
+            role = -1;
+            for (int j = 0; j < this->headCount; ++j) {
+                if (this->heads[j].sectorIndex < 0) {
+                    role = j;
+                    break;
+                }
+            }
+        }
 
-        // set entry and data offsets
-        this->entryWriteOffset = this->entrySize;
-        this->dataWriteOffset = this->info.sectorSize;
-        break;
-    case SectorState::OPEN: {
-        // typical case where one sector is open for write
-        this->sectorIndex = head;
-        this->sectorOffset = this->sectorIndex * this->info.sectorSize;
+        if (role < 0) {
+            // no free head (e.g. hot/cold separation was disabled): close the sector
+            int lastEntryOffset;
+            int filterSize;
+            co_await getLastEntry(sectorOffset, lastEntryOffset, filterSize);
+            lastEntryOffset = std::max(lastEntryOffset, this->entrySize);
+            auto &entry = initEntry();
+            entry.id = this->sectors[i].sequence;
+            setSizeAndOffset(entry, 0, lastEntryOffset);
+            setChecksum(entry, PLAIN);
+            setOffset(sectorOffset, Command::WRITE);
+            co_await writeBuffer(this->rawEntrySize);
+            this->sectors[i].state = SectorState::CLOSED;
+            setLastEntry(this->sectors[i], lastEntryOffset, 0, false);
+            continue;
+        }
 
-        // set entry and data offsets
+        // set entry and data offsets and fill bloom filter
+        auto head = this->head = &this->heads[role];
+        head->sectorIndex = i;
+        head->sectorOffset = sectorOffset;
+        std::fill(head->filter, head->filter + this->filterSize, 0);
         std::pair<int, int> offsets;
-        co_await detectOffsets(head, offsets);
-        this->entryWriteOffset = offsets.first;
-        this->dataWriteOffset = offsets.second;
-        break;
+        co_await detectOffsets(i, offsets);
+        head->entryWriteOffset = offsets.first;
+        head->dataWriteOffset = offsets.second;
     }
-    case SectorState::CLOSED:
-        // we were interrupted in the garbage collection process
 
-        // go to next sector
-        this->sectorIndex = next;
-        this->sectorOffset = this->sectorIndex * this->info.sectorSize;
+    // the recovery checks the sectors and opens the missing heads
+    this->recoveryIndex = 0;
+    result = OK;
+}
+
+BufferStorage::PoolCoroutine BufferStorage::recover(bool all, int &result) {
+    result = OK;
+    do {
+        int index = this->recoveryIndex;
+        if (index < 0)
+            break;
+        if (index < this->info.sectorCount) {
+            auto &sector = this->sectors[index];
+            auto head = getHead(index);
+            if (sector.state == SectorState::OPEN && head != nullptr) {
+                // check if data of the head is actually empty and does not contain incomplete writes
+                co_await checkData(index, head->entryWriteOffset, head->dataWriteOffset);
+            } else if (sector.state == SectorState::EMPTY) {
+                // check if the sector is erased as erasing of a sector may have been interrupted, no erase here so
+                // that mount is fast
+                bool erased;
+                co_await checkErased(index, erased);
+                if (!erased)
+                    sector = {this->sequence, SectorState::DIRTY, 0};
+            }
+            this->recoveryIndex = index + 1;
+            continue;
+        }
 
-        // set entry and data offsets
-        this->entryWriteOffset = this->entrySize;
-        this->dataWriteOffset = this->info.sectorSize;
+        // open a new sector for heads without open sector, searching in ring order after the newest sector (cold
+        // head first so that the hot head is newer)
+        int newest = getNewestSector();
+        for (int role = this->headCount - 1; role >= 0; --role) {
+            auto head = this->head = &this->heads[role];
+            if (head->sectorIndex >= 0)
+                continue;
+            head->sectorIndex = newest;
+            co_await openSector();
+            if (head->sectorIndex < 0) {
+                // all sectors are closed which should not happen
+                result = Result::FATAL_ERROR;
+                co_return;
+            }
+        }
 
-        // garbage collect tail sector
-        co_await gc(next);
+        // make sure there are free sectors for closing a head (garbage collection may have been interrupted)
+        co_await gc();
+        this->recoveryIndex = -1;
+    } while (all);
+}
 
-        break;
+Coroutine BufferStorage::recoverInBackground() {
+    while (true) {
+        // acquire semaphore for each step so that reads can interleave
+        co_await this->semaphore.untilAcquired();
+        Semaphore::Guard guard(this->semaphore);
+
+        // check if recovery is complete (e.g. done by a write or a new mount)
+        if (this->recoveryIndex < 0 || this->stat != State::READY)
+            co_return;
+
+        this->stat = State::BUSY;
+        int result;
+        co_await recover(false, result);
+        this->stat = State::READY;
     }
-    result = OK;
-    this->stat = State::READY;
 }
 
 AwaitableCoroutine BufferStorage::clear(int &result) {
+    return clear(POOL, result);
+}
+
+BufferStorage::PoolCoroutine BufferStorage::clear(Pool, int &result) {
+    trace(Operation::CLEAR, 0, 0);
+
     // acquire semaphore
     co_await this->semaphore.untilAcquired();
     Semaphore::Guard guard(this->semaphore);
 
     this->stat = State::BUSY;
+    this->recoveryIndex = -1;
 
     co_await this->buffer.acquire();
+    co_await clearSectors();
+
+    commit();
+    result = OK;
+    this->stat = State::READY;
+}
+
+BufferStorage::PoolCoroutine BufferStorage::clearSectors() {
 //debug::set(debug::MAGENTA);
 
     // erase flash
@@ -206,16 +693,30 @@ AwaitableCoroutine BufferStorage::clear(int &result) {
 //debug::set(debug::CYAN);
 
     // initialize member variables
-    this->sectorIndex = 0;
-    this->sectorOffset = 0;
-    this->entryWriteOffset = this->entrySize;
-    this->dataWriteOffset = this->info.sectorSize;
-
-    result = OK;
-    this->stat = State::READY;
+    for (int i = 0; i < this->info.sectorCount; ++i) {
+        this->sectors[i] = {0, SectorState::EMPTY, 0};
+    }
+    this->sequence = 0xffff;
+    this->liveSize = 0;
+    this->liveProgrammedBytes = this->stats.programmedBytes - this->stats.copiedBytes;
+    rotateRecentFilters();
+    rotateRecentFilters();
+
+    // open the first sectors for the heads (cold head first so that the hot head is newer)
+    for (int role = this->headCount - 1; role >= 0; --role) {
+        this->head = &this->heads[role];
+        this->head->sectorIndex = -1;
+        co_await openSector();
+    }
 }
 
 AwaitableCoroutine BufferStorage::read(int id, void *data, int size, int &result) {
+    return read(POOL, id, data, size, result);
+}
+
+BufferStorage::PoolCoroutine BufferStorage::read(Pool, int id, void *data, int size, int &result) {
+    trace(Operation::READ, id, size);
+
     // acquire semaphore
     co_await this->semaphore.untilAcquired();
     Semaphore::Guard guard(this->semaphore);
@@ -241,93 +742,187 @@ AwaitableCoroutine BufferStorage::read(int id, void *data, int size, int &result
         co_return;
     }
     this->stat = State::BUSY;
+
+    // find element
+    Element element;
+    co_await findElement(id, element);
+    if (element.size < 0) {
+        // something went wrong
+        result = FATAL_ERROR;
+        this->stat = State::READY;
+        co_return;
+    }
+
+    // read data
+    co_await readData(element, dst, size, result);
+    this->stat = State::READY;
+}
+
+AwaitableCoroutine BufferStorage::readMany(std::span<ReadRequest> requests, int &result) {
+    return readMany(POOL, requests, result);
+}
+
+BufferStorage::PoolCoroutine BufferStorage::readMany(Pool, std::span<ReadRequest> requests, int &result) {
+    for (auto &request : requests)
+        trace(Operation::READ, request.id, request.size);
+
+    // acquire semaphore
+    co_await this->semaphore.untilAcquired();
+    Semaphore::Guard guard(this->semaphore);
+
+    // fill data with zeros and check ids
+    int pending = 0;
+    for (auto &request : requests) {
+        auto dst = reinterpret_cast<uint8_t *>(request.data);
+        std::fill(dst, dst + request.size, 0);
+        if (uint32_t(request.id) > 0xffff) {
+            assert(false);
+            request.result = INVALID_ID;
+        } else {
+            request.result = PENDING;
+            ++pending;
+        }
+    }
+
+    // check state
+    if (this->stat != State::READY) {
+        assert(false);
+        for (auto &request : requests)
+            request.result = NOT_READY;
+        result = NOT_READY;
+        co_return;
+    }
+    this->stat = State::BUSY;
     auto &buffer = this->buffer;
 
-    // get sector info (allocation table starts from front, data from back)
-    int sectorIndex = this->sectorIndex;
-    int sectorOffset = this->sectorOffset;
-    int entryOffset = this->entryWriteOffset - this->entrySize;
-    int dataOffset = this->info.sectorSize;
+    // iterate over sectors from newest to oldest until all requests are resolved
+    int sectorIndex = getNewestSector();
+    while (sectorIndex >= 0 && pending > 0) {
+        int sectorOffset = sectorIndex * this->info.sectorSize;
+        int dataOffset = this->info.sectorSize;
+
+        // get offset of last entry in allocation table and bloom filter of the sector
+        int entryOffset;
+        uint8_t filterData[MAX_FILTER_SIZE];
+        const uint8_t *filter = nullptr;
+        auto head = getHead(sectorIndex);
+        if (head != nullptr) {
+            // open sector
+            entryOffset = head->entryWriteOffset - this->entrySize;
+            filter = head->filter;
+        } else {
+            int filterSize;
+            co_await getLastEntry(sectorOffset, entryOffset, filterSize);
+            if (filterSize == this->filterSize && entryOffset > 0) {
+                // read bloom filter which is located behind the last entry
+                setOffset(sectorOffset + entryOffset + this->entrySize, Command::READ);
+                co_await buffer.read(filterSize);
+                if (buffer.size() >= filterSize) {
+                    std::copy(buffer.data(), buffer.data() + filterSize, filterData);
+                    filter = filterData;
+                }
+            }
+        }
+
+        // skip the sector if its bloom filter contains none of the pending ids
+        if (filter != nullptr) {
+            bool contains = false;
+            for (auto &request : requests) {
+                if (request.result == PENDING && mayContain(filter, request.id))
+                    contains = true;
+            }
+            if (!contains)
+                entryOffset = 0;
+        }
 
-    // iterate over sectors
-    int i = 0;
-    while (true) {
         // iterate over allocation table entries from last to first (newest to oldest)
-        while (entryOffset > 0) {
+        while (entryOffset > 0 && pending > 0) {
             // read entry
             setOffset(sectorOffset + entryOffset, Command::READ);
-            co_await buffer.read(sizeof(Entry));
-            if (buffer.size() < int(sizeof(Entry))) {
+            co_await buffer.read(this->rawEntrySize);
+            if (buffer.size() < this->rawEntrySize) {
                 // something went wrong
                 result = FATAL_ERROR;
                 this->stat = State::READY;
                 co_return;
             }
-            Entry &entry = buffer.value<Entry>();
+            Entry entry = buffer.value<Entry>();
 
-            // check if entry is valid
             if (isEntryValid(entryOffset, dataOffset, entry)) {
-                // check if found
-                if (entry.id == id) {
-                    // read data
-                    if ((entry.small.size & SMALL_FLAG) == 0) {
-                        // not a small entry
-                        int dataSize = entry.size;
-                        int s = std::min(size, dataSize);
-
-                        // calc offset in memory (offset of sector + offset of entry)
-                        int offset = sectorOffset + (entry.offset << this->offsetShift);
-                        while (s > 0) {
-                            int capacity = buffer.capacity() & ~(this->info.blockSize - 1);
-                            int toRead = std::min(s, capacity);
-
-                            setOffset(offset, Command::READ);
-                            co_await buffer.read(toRead);
-                            int read = buffer.size();
-                            if (read < toRead) {
-                                // something went wrong
-                                this->stat = State::READY;
-                                result = FATAL_ERROR;
-                                co_return;
-                            }
-                            std::copy(buffer.data(), buffer.data() + read, dst);
-                            offset += read;
-                            dst += read;
-                            s -= read;
-                        }
-                        result = dataSize;
+                // get element
+                Element element;
+                element.kind = PLAIN;
+                element.offset = -1;
+                element.patchCount = 0;
+                if ((entry.small.size & SMALL_FLAG) != 0) {
+                    // small entry with inline data
+                    element.size = getSmallSize(entry);
+                    copySmallData(entry, element.data);
+                } else {
+                    element.kind = getKind(entry);
+                    element.size = getSize(entry);
+                    element.offset = sectorOffset + getOffset(entry);
+                }
+
+                // resolve all pending requests for the element (the first entry that is seen is the newest)
+                for (size_t i = 0; i < requests.size(); ++i) {
+                    auto &request = requests[i];
+                    if (request.result != PENDING || request.id != entry.id)
+                        continue;
+                    --pending;
+                    if (element.kind == PATCH) {
+                        // element has patches: gets read separately
+                        request.result = PATCHED;
                     } else {
-                        // small entry with inline data
-                        int dataSize = entry.small.size & 3;
-                        int s = std::min(size, dataSize);
-                        std::copy(entry.small.data, entry.small.data + s, dst);
-                        result = dataSize;
+                        co_await readData(element, reinterpret_cast<uint8_t *>(request.data), request.size,
+                            request.result);
+                    }
+                }
+            } else if (isRangeEntry(entry)) {
+                // range entry: resolve all pending requests in the range as not found
+                for (auto &request : requests) {
+                    if (request.result == PENDING && rangeContains(entry, request.id)) {
+                        request.result = 0;
+                        --pending;
                     }
-                    this->stat = State::READY;
-                    co_return;
                 }
             }
             entryOffset -= this->entrySize;
         }
 
-        ++i;
-        if (i == this->info.sectorCount - 1)
-            break;
-
         // go to previous sector
-        sectorIndex = sectorIndex == 0 ? info.sectorCount - 1 : sectorIndex - 1;
-        sectorOffset = sectorIndex * this->info.sectorSize;
+        sectorIndex = getPreviousSector(sectorIndex);
+    }
 
-        // get offset of last entry in allocation table
-        co_await getLastEntry(sectorOffset, entryOffset);
+    for (size_t i = 0; i < requests.size(); ++i) {
+        auto &request = requests[i];
+        if (request.result == PENDING) {
+            // not found (which is ok)
+            request.result = 0;
+        } else if (request.result == PATCHED) {
+            // element with patches: find element and collect its patches
+            Element element;
+            co_await findElement(request.id, element);
+            if (element.size < 0) {
+                // something went wrong
+                request.result = FATAL_ERROR;
+                continue;
+            }
+            co_await readData(element, reinterpret_cast<uint8_t *>(request.data), request.size, request.result);
+        }
     }
 
-    // not found (which is ok)
+    result = OK;
     this->stat = State::READY;
-    result = 0;
 }
 
-AwaitableCoroutine BufferStorage::write(int id, const void *data, int size, int &result) {
+AwaitableCoroutine BufferStorage::exportAll(ExportStream &stream, int &result) {
+    return exportAll(POOL, stream, result);
+}
+
+BufferStorage::PoolCoroutine BufferStorage::exportAll(Pool, ExportStream &stream, int &result) {
+    trace(Operation::EXPORT, 0, 0);
+
     // acquire semaphore
     co_await this->semaphore.untilAcquired();
     Semaphore::Guard guard(this->semaphore);
@@ -338,450 +933,2994 @@ AwaitableCoroutine BufferStorage::write(int id, const void *data, int size, int
         result = NOT_READY;
         co_return;
     }
+    this->stat = State::BUSY;
+    auto &buffer = this->buffer;
 
-    // check id
-    if (uint32_t(id) > 0xffff) {
-        assert(false);
-        result = INVALID_ID;
-        co_return;
-    }
-
-    // check size, must fit into a sector which has at least two entries (one for the single entry and one for closing)
-    if (uint32_t(size) > uint32_t(this->info.sectorSize - this->entrySize * 2)) {
-        assert(false);
-        result = WRITE_SIZE_EXCEEDED;
+    // write header
+    co_await writeStream(stream, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC), result);
+    if (result != OK) {
+        this->stat = State::READY;
         co_return;
     }
-    this->stat = State::BUSY;
-    auto &buffer = this->buffer;
 
-    // check if entry exists and has same data
-    // todo
+    // get oldest sector
+    int sectorIndex = getNewestSector();
+    for (int i = sectorIndex; i >= 0; i = getPreviousSector(i))
+        sectorIndex = i;
 
-    // check if entry will fit
-    int gcCount = 0;
-    while (this->entryWriteOffset + this->entrySize + size > this->dataWriteOffset) {
-        // data does not fit, we need to start a new sector
+    // iterate over sectors from oldest to newest, dirty sectors contain no live entries
+    int count = 0;
+    for (; sectorIndex >= 0; sectorIndex = getNextSector(sectorIndex)) {
+        if (this->sectors[sectorIndex].state == SectorState::DIRTY)
+            continue;
+        int sectorOffset = sectorIndex * this->info.sectorSize;
 
-        // check if all sectors were already garbage collected which means we are out of memory
-        ++gcCount;
+        // get offset of last entry in allocation table
+        int lastEntryOffset;
+        auto head = getHead(sectorIndex);
+        if (head != nullptr) {
+            // open sector
+            lastEntryOffset = head->entryWriteOffset - this->entrySize;
+        } else {
+            int filterSize;
+            co_await getLastEntry(sectorOffset, lastEntryOffset, filterSize);
+            if (lastEntryOffset < 0) {
+                // something went wrong
+                result = FATAL_ERROR;
+                this->stat = State::READY;
+                co_return;
+            }
+        }
+
+        // iterate over all entries from first to last (oldest to newest)
+        int entryOffset = this->entrySize;
+        int dataOffset = this->info.sectorSize;
+        while (entryOffset <= lastEntryOffset) {
+            // read entry
+            setOffset(sectorOffset + entryOffset, Command::READ);
+            co_await buffer.read(this->rawEntrySize);
+            if (buffer.size() < this->rawEntrySize) {
+                // something went wrong
+                result = FATAL_ERROR;
+                this->stat = State::READY;
+                co_return;
+            }
+            Entry entry = buffer.value<Entry>();
+
+            if (isEntryValid(entryOffset, dataOffset, entry)) {
+                bool small = (entry.small.size & SMALL_FLAG) != 0;
+                int kind = small ? PLAIN : getKind(entry);
+                int size = small ? getSmallSize(entry) : getSize(entry);
+                if (!small) {
+                    // set new data offset
+                    dataOffset = getOffset(entry);
+                }
+
+                // patches get exported with their element, deleted elements are not exported
+                if (kind != PATCH && size > 0) {
+                    // check if the entry is outdated (there is a newer entry with same id) and collect its patches
+                    Element element;
+                    int newer;
+                    co_await findNewer(sectorIndex, entryOffset, dataOffset, entry.id, element, newer);
+                    if (newer < 0) {
+                        // something went wrong
+                        result = FATAL_ERROR;
+                        this->stat = State::READY;
+                        co_return;
+                    }
+                    if (newer == 0) {
+                        element.kind = kind;
+                        element.size = size;
+                        element.offset = small ? -1 : sectorOffset + dataOffset;
+                        if (small)
+                            copySmallData(entry, element.data);
+                        co_await exportElement(stream, entry.id, element, result);
+                        if (result != OK) {
+                            this->stat = State::READY;
+                            co_return;
+                        }
+                        ++count;
+                    }
+                }
+            }
+            entryOffset += this->entrySize;
+        }
+    }
+
+    // write end record with the number of elements
+    uint8_t record[SNAPSHOT_RECORD_SIZE + SNAPSHOT_CRC_SIZE] = {0, 0, uint8_t(SNAPSHOT_END), uint8_t(SNAPSHOT_END >> 8),
+        uint8_t(count), uint8_t(count >> 8), uint8_t(count >> 16), uint8_t(count >> 24)};
+    uint16_t crc = crc16(record, SNAPSHOT_RECORD_SIZE);
+    record[SNAPSHOT_RECORD_SIZE] = crc;
+    record[SNAPSHOT_RECORD_SIZE + 1] = crc >> 8;
+    co_await writeStream(stream, record, sizeof(record), result);
+    if (result == OK)
+        result = count;
+    this->stat = State::READY;
+}
+
+AwaitableCoroutine BufferStorage::importAll(ImportStream &stream, int &result) {
+    return importAll(POOL, stream, result);
+}
+
+BufferStorage::PoolCoroutine BufferStorage::importAll(Pool, ImportStream &stream, int &result) {
+    trace(Operation::IMPORT, 0, 0);
+
+    // acquire semaphore
+    co_await this->semaphore.untilAcquired();
+    Semaphore::Guard guard(this->semaphore);
+
+    auto state = this->stat;
+    this->stat = State::BUSY;
+    co_await this->buffer.acquire();
+
+    // check header before the storage gets cleared
+    uint8_t magic[sizeof(SNAPSHOT_MAGIC)];
+    co_await readStream(stream, magic, sizeof(magic), result);
+    if (result == OK && !std::equal(magic, magic + sizeof(magic), SNAPSHOT_MAGIC))
+        result = CHECKSUM_ERROR;
+    if (result != OK) {
+        this->stat = state;
+        co_return;
+    }
+
+    this->recoveryIndex = -1;
+    co_await clearSectors();
+
+    // pack the elements into the sectors of the cold head (the only head if hot/cold separation is not enabled)
+    this->head = &this->heads[this->headCount - 1];
+    int count = 0;
+    while (true) {
+        // read record header
+        uint8_t record[SNAPSHOT_RECORD_SIZE];
+        co_await readStream(stream, record, SNAPSHOT_RECORD_SIZE, result);
+        if (result != OK)
+            break;
+        uint16_t crc = crc16(record, SNAPSHOT_RECORD_SIZE);
+        int id = record[0] | (record[1] << 8);
+        int kind = record[2] | (record[3] << 8);
+        int size = record[4] | (record[5] << 8) | (record[6] << 16) | (record[7] << 24);
+
+        if (kind == SNAPSHOT_END) {
+            // end record: check checksum and number of elements
+            uint8_t c[SNAPSHOT_CRC_SIZE];
+            co_await readStream(stream, c, SNAPSHOT_CRC_SIZE, result);
+            if (result == OK)
+                result = (c[0] | (c[1] << 8)) == crc && size == count ? count : CHECKSUM_ERROR;
+            break;
+        }
+
+        co_await importElement(stream, id, kind, size, crc, result);
+        if (result != OK)
+            break;
+        ++count;
+    }
+
+    commit();
+    this->stat = State::READY;
+}
+
+BufferStorage::PoolCoroutine BufferStorage::exportElement(ExportStream &stream, int id, const Element &element,
+    int &result)
+{
+    auto &buffer = this->buffer;
+    int size = element.kind == COUNTER ? COUNTER_BASE_SIZE : element.size;
+
+    // write record header
+    uint8_t record[SNAPSHOT_RECORD_SIZE] = {uint8_t(id), uint8_t(id >> 8), uint8_t(element.kind), 0,
+        uint8_t(size), uint8_t(size >> 8), uint8_t(size >> 16), uint8_t(size >> 24)};
+    uint16_t crc = crc16(record, SNAPSHOT_RECORD_SIZE);
+    co_await writeStream(stream, record, SNAPSHOT_RECORD_SIZE, result);
+    if (result != OK)
+        co_return;
+
+    // write data
+    if (element.offset < 0) {
+        // small entry with inline data
+        crc = crc16(element.data, size, crc);
+        co_await writeStream(stream, element.data, size, result);
+    } else if (element.kind == COUNTER) {
+        // counter: value is base value plus number of programmed blocks
+        uint32_t value;
+        int count;
+        co_await readCounter(element, value, count);
+        if (count < 0) {
+            // something went wrong
+            result = FATAL_ERROR;
+            co_return;
+        }
+        value += count;
+        uint8_t data[COUNTER_BASE_SIZE] = {uint8_t(value), uint8_t(value >> 8), uint8_t(value >> 16),
+            uint8_t(value >> 24)};
+        crc = crc16(data, COUNTER_BASE_SIZE, crc);
+        co_await writeStream(stream, data, COUNTER_BASE_SIZE, result);
+    } else if (this->info.mapped && element.patchCount == 0) {
+        // memory mapped memory: write directly from memory (compressed data is exported as is)
+        auto src = getMapped(element.offset);
+        crc = crc16(src, size, crc);
+        co_await writeStream(stream, src, size, result);
+    } else {
+        // read data in chunks and apply the patches to each chunk, use a local chunk if the buffer is needed for the
+        // patches (compressed data is exported as is)
+        uint8_t chunk[FOLD_CHUNK_SIZE];
+        int chunkSize = element.patchCount > 0 ? std::min(buffer.capacity(), FOLD_CHUNK_SIZE)
+            : buffer.capacity() & ~(this->info.blockSize - 1);
+        int position = 0;
+        while (position < size) {
+            int toRead = std::min(size - position, chunkSize);
+            int end = position + toRead;
+
+            setOffset(element.offset + position, Command::READ);
+            co_await buffer.read(toRead);
+            if (buffer.size() < toRead) {
+                // something went wrong
+                result = FATAL_ERROR;
+                co_return;
+            }
+            const uint8_t *data = buffer.data();
+            if (element.patchCount > 0) {
+                std::copy(buffer.data(), buffer.data() + toRead, chunk);
+
+                // apply patches from oldest to newest
+                for (int i = element.patchCount - 1; i >= 0; --i) {
+                    auto &patch = element.patches[i];
+                    int start = std::max(position, patch.elementOffset);
+                    int s = std::min(end, patch.elementOffset + patch.size) - start;
+                    if (s > 0) {
+                        setOffset(patch.offset + (start - patch.elementOffset), Command::READ);
+                        co_await buffer.read(s);
+                        if (buffer.size() < s) {
+                            // something went wrong
+                            result = FATAL_ERROR;
+                            co_return;
+                        }
+                        std::copy(buffer.data(), buffer.data() + s, chunk + (start - position));
+                    }
+                }
+                data = chunk;
+            }
+            crc = crc16(data, toRead, crc);
+            co_await writeStream(stream, data, toRead, result);
+            if (result != OK)
+                co_return;
+            position = end;
+        }
+    }
+    if (result != OK)
+        co_return;
+
+    // write checksum
+    uint8_t c[SNAPSHOT_CRC_SIZE] = {uint8_t(crc), uint8_t(crc >> 8)};
+    co_await writeStream(stream, c, SNAPSHOT_CRC_SIZE, result);
+}
+
+BufferStorage::PoolCoroutine BufferStorage::importElement(ImportStream &stream, int id, int kind, int size,
+    uint16_t crc, int &result)
+{
+    auto &buffer = this->buffer;
+
+    // check record
+    int maxSize = std::min(this->info.sectorSize - this->firstEntryOffset - this->entrySize,
+        this->info.wideEntries ? WIDE_SIZE_MASK : SIZE_MASK);
+    if (uint32_t(id) > 0xffff || (kind != PLAIN && kind != COMPRESSED && kind != COUNTER)
+        || (kind == COMPRESSED && size < COMPRESSED_HEADER_SIZE) || (kind == COUNTER && size != COUNTER_BASE_SIZE))
+    {
+        result = CHECKSUM_ERROR;
+        co_return;
+    }
+    if (uint32_t(size) > uint32_t(maxSize)) {
+        result = WRITE_SIZE_EXCEEDED;
+        co_return;
+    }
+
+    // close the sector of the head if the element does not fit, the spare sectors stay free for garbage collection
+    int dataSize = kind == COUNTER ? getCounterSize()
+        : (kind != PLAIN || size > this->smallSize ? align(size, this->info.blockSize) : 0);
+    if (this->head->entryWriteOffset + this->entrySize + dataSize > this->head->dataWriteOffset) {
+        if (getFreeCount() <= this->spareCount) {
+            result = OUT_OF_MEMORY;
+            co_return;
+        }
+        co_await closeSector();
+    }
+
+    // read data, large data gets written to the head chunk by chunk
+    uint8_t data[MAX_SMALL_SIZE];
+    if (kind == COUNTER || dataSize == 0) {
+        co_await readStream(stream, data, size, result);
+        if (result != OK)
+            co_return;
+        crc = crc16(data, size, crc);
+    } else {
+        int offset = this->head->dataWriteOffset - dataSize;
+        this->head->dataWriteOffset = offset;
+        int position = 0;
+        while (position < size) {
+            int capacity = buffer.capacity() & ~(this->info.blockSize - 1);
+            int toWrite = std::min(size - position, capacity);
+
+            co_await readStream(stream, buffer.data(), toWrite, result);
+            if (result != OK)
+                co_return;
+            crc = crc16(buffer.data(), toWrite, crc);
+            setOffset(this->head->sectorOffset + offset + position, Command::WRITE);
+            co_await writeBuffer(toWrite);
+            position += toWrite;
+        }
+    }
+
+    // check checksum, the element only becomes visible when its entry is written
+    uint8_t c[SNAPSHOT_CRC_SIZE];
+    co_await readStream(stream, c, SNAPSHOT_CRC_SIZE, result);
+    if (result != OK)
+        co_return;
+    if ((c[0] | (c[1] << 8)) != crc) {
+        result = CHECKSUM_ERROR;
+        co_return;
+    }
+
+    // write entry
+    if (kind == COUNTER)
+        co_await writeCounter(id, data[0] | (data[1] << 8) | (data[2] << 16) | (uint32_t(data[3]) << 24));
+    else
+        co_await writeEntry(id, kind, size, data);
+
+    this->stats.writtenBytes += size;
+    result = OK;
+}
+
+BufferStorage::PoolCoroutine BufferStorage::writeStream(ExportStream &stream, const void *data, int size, int &result) {
+    int written;
+    co_await stream.write(data, size, written);
+    result = written == size ? OK : (written < 0 ? written : FATAL_ERROR);
+}
+
+BufferStorage::PoolCoroutine BufferStorage::readStream(ImportStream &stream, void *data, int size, int &result) {
+    int read;
+    co_await stream.read(data, size, read);
+    result = read == size ? OK : (read < 0 ? read : CHECKSUM_ERROR);
+}
+
+BufferStorage::PoolCoroutine BufferStorage::readData(const Element &element, uint8_t *dst, int size, int &result) {
+    auto &buffer = this->buffer;
+    int dataSize;
+    if (element.offset < 0) {
+        // small entry with inline data (or not found which is ok)
+        dataSize = element.size;
+        int s = std::min(size, dataSize);
+        std::copy(element.data, element.data + s, dst);
+    } else if (element.kind == COUNTER) {
+        // counter: value is base value plus number of programmed blocks
+        uint32_t value;
+        int count;
+        co_await readCounter(element, value, count);
+        if (count < 0) {
+            // something went wrong
+            result = FATAL_ERROR;
+            co_return;
+        }
+        value += count;
+        dataSize = COUNTER_BASE_SIZE;
+        int s = std::min(size, dataSize);
+        auto v = reinterpret_cast<const uint8_t *>(&value);
+        std::copy(v, v + s, dst);
+    } else if (element.kind == COMPRESSED && this->info.mapped) {
+        // compressed entry in memory mapped memory: decode directly from memory
+        auto src = getMapped(element.offset);
+        dataSize = src[0] | (src[1] << 8);
+        PackBitsDecoder decoder(dst, size);
+        decoder.decode(src + COMPRESSED_HEADER_SIZE, element.size - COMPRESSED_HEADER_SIZE);
+    } else if (element.kind == COMPRESSED) {
+        // compressed entry: read header and compressed data
+        int offset = element.offset;
+        dataSize = 0;
+        PackBitsDecoder decoder(dst, size);
+        int s = element.size;
+        bool first = true;
+        while (s > 0) {
+            int capacity = buffer.capacity() & ~(this->info.blockSize - 1);
+            int toRead = std::min(s, capacity);
+
+            setOffset(offset, Command::READ);
+            co_await buffer.read(toRead);
+            int read = buffer.size();
+            if (read < toRead) {
+                // something went wrong
+                result = FATAL_ERROR;
+                co_return;
+            }
+            int i = 0;
+            if (first) {
+                // get uncompressed size from header
+                dataSize = buffer[0] | (buffer[1] << 8);
+                i = COMPRESSED_HEADER_SIZE;
+                first = false;
+            }
+            decoder.decode(buffer.data() + i, read - i);
+            if (decoder.full()) {
+                // destination is full
+                break;
+            }
+            offset += read;
+            s -= read;
+        }
+    } else if (this->info.mapped) {
+        // not a small entry in memory mapped memory: copy directly into the destination
+        dataSize = element.size;
+        int s = std::min(size, dataSize);
+        auto src = getMapped(element.offset);
+        std::copy(src, src + s, dst);
+    } else {
+        // not a small entry
+        dataSize = element.size;
+        int s = std::min(size, dataSize);
+        int offset = element.offset;
+        uint8_t *d = dst;
+        while (s > 0) {
+            int capacity = buffer.capacity() & ~(this->info.blockSize - 1);
+            int toRead = std::min(s, capacity);
+
+            setOffset(offset, Command::READ);
+            co_await buffer.read(toRead);
+            int read = buffer.size();
+            if (read < toRead) {
+                // something went wrong
+                result = FATAL_ERROR;
+                co_return;
+            }
+            std::copy(buffer.data(), buffer.data() + read, d);
+            offset += read;
+            d += read;
+            s -= read;
+        }
+    }
+
+    // apply patches from oldest to newest
+    int end = std::min(size, dataSize);
+    for (int i = element.patchCount - 1; i >= 0; --i) {
+        auto &patch = element.patches[i];
+        int o = patch.elementOffset;
+        int s = std::min(patch.size, end - o);
+        int offset = patch.offset;
+        if (this->info.mapped && s > 0) {
+            // memory mapped: copy directly into the destination
+            auto src = getMapped(offset);
+            std::copy(src, src + s, dst + o);
+            continue;
+        }
+        while (s > 0) {
+            int toRead = std::min(s, buffer.capacity());
+
+            setOffset(offset, Command::READ);
+            co_await buffer.read(toRead);
+            int read = buffer.size();
+            if (read < toRead) {
+                // something went wrong
+                result = FATAL_ERROR;
+                co_return;
+            }
+            std::copy(buffer.data(), buffer.data() + read, dst + o);
+            offset += read;
+            o += read;
+            s -= read;
+        }
+    }
+
+    result = dataSize;
+}
+
+AwaitableCoroutine BufferStorage::write(int id, const void *data, int size, int &result) {
+    trace(Operation::WRITE, id, size);
+    return writeElement(id, data, size, false, Placement::AUTO, result);
+}
+
+AwaitableCoroutine BufferStorage::write(int id, const void *data, int size, Placement placement, int &result) {
+    trace(placement == Placement::HOT ? Operation::WRITE_HOT
+        : (placement == Placement::COLD ? Operation::WRITE_COLD : Operation::WRITE), id, size);
+    return writeElement(id, data, size, false, placement, result);
+}
+
+AwaitableCoroutine BufferStorage::writeCompressed(int id, const void *data, int size, int &result) {
+    trace(Operation::WRITE_COMPRESSED, id, size);
+    return writeElement(id, data, size, true, Placement::AUTO, result);
+}
+
+BufferStorage::PoolCoroutine BufferStorage::writeElement(int id, const void *data, int size, bool compress,
+    Placement placement, int &result)
+{
+    // acquire semaphore
+    co_await this->semaphore.untilAcquired();
+    Semaphore::Guard guard(this->semaphore);
+
+    // check state
+    if (this->stat != State::READY) {
+        assert(false);
+        result = NOT_READY;
+        co_return;
+    }
+
+    // check id
+    if (uint32_t(id) > 0xffff) {
+        assert(false);
+        result = INVALID_ID;
+        co_return;
+    }
+
+    // check size, must fit into a sector which has at least two entries (one for the single entry and one for closing)
+    int maxSize = std::min(this->info.sectorSize - this->firstEntryOffset - this->entrySize,
+        this->info.wideEntries ? WIDE_SIZE_MASK : SIZE_MASK);
+    if (uint32_t(size) > uint32_t(maxSize)) {
+        assert(false);
+        result = WRITE_SIZE_EXCEEDED;
+        co_return;
+    }
+    this->stat = State::BUSY;
+
+    // finish the recovery after a lazy mount
+    if (this->recoveryIndex >= 0) {
+        co_await recover(true, result);
+        if (result != OK) {
+            this->stat = State::READY;
+            co_return;
+        }
+    }
+    co_await storeElement(id, reinterpret_cast<const uint8_t *>(data), size, compress, placement, result);
+    if (result >= 0)
+        commit();
+    this->stat = State::READY;
+}
+
+AwaitableCoroutine BufferStorage::update(int id, void *data, int capacity, UpdateFunction function, void *context,
+    int &result)
+{
+    return update(POOL, id, data, capacity, function, context, result);
+}
+
+BufferStorage::PoolCoroutine BufferStorage::update(Pool, int id, void *data, int capacity, UpdateFunction function,
+    void *context, int &result)
+{
+    trace(Operation::UPDATE, id, capacity);
+
+    // acquire semaphore
+    co_await this->semaphore.untilAcquired();
+    Semaphore::Guard guard(this->semaphore);
+
+    // check state
+    if (this->stat != State::READY) {
+        assert(false);
+        result = NOT_READY;
+        co_return;
+    }
+
+    // check id
+    if (uint32_t(id) > 0xffff) {
+        assert(false);
+        result = INVALID_ID;
+        co_return;
+    }
+    this->stat = State::BUSY;
+
+    // finish the recovery after a lazy mount
+    if (this->recoveryIndex >= 0) {
+        co_await recover(true, result);
+        if (result != OK) {
+            this->stat = State::READY;
+            co_return;
+        }
+    }
+    auto dst = reinterpret_cast<uint8_t *>(data);
+
+    // find element and read its data
+    Element element;
+    co_await findElement(id, element);
+    if (element.size < 0) {
+        // something went wrong
+        result = FATAL_ERROR;
+        this->stat = State::READY;
+        co_return;
+    }
+    std::fill(dst, dst + capacity, 0);
+    int size;
+    co_await readData(element, dst, capacity, size);
+    if (size < 0) {
+        result = size;
+        this->stat = State::READY;
+        co_return;
+    }
+
+    // modify the data
+    size = function(context, data, size);
+    if (size < 0) {
+        result = size;
+        this->stat = State::READY;
+        co_return;
+    }
+    int maxSize = std::min(this->info.sectorSize - this->firstEntryOffset - this->entrySize,
+        this->info.wideEntries ? WIDE_SIZE_MASK : SIZE_MASK);
+    if (size > capacity || size > maxSize) {
+        result = WRITE_SIZE_EXCEEDED;
+        this->stat = State::READY;
+        co_return;
+    }
+
+    // write the data if it has changed, compare with the element at the location found by the lookup
+    bool same;
+    co_await hasData(element, dst, size, same);
+    if (same) {
+        result = size;
+    } else if (element.kind == COUNTER) {
+        // a counter stays a counter, write a new counter with the new value
+        if (size != COUNTER_BASE_SIZE) {
+            result = NOT_SUPPORTED;
+        } else {
+            uint32_t value;
+            std::copy(dst, dst + COUNTER_BASE_SIZE, reinterpret_cast<uint8_t *>(&value));
+            co_await storeCounter(id, value, result);
+            if (result >= 0)
+                commit();
+        }
+    } else {
+        co_await storeElement(id, dst, size, element.kind == COMPRESSED, Placement::AUTO, result);
+        if (result >= 0)
+            commit();
+    }
+    this->stat = State::READY;
+}
+
+BufferStorage::PoolCoroutine BufferStorage::storeElement(int id, const uint8_t *src, int size, bool compress,
+    Placement placement, int &result)
+{
+    auto &buffer = this->buffer;
+
+    // check if compression pays off
+    int kind = PLAIN;
+    int storedSize = size;
+    if (compress && size > this->smallSize && size >= this->compression.minSize && size <= 0xffff) {
+        int compressedSize = COMPRESSED_HEADER_SIZE + PackBitsEncoder(src, size).encode(nullptr, size);
+        if (align(compressedSize, this->info.blockSize) + this->compression.minSaving <= align(size, this->info.blockSize)) {
+            kind = COMPRESSED;
+            storedSize = compressedSize;
+        }
+    }
+
+    // check if entry exists and has same data
+    // todo
+
+    // check if entry will fit
+    int dataSize = kind != PLAIN || size > this->smallSize ? align(storedSize, this->info.blockSize) : 0;
+    co_await selectHead(id, placement, -1);
+    int gcCount = 0;
+    while (this->head->entryWriteOffset + this->entrySize + dataSize > this->head->dataWriteOffset) {
+        // data does not fit, we need to start a new sector
+
+        // check if all sectors were already garbage collected which means we are out of memory
+        ++gcCount;
         if (gcCount >= this->info.sectorCount) {
             result = OUT_OF_MEMORY;
             co_return;
         }
 
-        // close current sector and go to next sector (which is erased)
-        co_await closeSector();
+        // fail fast if the entry does not fit even when all garbage gets reclaimed
+        if (gcCount == 1) {
+            bool fits;
+            co_await checkSpace(this->entrySize + dataSize, fits);
+            if (!fits) {
+                result = OUT_OF_MEMORY;
+                co_return;
+            }
+        }
+
+        // close sector of the head and go to next sector (which is erased)
+        co_await closeSector();
+        co_await gc();
+        co_await selectHead(id, placement, -1);
+    }
+
+    // write data
+    if (kind == COMPRESSED) {
+        int offset = this->head->dataWriteOffset - align(storedSize, this->info.blockSize);
+        this->head->dataWriteOffset = offset;
+        PackBitsEncoder encoder(src, size);
+        int s = storedSize;
+        bool first = true;
+        while (s > 0) {
+            int capacity = buffer.capacity() & ~(this->info.blockSize - 1);
+            int toWrite = std::min(s, capacity);
+
+            // header with uncompressed size, then compressed data
+            int i = 0;
+            if (first) {
+                buffer[0] = size;
+                buffer[1] = size >> 8;
+                i = COMPRESSED_HEADER_SIZE;
+                first = false;
+            }
+            encoder.encode(buffer.data() + i, toWrite - i);
+
+            setOffset(this->head->sectorOffset + offset, Command::WRITE);
+            co_await writeBuffer(toWrite);
+            offset += toWrite;
+            s -= toWrite;
+        }
+    } else if (size > this->smallSize) {
+        int offset = this->head->dataWriteOffset - align(size, this->info.blockSize);
+        this->head->dataWriteOffset = offset;
+        int s = size;
+        while (s > 0) {
+            int capacity = buffer.capacity() & ~(this->info.blockSize - 1);
+            int toWrite = std::min(s, capacity);
+
+            setOffset(this->head->sectorOffset + offset, Command::WRITE);
+            std::copy(src, src + toWrite, buffer.data());
+            co_await writeBuffer(toWrite);
+            offset += toWrite;
+            src += toWrite;
+            s -= toWrite;
+        }
+    }
+
+    // write entry (with inline data if size <= smallSize)
+    co_await writeEntry(id, kind, storedSize, src);
+
+    this->stats.writtenBytes += size;
+    result = size;
+}
+
+BufferStorage::PoolCoroutine BufferStorage::storeCounter(int id, uint32_t value, int &result) {
+    // check if counter will fit
+    int dataSize = getCounterSize();
+    co_await selectHead(id, Placement::AUTO, -1);
+    int gcCount = 0;
+    while (this->head->entryWriteOffset + this->entrySize + dataSize > this->head->dataWriteOffset) {
+        // counter does not fit, we need to start a new sector
+
+        // check if all sectors were already garbage collected which means we are out of memory
+        ++gcCount;
+        if (gcCount >= this->info.sectorCount) {
+            result = OUT_OF_MEMORY;
+            co_return;
+        }
+
+        // fail fast if the counter does not fit even when all garbage gets reclaimed
+        if (gcCount == 1) {
+            bool fits;
+            co_await checkSpace(this->entrySize + dataSize, fits);
+            if (!fits) {
+                result = OUT_OF_MEMORY;
+                co_return;
+            }
+        }
+
+        // close sector of the head and go to next sector (which is erased)
+        co_await closeSector();
+        co_await gc();
+        co_await selectHead(id, Placement::AUTO, -1);
+    }
+
+    // write counter
+    co_await writeCounter(id, value);
+
+    this->stats.writtenBytes += COUNTER_BASE_SIZE;
+    result = COUNTER_BASE_SIZE;
+}
+
+BufferStorage::PoolCoroutine BufferStorage::hasData(const Element &element, const uint8_t *data, int size, bool &result)
+{
+    auto &buffer = this->buffer;
+    result = false;
+    if (element.patchCount > 0)
+        co_return;
+
+    if (element.kind == COUNTER) {
+        // counter: compare with base value plus number of programmed blocks
+        if (size != COUNTER_BASE_SIZE)
+            co_return;
+        uint32_t value;
+        int count;
+        co_await readCounter(element, value, count);
+        if (count < 0)
+            co_return;
+        value += count;
+        result = std::equal(data, data + size, reinterpret_cast<const uint8_t *>(&value));
+    } else if (element.kind == COMPRESSED) {
+        // compressed data: decode chunk by chunk and compare with the data
+        uint8_t chunk[FOLD_CHUNK_SIZE];
+        PackBitsDecoder decoder(chunk, std::min(size, FOLD_CHUNK_SIZE));
+        int position = 0;
+        int offset = element.offset;
+        int s = element.size;
+        bool first = true;
+        while (s > 0) {
+            const uint8_t *src;
+            int read;
+            if (this->info.mapped) {
+                // decode directly from memory mapped memory
+                src = getMapped(offset);
+                read = s;
+            } else {
+                int capacity = buffer.capacity() & ~(this->info.blockSize - 1);
+                int toRead = std::min(s, capacity);
+                setOffset(offset, Command::READ);
+                co_await buffer.read(toRead);
+                read = buffer.size();
+                if (read < toRead)
+                    co_return;
+                src = buffer.data();
+            }
+            int i = 0;
+            if (first) {
+                // compare uncompressed size from header
+                if ((src[0] | (src[1] << 8)) != size)
+                    co_return;
+                i = COMPRESSED_HEADER_SIZE;
+                first = false;
+            }
+            while (position < size) {
+                i += decoder.decode(src + i, read - i);
+                if (!decoder.full())
+                    break;
+                int chunkSize = std::min(size - position, FOLD_CHUNK_SIZE);
+                if (!std::equal(chunk, chunk + chunkSize, data + position))
+                    co_return;
+                position += chunkSize;
+                decoder.setDestination(chunk, std::min(size - position, FOLD_CHUNK_SIZE));
+            }
+            offset += read;
+            s -= read;
+        }
+        result = position == size;
+    } else if (element.size != size) {
+        co_return;
+    } else if (element.offset < 0) {
+        // inline data (or not found and size is zero)
+        result = std::equal(data, data + size, element.data);
+    } else if (this->info.mapped) {
+        // compare directly with memory mapped memory
+        result = std::equal(data, data + size, getMapped(element.offset));
+    } else {
+        // compare chunk by chunk
+        int offset = element.offset;
+        int s = size;
+        while (s > 0) {
+            int toRead = std::min(s, buffer.capacity());
+            setOffset(offset, Command::READ);
+            co_await buffer.read(toRead);
+            if (buffer.size() < toRead || !std::equal(data, data + toRead, buffer.data()))
+                co_return;
+            offset += toRead;
+            data += toRead;
+            s -= toRead;
+        }
+        result = true;
+    }
+}
+
+AwaitableCoroutine BufferStorage::patch(int id, int offset, const void *data, int size, int &result) {
+    return patch(POOL, id, offset, data, size, result);
+}
+
+BufferStorage::PoolCoroutine BufferStorage::patch(Pool, int id, int offset, const void *data, int size, int &result) {
+    trace(Operation::PATCH, id, size);
+
+    // acquire semaphore
+    co_await this->semaphore.untilAcquired();
+    Semaphore::Guard guard(this->semaphore);
+
+    // check state
+    if (this->stat != State::READY) {
+        assert(false);
+        result = NOT_READY;
+        co_return;
+    }
+
+    // check id
+    if (uint32_t(id) > 0xffff) {
+        assert(false);
+        result = INVALID_ID;
+        co_return;
+    }
+
+    // check size of patch including header, a negative size is rejected
+    int maxSize = std::min(this->info.sectorSize - this->firstEntryOffset - this->entrySize,
+        this->info.wideEntries ? WIDE_SIZE_MASK : SIZE_MASK);
+    if (size < 0 || uint32_t(PATCH_HEADER_SIZE + size) > uint32_t(maxSize)) {
+        assert(false);
+        result = WRITE_SIZE_EXCEEDED;
+        co_return;
+    }
+
+    // an empty patch leaves the element unchanged, nothing gets written
+    if (size == 0) {
+        result = 0;
+        co_return;
+    }
+    this->stat = State::BUSY;
+
+    // finish the recovery after a lazy mount
+    if (this->recoveryIndex >= 0) {
+        co_await recover(true, result);
+        if (result != OK) {
+            this->stat = State::READY;
+            co_return;
+        }
+    }
+    auto &buffer = this->buffer;
+    auto src = reinterpret_cast<const uint8_t *>(data);
+
+    int gcCount = 0;
+    while (true) {
+        // find element to patch
+        Element element;
+        co_await findElement(id, element);
+        if (element.size < 0) {
+            // something went wrong
+            result = FATAL_ERROR;
+            this->stat = State::READY;
+            co_return;
+        }
+
+        // check if patching is supported and the patch is inside the element
+        if (element.kind != PLAIN) {
+            result = NOT_SUPPORTED;
+            this->stat = State::READY;
+            co_return;
+        }
+        if (uint32_t(offset) > uint32_t(element.size) || uint32_t(size) > uint32_t(element.size - offset)) {
+            result = WRITE_SIZE_EXCEEDED;
+            this->stat = State::READY;
+            co_return;
+        }
+        if (offset > 0xffff) {
+            // offset does not fit into the patch header
+            result = NOT_SUPPORTED;
+            this->stat = State::READY;
+            co_return;
+        }
+
+        // check if patch will fit. Small elements are written as a whole, long chains of patches get folded
+        co_await selectHead(id, Placement::AUTO, -1);
+        bool small = element.offset < 0;
+        bool fold = !small && element.patchCount >= MAX_PATCH_COUNT;
+        int dataSize = small ? 0 : align(fold ? element.size : PATCH_HEADER_SIZE + size, this->info.blockSize);
+        if (this->head->entryWriteOffset + this->entrySize + dataSize <= this->head->dataWriteOffset) {
+            if (small) {
+                // patch the inline data and write entry
+                std::copy(src, src + size, element.data + offset);
+                co_await writeEntry(id, PLAIN, element.size, element.data);
+            } else if (fold) {
+                // write a new copy of the element with all patches applied
+                co_await this->fold(id, element, offset, src, size);
+            } else {
+                // write patch header and patch data
+                int o = this->head->dataWriteOffset - dataSize;
+                this->head->dataWriteOffset = o;
+                int s = PATCH_HEADER_SIZE + size;
+                bool first = true;
+                while (s > 0) {
+                    int capacity = buffer.capacity() & ~(this->info.blockSize - 1);
+                    int toWrite = std::min(s, capacity);
+
+                    int i = 0;
+                    if (first) {
+                        // header with offset in element
+                        buffer[0] = offset;
+                        buffer[1] = offset >> 8;
+                        i = PATCH_HEADER_SIZE;
+                        first = false;
+                    }
+                    std::copy(src, src + (toWrite - i), buffer.data() + i);
+
+                    setOffset(this->head->sectorOffset + o, Command::WRITE);
+                    co_await writeBuffer(toWrite);
+                    o += toWrite;
+                    src += toWrite - i;
+                    s -= toWrite;
+                }
+                co_await writeEntry(id, PATCH, PATCH_HEADER_SIZE + size, nullptr);
+            }
+            break;
+        }
+
+        // patch does not fit, we need to start a new sector
+
+        // check if all sectors were already garbage collected which means we are out of memory
+        ++gcCount;
+        if (gcCount >= this->info.sectorCount) {
+            result = OUT_OF_MEMORY;
+            this->stat = State::READY;
+            co_return;
+        }
+
+        // fail fast if the patch does not fit even when all garbage gets reclaimed
+        if (gcCount == 1) {
+            bool fits;
+            co_await checkSpace(this->entrySize + dataSize, fits);
+            if (!fits) {
+                result = OUT_OF_MEMORY;
+                this->stat = State::READY;
+                co_return;
+            }
+        }
+
+        // close sector of the head and go to next sector (which is erased), then find the element again as garbage
+        // collection may have moved it
+        co_await closeSector();
+        co_await gc();
+    }
+
+    this->stats.writtenBytes += size;
+    commit();
+    result = size;
+    this->stat = State::READY;
+}
+
+AwaitableCoroutine BufferStorage::increment(int id, int &result) {
+    return increment(POOL, id, result);
+}
+
+BufferStorage::PoolCoroutine BufferStorage::increment(Pool, int id, int &result) {
+    trace(Operation::INCREMENT, id, 0);
+
+    // acquire semaphore
+    co_await this->semaphore.untilAcquired();
+    Semaphore::Guard guard(this->semaphore);
+
+    // check state
+    if (this->stat != State::READY) {
+        assert(false);
+        result = NOT_READY;
+        co_return;
+    }
+
+    // check id
+    if (uint32_t(id) > 0xffff) {
+        assert(false);
+        result = INVALID_ID;
+        co_return;
+    }
+    this->stat = State::BUSY;
+
+    // finish the recovery after a lazy mount
+    if (this->recoveryIndex >= 0) {
+        co_await recover(true, result);
+        if (result != OK) {
+            this->stat = State::READY;
+            co_return;
+        }
+    }
+    auto &buffer = this->buffer;
+
+    int gcCount = 0;
+    while (true) {
+        // find counter
+        Element element;
+        co_await findElement(id, element);
+        if (element.size < 0) {
+            // something went wrong
+            result = FATAL_ERROR;
+            this->stat = State::READY;
+            co_return;
+        }
+
+        uint32_t value = 0;
+        if (element.kind == COUNTER) {
+            int count;
+            co_await readCounter(element, value, count);
+            if (count < 0) {
+                // something went wrong
+                result = FATAL_ERROR;
+                this->stat = State::READY;
+                co_return;
+            }
+            int blockBits = this->counterBits ? this->info.blockSize * 8 : 1;
+            if (count < this->counterRunLength * blockBits) {
+                // program next block of the run or the block that contains the next bit
+                int block = count / blockBits;
+                int cleared = this->counterBits ? count % blockBits + 1 : this->info.blockSize * 8;
+                int offset = element.offset + align(COUNTER_BASE_SIZE, this->info.blockSize) + (block << this->offsetShift);
+                for (int i = 0; i < this->info.blockSize; ++i)
+                    buffer[i] = uint8_t(0xff << std::clamp(cleared - i * 8, 0, 8));
+                setOffset(offset, Command::WRITE);
+                co_await writeBuffer(this->info.blockSize);
+                break;
+            }
+
+            // run is exhausted
+            value += count;
+        }
+
+        // write a new counter that contains the incremented value
+        co_await selectHead(id, Placement::AUTO, -1);
+        if (this->head->entryWriteOffset + this->entrySize + getCounterSize() <= this->head->dataWriteOffset) {
+            co_await writeCounter(id, value + 1);
+            break;
+        }
+
+        // counter does not fit, we need to start a new sector
+
+        // check if all sectors were already garbage collected which means we are out of memory
+        ++gcCount;
+        if (gcCount >= this->info.sectorCount) {
+            result = OUT_OF_MEMORY;
+            this->stat = State::READY;
+            co_return;
+        }
+
+        // fail fast if the counter does not fit even when all garbage gets reclaimed
+        if (gcCount == 1) {
+            bool fits;
+            co_await checkSpace(this->entrySize + getCounterSize(), fits);
+            if (!fits) {
+                result = OUT_OF_MEMORY;
+                this->stat = State::READY;
+                co_return;
+            }
+        }
+
+        // close sector of the head and go to next sector (which is erased)
+        co_await closeSector();
+        co_await gc();
+    }
+
+    this->stats.writtenBytes += COUNTER_BASE_SIZE;
+    commit();
+    result = OK;
+    this->stat = State::READY;
+}
+
+AwaitableCoroutine BufferStorage::eraseRange(int firstId, int lastId, int &result) {
+    return eraseRange(POOL, firstId, lastId, result);
+}
+
+BufferStorage::PoolCoroutine BufferStorage::eraseRange(Pool, int firstId, int lastId, int &result) {
+    trace(Operation::ERASE_RANGE, firstId, lastId - firstId + 1);
+
+    // acquire semaphore
+    co_await this->semaphore.untilAcquired();
+    Semaphore::Guard guard(this->semaphore);
+
+    // check state
+    if (this->stat != State::READY) {
+        assert(false);
+        result = NOT_READY;
+        co_return;
+    }
+
+    // check ids
+    if (uint32_t(firstId) > 0xffff || uint32_t(lastId) > 0xffff || lastId < firstId) {
+        assert(false);
+        result = INVALID_ID;
+        co_return;
+    }
+    this->stat = State::BUSY;
+
+    // finish the recovery after a lazy mount
+    if (this->recoveryIndex >= 0) {
+        co_await recover(true, result);
+        if (result != OK) {
+            this->stat = State::READY;
+            co_return;
+        }
+    }
+
+    // the range entry goes to the newest head so that it is newer than all entries of the erased elements
+    this->head = getNewestHead();
+    int gcCount = 0;
+    while (this->head->entryWriteOffset + this->entrySize > this->head->dataWriteOffset) {
+        // entry does not fit, we need to start a new sector
+
+        // check if all sectors were already garbage collected which means we are out of memory
+        ++gcCount;
+        if (gcCount >= this->info.sectorCount) {
+            result = OUT_OF_MEMORY;
+            this->stat = State::READY;
+            co_return;
+        }
+
+        // fail fast if the entry does not fit even when all garbage gets reclaimed
+        if (gcCount == 1) {
+            bool fits;
+            co_await checkSpace(this->entrySize, fits);
+            if (!fits) {
+                result = OUT_OF_MEMORY;
+                this->stat = State::READY;
+                co_return;
+            }
+        }
+
+        // close sector of the head and go to next sector (which is erased)
+        co_await closeSector();
+        co_await gc();
+        this->head = getNewestHead();
+    }
+    co_await writeRangeEntry(firstId, lastId);
+
+    commit();
+    result = OK;
+    this->stat = State::READY;
+}
+
+AwaitableCoroutine BufferStorage::freeSpace(Space &space, int &result) {
+    return freeSpace(POOL, space, result);
+}
+
+BufferStorage::PoolCoroutine BufferStorage::freeSpace(Pool, Space &space, int &result) {
+    // acquire semaphore
+    co_await this->semaphore.untilAcquired();
+    Semaphore::Guard guard(this->semaphore);
+
+    // check state
+    if (this->stat != State::READY) {
+        assert(false);
+        result = NOT_READY;
+        co_return;
+    }
+    this->stat = State::BUSY;
+
+    // determine the size of the live entries and data
+    int liveSize;
+    co_await determineLiveSize(liveSize);
+    if (liveSize < 0) {
+        // something went wrong
+        result = FATAL_ERROR;
+        this->stat = State::READY;
+        co_return;
+    }
+
+    // free space in the heads and in the free sectors that are not spare
+    int sectorSize = this->info.sectorSize - this->firstEntryOffset;
+    int freeSize = std::max(getFreeCount() - this->spareCount, 0) * sectorSize;
+    for (int i = 0; i < this->headCount; ++i) {
+        auto head = &this->heads[i];
+        if (head->sectorIndex >= 0)
+            freeSize += head->dataWriteOffset - head->entryWriteOffset;
+    }
+
+    // the rest of the sectors that are not spare is garbage
+    int capacity = getCapacity();
+    space.live = liveSize;
+    space.free = std::min(freeSize, std::max(capacity - liveSize, 0));
+    space.garbage = std::max(capacity - liveSize - space.free, 0);
+    result = OK;
+    this->stat = State::READY;
+}
+
+AwaitableCoroutine BufferStorage::eraseSectors(int &result) {
+    return eraseSectors(POOL, result);
+}
+
+BufferStorage::PoolCoroutine BufferStorage::eraseSectors(Pool, int &result) {
+    trace(Operation::ERASE_SECTORS, 0, 0);
+
+    result = 0;
+    while (true) {
+        // acquire semaphore for each sector so that other operations can interleave
+        co_await this->semaphore.untilAcquired();
+        Semaphore::Guard guard(this->semaphore);
+
+        // check state
+        if (this->stat != State::READY) {
+            result = NOT_READY;
+            co_return;
+        }
+
+        // finish the recovery after a lazy mount as it may find dirty sectors
+        if (this->recoveryIndex >= 0) {
+            this->stat = State::BUSY;
+            int r;
+            co_await recover(true, r);
+            this->stat = State::READY;
+            if (r != OK) {
+                result = r;
+                co_return;
+            }
+        }
+
+        // get a dirty sector
+        int index = getSector(0, SectorState::DIRTY);
+        if (index < 0)
+            co_return;
+
+        this->stat = State::BUSY;
+        co_await eraseSector(index);
+        this->sectors[index].state = SectorState::EMPTY;
+        ++result;
+        this->stat = State::READY;
+    }
+}
+
+// reference: https://www.ccsinfo.com/forum/viewtopic.php?t=24977
+uint16_t BufferStorage::crc16(const void *data, int size, uint16_t crc) {
+    auto *it = reinterpret_cast<const uint8_t *>(data);
+    auto *end = it + size;
+    for (; it < end; ++it) {
+        uint16_t x = (crc >> 8) ^ *it;
+        x ^= x >> 4;
+        crc = (crc << 8) ^ (x << 12) ^ (x << 5) ^ x;
+    }
+    return crc;
+}
+
+/*
+// more on crc: https://www.mikrocontroller.net/attachment/91385/crc16.c
+// crc with table (can be obtained from https://crccalc.com/?crc=12&method=crc16&datatype=ascii&outtype=0):
+uint16_t crc16(const void *data, int size, uint16_t crc) {
+    auto *d = reinterpret_cast<const uint8_t *>(data);
+    for (int i = 0; i < size; ++i) {
+        crc = crc16Table[(crc >> 8) ^ d[i]] ^ (crc << 8);
+    }
+    return crc;
+}
+*/
+
+const uint8_t *BufferStorage::getMapped(int offset) {
+    return reinterpret_cast<const uint8_t *>(uintptr_t(this->info.address + offset));
+}
+
+void BufferStorage::setOffset(uint32_t offset, Command command) {
+    offset += this->info.address;
+    switch (this->info.type) {
+    case Type::MEM_4N:
+    case Type::FLASH_4N:
+        this->buffer.header<uint32_t>() = offset;
+        break;
+    case Type::MEM_1C2B:
+    case Type::FLASH_1C2B:
+        {
+            uint8_t *header = this->buffer.headerData();
+            header[0] = this->info.commands[int(command)];
+            header[1] = offset >> 8;
+            header[2] = offset;
+        }
+        break;
+    }
+}
+
+BufferStorage::PoolCoroutine BufferStorage::findElement(int id, Element &element) {
+    auto &buffer = this->buffer;
+
+    // not found is indicated by empty inline data
+    element.kind = PLAIN;
+    element.size = 0;
+    element.offset = -1;
+    element.patchCount = 0;
+
+    // iterate over sectors from newest to oldest (allocation table starts from front, data from back)
+    int sectorIndex = getNewestSector();
+    while (sectorIndex >= 0) {
+        int sectorOffset = sectorIndex * this->info.sectorSize;
+        int dataOffset = this->info.sectorSize;
+
+        // get offset of last entry in allocation table and skip the sector if its bloom filter does not contain the id
+        int entryOffset;
+        bool sorted = false;
+        auto head = getHead(sectorIndex);
+        if (head != nullptr) {
+            // open sector
+            entryOffset = mayContain(head->filter, id) ? head->entryWriteOffset - this->entrySize : 0;
+        } else {
+            int filterSize;
+            co_await getLastEntry(sectorOffset, entryOffset, filterSize);
+            bool contains;
+            co_await checkFilter(sectorOffset, entryOffset, filterSize, id, contains);
+            if (!contains) {
+                entryOffset = 0;
+            } else if (entryOffset > 0 && isSorted(sectorIndex)) {
+                // binary search for the last entry with the id
+                int offset;
+                co_await searchSorted(sectorOffset, entryOffset, id, true, offset);
+                if (offset >= 0) {
+                    entryOffset = offset;
+                    sorted = true;
+                }
+            }
+        }
+
+        // iterate over allocation table entries from last to first (newest to oldest)
+        while (entryOffset > 0) {
+            // read entry
+            setOffset(sectorOffset + entryOffset, Command::READ);
+            co_await buffer.read(this->rawEntrySize);
+            if (buffer.size() < this->rawEntrySize) {
+                // something went wrong
+                element.size = -1;
+                co_return;
+            }
+            Entry entry = buffer.value<Entry>();
+
+            // check if entry is valid and found, in a sorted sector the entries with the id are consecutive
+            bool valid = isEntryValid(entryOffset, dataOffset, entry);
+            if (sorted && valid && entry.id != id)
+                break;
+            if (!valid && isRangeEntry(entry) && rangeContains(entry, id)) {
+                // erased by a range entry, ignore patches without element
+                element.patchCount = 0;
+                co_return;
+            }
+            if (valid && entry.id == id) {
+                if ((entry.small.size & SMALL_FLAG) != 0) {
+                    // small entry with inline data
+                    element.size = getSmallSize(entry);
+                    copySmallData(entry, element.data);
+                    co_return;
+                }
+
+                // calc offset in memory (offset of sector + offset of entry)
+                int kind = getKind(entry);
+                int size = getSize(entry);
+                int offset = sectorOffset + getOffset(entry);
+                if (kind != PATCH) {
+                    element.kind = kind;
+                    element.size = size;
+                    element.offset = offset;
+                    co_return;
+                }
+
+                // patch: read header and continue searching for the element
+                if (element.patchCount < MAX_PATCH_COUNT) {
+                    setOffset(offset, Command::READ);
+                    co_await buffer.read(PATCH_HEADER_SIZE);
+                    if (buffer.size() < PATCH_HEADER_SIZE) {
+                        // something went wrong
+                        element.size = -1;
+                        co_return;
+                    }
+                    auto &patch = element.patches[element.patchCount++];
+                    patch.offset = offset + PATCH_HEADER_SIZE;
+                    patch.elementOffset = buffer[0] | (buffer[1] << 8);
+                    patch.size = size - PATCH_HEADER_SIZE;
+                }
+            }
+            entryOffset -= this->entrySize;
+        }
+
+        // go to previous sector
+        sectorIndex = getPreviousSector(sectorIndex);
+    }
+
+    // not found (which is ok), ignore patches without element
+    element.patchCount = 0;
+}
+
+BufferStorage::PoolCoroutine BufferStorage::fold(int id, const Element &element, int patchOffset,
+    const uint8_t *patchData, int patchSize)
+{
+    auto &buffer = this->buffer;
+    int size = element.size;
+    int offset = this->head->dataWriteOffset - align(size, this->info.blockSize);
+    this->head->dataWriteOffset = offset;
+
+    // copy element in chunks and apply patches to each chunk
+    uint8_t chunk[FOLD_CHUNK_SIZE];
+    int position = 0;
+    while (position < size) {
+        int capacity = std::min(buffer.capacity(), FOLD_CHUNK_SIZE) & ~(this->info.blockSize - 1);
+        int toCopy = std::min(size - position, capacity);
+        int end = position + toCopy;
+
+        // read chunk of element
+        setOffset(element.offset + position, Command::READ);
+        co_await buffer.read(toCopy);
+        std::copy(buffer.data(), buffer.data() + toCopy, chunk);
+
+        // apply patches from oldest to newest
+        for (int i = element.patchCount - 1; i >= 0; --i) {
+            auto &patch = element.patches[i];
+            int start = std::max(position, patch.elementOffset);
+            int s = std::min(end, patch.elementOffset + patch.size) - start;
+            if (s > 0) {
+                setOffset(patch.offset + (start - patch.elementOffset), Command::READ);
+                co_await buffer.read(s);
+                std::copy(buffer.data(), buffer.data() + s, chunk + (start - position));
+            }
+        }
+
+        // apply patch from memory
+        {
+            int start = std::max(position, patchOffset);
+            int s = std::min(end, patchOffset + patchSize) - start;
+            if (s > 0)
+                std::copy(patchData + (start - patchOffset), patchData + (start - patchOffset) + s, chunk + (start - position));
+        }
+
+        // write chunk
+        std::copy(chunk, chunk + toCopy, buffer.data());
+        setOffset(this->head->sectorOffset + offset + position, Command::WRITE);
+        co_await writeBuffer(toCopy);
+        position = end;
+    }
+
+    // write entry
+    co_await writeEntry(id, PLAIN, size, nullptr);
+}
+
+BufferStorage::PoolCoroutine BufferStorage::readCounter(const Element &element, uint32_t &value, int &count) {
+    auto &buffer = this->buffer;
+
+    // read base value
+    setOffset(element.offset, Command::READ);
+    co_await buffer.read(COUNTER_BASE_SIZE);
+    if (buffer.size() < COUNTER_BASE_SIZE) {
+        // something went wrong
+        count = -1;
+        co_return;
+    }
+    value = buffer.value<uint32_t>();
+
+    // binary search for the first block in the run that is not used, the used blocks are at the start of the run
+    int runOffset = element.offset + align(COUNTER_BASE_SIZE, this->info.blockSize);
+    int runLength = (element.size - align(COUNTER_BASE_SIZE, this->info.blockSize)) >> this->offsetShift;
+    int low = 0;
+    int high = runLength;
+    while (low < high) {
+        int mid = (low + high) >> 1;
+        setOffset(runOffset + (mid << this->offsetShift), Command::READ);
+        co_await buffer.read(this->info.blockSize);
+        if (buffer.size() < this->info.blockSize) {
+            // something went wrong
+            count = -1;
+            co_return;
+        }
+
+        // check if block is used, a run of blocks uses a block when it is programmed, a run of bits when all its bits
+        // are cleared
+        int erasedCount = 0;
+        int clearedCount = 0;
+        for (int i = 0; i < this->info.blockSize; ++i) {
+            erasedCount += buffer[i] == 0xff;
+            clearedCount += buffer[i] == 0;
+        }
+        if (this->counterBits ? clearedCount == this->info.blockSize : erasedCount < this->info.blockSize)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    if (!this->counterBits) {
+        count = low;
+        co_return;
+    }
+
+    // count the cleared bits of the partially programmed block
+    count = low * this->info.blockSize * 8;
+    if (low < runLength) {
+        setOffset(runOffset + (low << this->offsetShift), Command::READ);
+        co_await buffer.read(this->info.blockSize);
+        if (buffer.size() < this->info.blockSize) {
+            // something went wrong
+            count = -1;
+            co_return;
+        }
+        for (int i = 0; i < this->info.blockSize; ++i)
+            count += 8 - std::popcount(buffer[i]);
+    }
+}
+
+BufferStorage::PoolCoroutine BufferStorage::writeCounter(int id, uint32_t value) {
+    auto &buffer = this->buffer;
+    int size = getCounterSize();
+    int offset = this->head->dataWriteOffset - size;
+    this->head->dataWriteOffset = offset;
+
+    // write base value, the run of blocks stays erased
+    int baseSize = align(COUNTER_BASE_SIZE, this->info.blockSize);
+    std::fill(buffer.data(), buffer.data() + baseSize, 0xff);
+    buffer.value<uint32_t>() = value;
+    setOffset(this->head->sectorOffset + offset, Command::WRITE);
+    co_await writeBuffer(baseSize);
+
+    // write entry
+    co_await writeEntry(id, COUNTER, size, nullptr);
+}
+
+int BufferStorage::getCounterSize() {
+    return align(COUNTER_BASE_SIZE, this->info.blockSize) + (this->counterRunLength << this->offsetShift);
+}
+
+uint16_t BufferStorage::calcChecksum(const Entry &entry) {
+    uint16_t crc = crc16(&entry, offsetof(Entry, checksum));
+
+    // bytes behind the checksum: upper bits of size and offset (wide entry format) and inline data of small entries
+    int size = this->info.wideEntries ? 4 : 0;
+    if ((entry.small.size & (SMALL_FLAG | SMALL_KIND_MASK)) == (SMALL_FLAG | SMALL_DATA))
+        size = std::max(size, std::min(getSmallSize(entry), this->smallSize) - SMALL_SIZE);
+    if (size > 0)
+        crc = crc16(entry.small.moreData, size, crc);
+    return crc;
+}
+
+BufferStorage::Entry &BufferStorage::initEntry() {
+    auto &entry = this->buffer.value<Entry>();
+    std::fill(entry.small.moreData, entry.small.moreData + (MAX_SMALL_SIZE - SMALL_SIZE), 0xff);
+    entry.data[0] = 0xffffffff;
+    entry.data[1] = 0xffffffff;
+    return entry;
+}
+
+int BufferStorage::getSmallSize(const Entry &entry) {
+    // bits 2-4 are stored inverted so that they are 0 for entries with up to SMALL_SIZE bytes
+    return (entry.small.size & 3) | (~entry.small.size & 0x1c);
+}
+
+void BufferStorage::copySmallData(const Entry &entry, uint8_t *data) {
+    int size = getSmallSize(entry);
+    int s = std::min(size, SMALL_SIZE);
+    std::copy(entry.small.data, entry.small.data + s, data);
+    std::copy(entry.small.moreData, entry.small.moreData + (size - s), data + s);
+}
+
+int BufferStorage::getKind(const Entry &entry) {
+    int tag = entry.checksum ^ calcChecksum(entry);
+    for (int kind = 0; kind < int(std::size(KIND_TAGS)); ++kind) {
+        if (tag == KIND_TAGS[kind])
+            return kind;
+    }
+    return -1;
+}
+
+void BufferStorage::setChecksum(Entry &entry, int kind) {
+    entry.checksum = calcChecksum(entry) ^ KIND_TAGS[kind];
+}
+
+int BufferStorage::getSize(const Entry &entry) {
+    int size = entry.size;
+    if (this->info.wideEntries)
+        size |= (entry.sizeHigh & 0x7fff) << 16;
+    return size;
+}
+
+int BufferStorage::getOffset(const Entry &entry) {
+    // the upper bit of the offset field is the flag of small entries
+    int offset = entry.offset & 0x7fff;
+    if (this->info.wideEntries)
+        offset |= entry.offsetHigh << 15;
+    return offset << this->offsetShift;
+}
+
+void BufferStorage::setSizeAndOffset(Entry &entry, int size, int offset) {
+    offset >>= this->offsetShift;
+    entry.size = size;
+    entry.offset = offset & 0x7fff;
+    entry.sizeHigh = size >> 16;
+    entry.offsetHigh = offset >> 15;
+}
+
+bool BufferStorage::isEntryValid(int entryOffset, int dataOffset, const Entry &entry) {
+    if ((entry.small.size & SMALL_FLAG) == 0) {
+        // not a small entry: check checksum (matches the tag of the kind) and if data is in valid range
+        if (getKind(entry) < 0)
+            return false;
+        int offset = getOffset(entry);
+        if (offset < entryOffset + this->entrySize || offset + getSize(entry) > dataOffset)
+            return false;
+    } else if (entry.checksum != calcChecksum(entry)) {
+        // invalid checksum
+        return false;
+    } else if ((entry.small.size & SMALL_KIND_MASK) != SMALL_DATA) {
+        // header entry
+        return false;
+    } else if (getSmallSize(entry) > this->smallSize) {
+        // inline data does not fit into the entry
+        return false;
+    }
+
+    return true;
+}
+
+void BufferStorage::commit() {
+    if (this->commitHandler != nullptr && (this->stats.programmedBytes != this->committedBytes
+        || this->stats.erasedSectors != this->committedSectors))
+    {
+        this->committedBytes = this->stats.programmedBytes;
+        this->committedSectors = this->stats.erasedSectors;
+        this->commitHandler->commit();
+    }
+}
+
+void BufferStorage::rotateRecentFilters() {
+    std::copy(this->recentFilters[0], this->recentFilters[0] + this->filterSize, this->recentFilters[1]);
+    std::fill(this->recentFilters[0], this->recentFilters[0] + this->filterSize, 0);
+}
+
+bool BufferStorage::isHeaderEntry(const Entry &entry) {
+    return entry.checksum == calcChecksum(entry) && (entry.small.size & SMALL_FLAG) != 0
+        && (entry.small.size & SMALL_KIND_MASK) == SMALL_HEADER;
+}
+
+bool BufferStorage::isRangeEntry(const Entry &entry) {
+    return entry.checksum == calcChecksum(entry) && (entry.small.size & SMALL_FLAG) != 0
+        && (entry.small.size & SMALL_KIND_MASK) == SMALL_RANGE;
+}
+
+BufferStorage::PoolCoroutine BufferStorage::detectOffsets(int sectorIndex, std::pair<int, int>& offsets) {
+    auto &buffer = this->buffer;
+    int sectorOffset = sectorIndex * this->info.sectorSize;
+    int entryOffset = this->entrySize;
+    int dataOffset = this->info.sectorSize;
+    this->head->lastId = 0;
+    this->head->sorted = true;
+
+    // iterate over entries
+    while (entryOffset <= dataOffset) {
+        // read next entry
+        setOffset(sectorOffset + entryOffset, Command::READ);
+        co_await buffer.read(this->rawEntrySize);
+        if (buffer.size() < this->rawEntrySize) {
+            // something went wrong
+            break;
+        }
+        auto &entry = buffer.value<Entry>();
+
+        // end of list is indicated by an empty entry
+        if (isEmpty(entry))
+            break;
+
+        // check if entry is valid
+        if (isEntryValid(entryOffset, dataOffset, entry)) {
+            // add to bloom filter of current sector and check if the entries are sorted
+            addToFilter(this->head->filter, entry.id);
+            if (entry.id < this->head->lastId)
+                this->head->sorted = false;
+            this->head->lastId = entry.id;
+
+            if ((entry.small.size & SMALL_FLAG) == 0) {
+                // set new data offset
+                dataOffset = getOffset(entry);
+            }
+        } else if (isRangeEntry(entry)) {
+            addToFilter(this->head->filter, RANGE_FILTER_ID);
+            this->head->sorted = false;
+        }
+        entryOffset += this->entrySize;
+    }
+
+    offsets = {entryOffset, dataOffset};
+}
+
+BufferStorage::PoolCoroutine BufferStorage::checkData(int sectorIndex, int entryOffset, int &dataOffset) {
+    auto &buffer = this->buffer;
+    int sectorOffset = sectorIndex * this->info.sectorSize;
+
+    // check from entryOffset (behind last entry) to dataOffset (start of data of last entry)
+    int size = dataOffset - entryOffset;
+    int o = entryOffset;
+    while (size > 0) {
+        int capacity = buffer.capacity() & ~(this->info.blockSize - 1);
+        int toCheck = std::min(size, capacity);
+
+        setOffset(sectorOffset + o, Command::READ);
+        co_await buffer.read(toCheck);
+
+        int read = buffer.size();
+        for (int i = 0; i < read; ++i) {
+            if (buffer[i] != 0xff) {
+                // down-align to block size
+                dataOffset = (o + i) & ~(this->info.blockSize - 1);
+            }
+        }
+        size -= toCheck;
+        o += toCheck;
+    }
+}
+
+BufferStorage::PoolCoroutine BufferStorage::getLastEntry(int sectorOffset, int &entryOffsetResult,
+    int &filterSizeResult)
+{
+    auto &buffer = this->buffer;
+    auto &sector = this->sectors[sectorOffset / this->info.sectorSize];
+    filterSizeResult = 0;
+
+    // use cached value
+    if (sector.state == SectorState::CLOSED && sector.lastEntry != LAST_ENTRY_UNKNOWN) {
+        entryOffsetResult = (sector.lastEntry & LAST_ENTRY_INDEX) * this->entrySize;
+        if (sector.lastEntry & LAST_ENTRY_FILTER)
+            filterSizeResult = this->filterSize;
+        co_return;
+    }
+
+    // read close entry (assumption is that it is present and valid)
+    {
+        setOffset(sectorOffset, Command::READ);
+        co_await buffer.read(this->rawEntrySize);
+        if (buffer.size() < this->rawEntrySize) {
+            // something went wrong
+            entryOffsetResult = -1;
+            co_return;
+        }
+        auto &entry = buffer.value<Entry>();
+
+        // check if empty, should not happen as the sector is assumed to be closed
+        // todo: report malfunction
+        //if (entry.empty())
+        //	return 0;
 
-        co_await gc(this->sectorIndex);
+        // return offset and size of bloom filter if close entry is valid
+        if (isCloseEntryValid(entry)) {
+            entryOffsetResult = getOffset(entry);
+            filterSizeResult = getSize(entry);
+            if (sector.state == SectorState::CLOSED)
+                setLastEntry(sector, entryOffsetResult, filterSizeResult, getKind(entry) == SORTED);
+            co_return;
+        }
     }
 
-    // write data
-    auto src = reinterpret_cast<const uint8_t *>(data);
-    if (size > SMALL_SIZE) {
-        int offset = this->dataWriteOffset - align(size, this->info.blockSize);
-        this->dataWriteOffset = offset;
-        int s = size;
+    // close entry is not valid, therefore detect last entry
+    int entryOffset = this->entrySize;
+    int validOffset = 0;
+    int dataOffset = this->info.sectorSize;
+
+    // iterate over entries
+    while (entryOffset <= dataOffset) {
+        // read next entry
+        setOffset(sectorOffset + entryOffset, Command::READ);
+        co_await buffer.read(this->rawEntrySize);
+        if (buffer.size() < this->rawEntrySize) {
+            // something went wrong
+            entryOffsetResult = -1;
+            co_return;
+        }
+        auto &entry = buffer.value<Entry>();
+
+        // end of list is indicated by an empty entry
+        if (isEmpty(entry))
+            break;
+
+        // check if entry is valid
+        if (isEntryValid(entryOffset, dataOffset, entry)) {
+            validOffset = entryOffset;
+
+            if ((entry.small.size & SMALL_FLAG) == 0) {
+                // set new data offset
+                dataOffset = getOffset(entry);
+            }
+        } else if (isRangeEntry(entry)) {
+            validOffset = entryOffset;
+        }
+        entryOffset += this->entrySize;
+    }
+
+    entryOffsetResult = validOffset;
+    if (sector.state == SectorState::CLOSED)
+        setLastEntry(sector, validOffset, 0, false);
+}
+
+void BufferStorage::setLastEntry(Sector &sector, int entryOffset, int filterSize, bool sorted) {
+    int index = entryOffset / this->entrySize;
+    if (index > LAST_ENTRY_INDEX) {
+        // does not fit (very large sector)
+        sector.lastEntry = LAST_ENTRY_UNKNOWN;
+        return;
+    }
+    sector.lastEntry = index | (filterSize > 0 ? LAST_ENTRY_FILTER : 0) | (sorted ? LAST_ENTRY_SORTED : 0);
+}
+
+bool BufferStorage::isSorted(int sectorIndex) {
+    auto &sector = this->sectors[sectorIndex];
+    return sector.state == SectorState::CLOSED && sector.lastEntry != LAST_ENTRY_UNKNOWN
+        && (sector.lastEntry & LAST_ENTRY_SORTED) != 0;
+}
+
+BufferStorage::PoolCoroutine BufferStorage::searchSorted(int sectorOffset, int lastEntryOffset, int id, bool last,
+    int &entryOffsetResult)
+{
+    auto &buffer = this->buffer;
+    entryOffsetResult = 0;
+
+    // search the first entry with larger id (last) or with larger or equal id (first) in units of entries, the entry
+    // in front of it or the entry itself is the one with the given id if present
+    int low = 1;
+    int high = lastEntryOffset / this->entrySize + 1;
+    while (low < high) {
+        int middle = (low + high) >> 1;
+        int entryOffset = middle * this->entrySize;
+
+        // read entry
+        setOffset(sectorOffset + entryOffset, Command::READ);
+        co_await buffer.read(this->rawEntrySize);
+        if (buffer.size() < this->rawEntrySize) {
+            // something went wrong
+            entryOffsetResult = -1;
+            co_return;
+        }
+        auto &entry = buffer.value<Entry>();
+
+        int entryId;
+        if (isEntryValid(entryOffset, this->info.sectorSize, entry)) {
+            entryId = entry.id;
+        } else if (middle == 1 && isHeaderEntry(entry)) {
+            // header entry of hot/cold separation is in front of all entries
+            entryId = -1;
+        } else {
+            // invalid entry (e.g. interrupted write), fall back to linear search
+            entryOffsetResult = -1;
+            co_return;
+        }
+
+        if (last ? entryId <= id : entryId < id) {
+            low = middle + 1;
+            if (last)
+                entryOffsetResult = entryId == id ? entryOffset : 0;
+        } else {
+            high = middle;
+            if (!last)
+                entryOffsetResult = entryId == id ? entryOffset : 0;
+        }
+    }
+}
+
+BufferStorage::PoolCoroutine BufferStorage::checkFilter(int sectorOffset, int lastEntryOffset, int filterSize, int id,
+    bool &contains)
+{
+    auto &buffer = this->buffer;
+    contains = true;
+    if (filterSize != this->filterSize || lastEntryOffset <= 0)
+        co_return;
+
+    // read bloom filter which is located behind the last entry
+    setOffset(sectorOffset + lastEntryOffset + this->entrySize, Command::READ);
+    co_await buffer.read(filterSize);
+    if (buffer.size() < filterSize)
+        co_return;
+    contains = mayContain(buffer.data(), id);
+}
+
+void BufferStorage::addToFilter(uint8_t *filter, int id) {
+    for (uint32_t h : FILTER_HASHES) {
+        int bit = (uint32_t(id + 1) * h) >> this->filterShift;
+        filter[bit >> 3] |= 1 << (bit & 7);
+    }
+}
+
+bool BufferStorage::filterContains(const uint8_t *filter, int id) {
+    for (uint32_t h : FILTER_HASHES) {
+        int bit = (uint32_t(id + 1) * h) >> this->filterShift;
+        if ((filter[bit >> 3] & (1 << (bit & 7))) == 0)
+            return false;
+    }
+    return true;
+}
+
+bool BufferStorage::mayContain(const uint8_t *filter, int id) {
+    return filterContains(filter, id) || filterContains(filter, RANGE_FILTER_ID);
+}
+
+Awaitable<Buffer::Events> BufferStorage::writeEntry(int id, int kind, int size, const uint8_t *data) {
+
+    // set offset and advance entry write offset
+    int offset = this->head->sectorOffset + this->head->entryWriteOffset;
+    setOffset(offset, Command::WRITE);
+    this->head->entryWriteOffset += this->entrySize;
+
+    // add to bloom filter of current sector and check if the entries stay sorted
+    addToFilter(this->head->filter, id);
+    if (id < this->head->lastId)
+        this->head->sorted = false;
+    this->head->lastId = id;
+
+    // create entry
+    auto &entry = initEntry();
+    entry.id = id;
+    if (size > this->smallSize || kind != PLAIN) {
+        setSizeAndOffset(entry, size, this->head->dataWriteOffset);
+    } else {
+        // small entry: inline data, bits 2-4 of the size are stored inverted
+        entry.small.size = SMALL_FLAG | SMALL_DATA | (size & 3) | (~size & 0x1c);
+        int s = std::min(size, SMALL_SIZE);
+        std::copy(data, data + s, entry.small.data);
+        std::copy(data + s, data + size, entry.small.moreData);
+    }
+    setChecksum(entry, kind);
+
+    // write entry
+    return writeBuffer(this->rawEntrySize);
+}
+
+Awaitable<Buffer::Events> BufferStorage::writeRangeEntry(int firstId, int lastId) {
+    // set offset and advance entry write offset
+    int offset = this->head->sectorOffset + this->head->entryWriteOffset;
+    setOffset(offset, Command::WRITE);
+    this->head->entryWriteOffset += this->entrySize;
+
+    // lookups of all ids have to check the sector and the entries are not sorted any more
+    addToFilter(this->head->filter, RANGE_FILTER_ID);
+    this->head->sorted = false;
+
+    // create entry, the last id is stored in the inline data
+    auto &entry = initEntry();
+    entry.id = firstId;
+    entry.small.size = SMALL_FLAG | SMALL_RANGE | 0x1f; // unused bits set to 1
+    entry.small.data[0] = lastId;
+    entry.small.data[1] = lastId >> 8;
+    entry.checksum = calcChecksum(entry);
+
+    // write entry
+    return writeBuffer(this->rawEntrySize);
+}
+
+
+BufferStorage::PoolCoroutine BufferStorage::closeSector() {
+    auto &buffer = this->buffer;
+
+    // write bloom filter of the ids in the sector behind the last entry if there is enough space
+    int filterSize = 0;
+    int alignedFilterSize = align(this->filterSize, this->info.blockSize);
+    auto head = this->head;
+    if (head->entryWriteOffset > this->firstEntryOffset && head->entryWriteOffset + alignedFilterSize <= head->dataWriteOffset) {
+        filterSize = this->filterSize;
+        std::copy(head->filter, head->filter + filterSize, buffer.data());
+        std::fill(buffer.data() + filterSize, buffer.data() + alignedFilterSize, 0xff);
+        setOffset(head->sectorOffset + head->entryWriteOffset, Command::WRITE);
+        co_await writeBuffer(alignedFilterSize);
+    }
+
+    // create entry (id is the sequence number of the sector, size is the size of the bloom filter)
+    auto &entry = initEntry();
+    entry.id = this->sectors[head->sectorIndex].sequence;
+    setSizeAndOffset(entry, filterSize, head->entryWriteOffset - this->entrySize); // offset of last entry in sector, gets used by getLastEntry()
+    setChecksum(entry, head->sorted ? SORTED : PLAIN);
+
+    // write close entry at start of sector (index 0), an empty sector has an invalid close entry which is equivalent
+    // to no last entry
+    auto &sector = this->sectors[head->sectorIndex];
+    sector.state = SectorState::CLOSED;
+    setLastEntry(sector, std::max(head->entryWriteOffset - this->entrySize, 0), filterSize, head->sorted);
+    if (head == &this->heads[HOT])
+        rotateRecentFilters();
+    setOffset(head->sectorOffset, Command::WRITE);
+    co_await writeBuffer(this->rawEntrySize);
+
+    // use next free sector, garbage collection makes sure that there is one
+    co_await openSector();
+    assert(head->sectorIndex >= 0);
+}
+
+BufferStorage::PoolCoroutine BufferStorage::openSector() {
+    auto head = this->head;
+
+    // get next empty sector in ring order, erase a dirty sector if there is no empty sector
+    int index = getSector(head->sectorIndex, SectorState::EMPTY);
+    if (index < 0) {
+        index = getSector(head->sectorIndex, SectorState::DIRTY);
+        if (index >= 0)
+            co_await eraseSector(index);
+    }
+    head->sectorIndex = index;
+    if (index < 0)
+        co_return;
+    ++this->sequence;
+    this->sectors[index] = {this->sequence, SectorState::OPEN, 0};
+    head->sectorOffset = index * this->info.sectorSize;
+    head->entryWriteOffset = this->firstEntryOffset;
+    head->dataWriteOffset = this->info.sectorSize;
+    std::fill(head->filter, head->filter + this->filterSize, 0);
+    head->lastId = 0;
+    head->sorted = true;
+
+    if (this->headCount > 1) {
+        // write header entry with sequence number and role so that mount() can order the open sectors
+        auto &entry = initEntry();
+        entry.id = this->sequence;
+        entry.small.size = SMALL_FLAG | SMALL_HEADER | 0x1f; // unused bits set to 1
+        entry.small.data[0] = head - this->heads;
+        entry.checksum = calcChecksum(entry);
+        setOffset(head->sectorOffset + this->entrySize, Command::WRITE);
+        co_await writeBuffer(this->rawEntrySize);
+    }
+}
+
+bool BufferStorage::isCloseEntryValid(const Entry &entry) {
+    // check checksum (matches the tag of the kind)
+    int kind = getKind(entry);
+    if (kind != PLAIN && kind != SORTED)
+        return false;
+
+    // check if length is 0 or the size of the bloom filter (id is the sequence number)
+    int size = getSize(entry);
+    if (size != 0 && size != this->filterSize)
+        return false;
+
+    // check if there is at least one entry and the offset is inside the sector
+    int offset = getOffset(entry);
+    if (offset < this->entrySize || offset >= this->info.sectorSize)
+        return false;
+
+    return true;
+}
+
+BufferStorage::PoolCoroutine BufferStorage::eraseSector(int index) {
+    auto &buffer = this->buffer;
+    int sectorOffset = index * this->info.sectorSize;
+
+    if (this->info.type < Type::FLASH_4N) {
+        // generic memory: explicitly fill with 0xff
+        int s = this->info.sectorSize;
+        int offset = sectorOffset;
         while (s > 0) {
             int capacity = buffer.capacity() & ~(this->info.blockSize - 1);
             int toWrite = std::min(s, capacity);
 
-            setOffset(this->sectorOffset + offset, Command::WRITE);
-            std::copy(src, src + toWrite, buffer.data());
+            std::fill(buffer.data(), buffer.data() + capacity, 0xff);
+            setOffset(offset, Command::WRITE);
             co_await buffer.write(toWrite);
             offset += toWrite;
-            src += toWrite;
             s -= toWrite;
         }
+    } else {
+        // flash: use page erase
+        for (int offset = 0; offset < this->info.sectorSize; offset += this->info.pageSize) {
+            setOffset(sectorOffset + offset, Command::ERASE);
+            co_await buffer.erase();
+//debug::set(debug::YELLOW);
+        }
     }
+    ++this->stats.erasedSectors;
+}
 
-    // write entry (with inline data if size <= SMALL_SIZE)
-    co_await writeEntry(id, size, src);
+void *BufferStorage::allocateFrame(std::size_t size) {
+    uint8_t *frame;
+    BufferStorage *storage = this;
+    if (size <= FRAME_SIZE - FRAME_HEADER_SIZE && this->freeFrames != nullptr) {
+        // take frame from the pool
+        frame = this->freeFrames;
+        this->freeFrames = *reinterpret_cast<uint8_t **>(frame);
+    } else {
+        // frame is too large or the pool is exhausted
+        frame = new uint8_t[FRAME_HEADER_SIZE + size];
+        storage = nullptr;
+        ++this->stats.heapFrames;
+    }
+    *reinterpret_cast<BufferStorage **>(frame) = storage;
+    return frame + FRAME_HEADER_SIZE;
+}
 
-    result = size;
-    this->stat = State::READY;
+void BufferStorage::freeFrame(void *frame) {
+    auto f = reinterpret_cast<uint8_t *>(frame) - FRAME_HEADER_SIZE;
+    auto storage = *reinterpret_cast<BufferStorage **>(f);
+    if (storage != nullptr) {
+        // return frame to the pool
+        *reinterpret_cast<uint8_t **>(f) = storage->freeFrames;
+        storage->freeFrames = f;
+    } else {
+        delete [] f;
+    }
 }
 
-// reference: https://www.ccsinfo.com/forum/viewtopic.php?t=24977
-uint16_t BufferStorage::crc16(const void *data, int size, uint16_t crc) {
-    auto *it = reinterpret_cast<const uint8_t *>(data);
-    auto *end = it + size;
-    for (; it < end; ++it) {
-        uint16_t x = (crc >> 8) ^ *it;
-        x ^= x >> 4;
-        crc = (crc << 8) ^ (x << 12) ^ (x << 5) ^ x;
+Awaitable<Buffer::Events> BufferStorage::writeBuffer(int size) {
+    this->stats.programmedBytes += size;
+    return this->buffer.write(size);
+}
+
+bool BufferStorage::isNewer(int sectorIndex1, int sectorIndex2) {
+    // compare using serial number arithmetic so that the sequence numbers can wrap around
+    return int16_t(this->sectors[sectorIndex1].sequence - this->sectors[sectorIndex2].sequence) > 0;
+}
+
+int BufferStorage::getPreviousSector(int sectorIndex) {
+    int previous = -1;
+    for (int i = 0; i < this->info.sectorCount; ++i) {
+        if (this->sectors[i].state != SectorState::EMPTY && isNewer(sectorIndex, i)
+            && (previous == -1 || isNewer(i, previous)))
+        {
+            previous = i;
+        }
     }
-    return crc;
+    return previous;
 }
 
-/*
-// more on crc: https://www.mikrocontroller.net/attachment/91385/crc16.c
-// crc with table (can be obtained from https://crccalc.com/?crc=12&method=crc16&datatype=ascii&outtype=0):
-uint16_t crc16(const void *data, int size, uint16_t crc) {
-    auto *d = reinterpret_cast<const uint8_t *>(data);
-    for (int i = 0; i < size; ++i) {
-        crc = crc16Table[(crc >> 8) ^ d[i]] ^ (crc << 8);
+int BufferStorage::getNextSector(int sectorIndex) {
+    int next = -1;
+    for (int i = 0; i < this->info.sectorCount; ++i) {
+        if (this->sectors[i].state != SectorState::EMPTY && isNewer(i, sectorIndex)
+            && (next == -1 || isNewer(next, i)))
+        {
+            next = i;
+        }
     }
-    return crc;
+    return next;
 }
-*/
 
-void BufferStorage::setOffset(uint32_t offset, Command command) {
-    offset += this->info.address;
-    switch (this->info.type) {
-    case Type::MEM_4N:
-    case Type::FLASH_4N:
-        this->buffer.header<uint32_t>() = offset;
-        break;
-    case Type::MEM_1C2B:
-    case Type::FLASH_1C2B:
+int BufferStorage::getNewestSector() {
+    int newest = -1;
+    for (int i = 0; i < this->info.sectorCount; ++i) {
+        if (this->sectors[i].state != SectorState::EMPTY && (newest == -1 || isNewer(i, newest)))
+            newest = i;
+    }
+    return newest;
+}
+
+int BufferStorage::getSector(int sectorIndex, SectorState state) {
+    for (int i = 1; i <= this->info.sectorCount; ++i) {
+        int index = (sectorIndex + i) % this->info.sectorCount;
+        if (this->sectors[index].state == state)
+            return index;
+    }
+    return -1;
+}
+
+int BufferStorage::getFreeCount() {
+    int count = 0;
+    for (int i = 0; i < this->info.sectorCount; ++i) {
+        auto state = this->sectors[i].state;
+        if (state == SectorState::EMPTY || state == SectorState::DIRTY)
+            ++count;
+    }
+    return count;
+}
+
+BufferStorage::PoolCoroutine BufferStorage::checkErased(int sectorIndex, bool &erased) {
+    auto &buffer = this->buffer;
+    int sectorOffset = sectorIndex * this->info.sectorSize;
+    erased = false;
+
+    int size = this->info.sectorSize;
+    int o = 0;
+    while (size > 0) {
+        int capacity = buffer.capacity() & ~(this->info.blockSize - 1);
+        int toCheck = std::min(size, capacity);
+
+        setOffset(sectorOffset + o, Command::READ);
+        co_await buffer.read(toCheck);
+        if (buffer.size() < toCheck) {
+            // something went wrong
+            co_return;
+        }
+
+        for (int i = 0; i < toCheck; ++i) {
+            if (buffer[i] != 0xff)
+                co_return;
+        }
+        size -= toCheck;
+        o += toCheck;
+    }
+    erased = true;
+}
+
+BufferStorage::Head *BufferStorage::getHead(int sectorIndex) {
+    for (int i = 0; i < this->headCount; ++i) {
+        if (this->heads[i].sectorIndex == sectorIndex)
+            return &this->heads[i];
+    }
+    return nullptr;
+}
+
+BufferStorage::Head *BufferStorage::getOldHead() {
+    for (int i = 0; i < this->headCount; ++i) {
+        auto head = &this->heads[i];
+        if (head->sectorIndex >= 0
+            && int16_t(this->sequence - this->sectors[head->sectorIndex].sequence) >= MAX_SEQUENCE_AGE)
         {
-            uint8_t *header = this->buffer.headerData();
-            header[0] = this->info.commands[int(command)];
-            header[1] = offset >> 8;
-            header[2] = offset;
+            return head;
         }
-        break;
     }
+    return nullptr;
+}
+
+BufferStorage::Head *BufferStorage::getNewestHead() {
+    auto newest = &this->heads[HOT];
+    for (int i = 1; i < this->headCount; ++i) {
+        if (isNewer(this->heads[i].sectorIndex, newest->sectorIndex))
+            newest = &this->heads[i];
+    }
+    return newest;
+}
+
+BufferStorage::PoolCoroutine BufferStorage::selectHead(int id, Placement placement, int excludeSectorIndex) {
+    // the newest head can be used for all elements
+    auto newest = getNewestHead();
+    this->head = newest;
+    if (this->headCount == 1)
+        return {};
+
+    // get preferred head, elements that get rewritten during the lifetime of the current or previous hot sector are hot
+    int role = placement == Placement::COLD ? COLD : HOT;
+    if (placement == Placement::AUTO) {
+        if (!filterContains(this->recentFilters[0], id) && !filterContains(this->recentFilters[1], id))
+            role = COLD;
+        addToFilter(this->recentFilters[0], id);
+    }
+    auto head = &this->heads[role];
+    if (head == newest)
+        return {};
+
+    // check the bloom filters of the newer sectors
+    return selectHeadIfNotNewer(head, id, excludeSectorIndex);
+}
+
+BufferStorage::PoolCoroutine BufferStorage::selectHeadIfNotNewer(Head *head, int id, int excludeSectorIndex) {
+    // check if a newer sector may contain the element
+    int sectorIndex = head->sectorIndex;
+    while ((sectorIndex = getNextSector(sectorIndex)) >= 0) {
+        if (sectorIndex == excludeSectorIndex)
+            continue;
+        bool contains;
+        auto h = getHead(sectorIndex);
+        if (h != nullptr) {
+            contains = mayContain(h->filter, id);
+        } else {
+            int sectorOffset = sectorIndex * this->info.sectorSize;
+            int lastEntryOffset;
+            int filterSize;
+            co_await getLastEntry(sectorOffset, lastEntryOffset, filterSize);
+            co_await checkFilter(sectorOffset, lastEntryOffset, filterSize, id, contains);
+        }
+        if (contains)
+            co_return;
+    }
+    this->head = head;
 }
 
-bool BufferStorage::isEntryValid(int entryOffset, int dataOffset, const Entry &entry) {
-    // check checksum
-    if (entry.checksum != calcChecksum(entry))
-        return false;
+BufferStorage::PoolCoroutine BufferStorage::findNewer(int sectorIndex, int entryOffset, int dataOffset, int id,
+    Element &element, int &result)
+{
+    auto &buffer = this->buffer;
+    element.patchCount = 0;
+    result = 0;
+
+    // search in the given sector behind the given entry and in all newer sectors
+    entryOffset += this->entrySize;
+    bool first = true;
+    while (sectorIndex >= 0) {
+        int sectorOffset = sectorIndex * this->info.sectorSize;
+
+        // get offset of last entry in allocation table and skip the sector if its bloom filter does not contain the id
+        // (the first sector contains the id)
+        int lastEntryOffset;
+        bool sorted = false;
+        auto head = getHead(sectorIndex);
+        if (head != nullptr) {
+            // open sector
+            lastEntryOffset = mayContain(head->filter, id) ? head->entryWriteOffset - this->entrySize : 0;
+        } else {
+            int filterSize;
+            co_await getLastEntry(sectorOffset, lastEntryOffset, filterSize);
+            if (lastEntryOffset < 0) {
+                // something went wrong
+                result = -1;
+                co_return;
+            }
+            if (!first) {
+                bool contains;
+                co_await checkFilter(sectorOffset, lastEntryOffset, filterSize, id, contains);
+                if (!contains) {
+                    lastEntryOffset = 0;
+                } else if (lastEntryOffset > 0 && isSorted(sectorIndex)) {
+                    // binary search for the first entry with the id
+                    int offset;
+                    co_await searchSorted(sectorOffset, lastEntryOffset, id, false, offset);
+                    if (offset == 0) {
+                        lastEntryOffset = 0;
+                    } else if (offset > 0) {
+                        entryOffset = offset;
+                        sorted = true;
+                    }
+                }
+            }
+        }
+
+        // iterate over entries
+        while (entryOffset <= lastEntryOffset) {
+            setOffset(sectorOffset + entryOffset, Command::READ);
+            co_await buffer.read(this->rawEntrySize);
+            if (buffer.size() < this->rawEntrySize) {
+                // something went wrong
+                result = -1;
+                co_return;
+            }
+            Entry entry = buffer.value<Entry>();
 
-    if ((entry.small.size & SMALL_FLAG) == 0) {
-        // not a small entry: check if data is in valid range
-        int offset = entry.offset << this->offsetShift;
-        if (offset < entryOffset + this->entrySize || offset + entry.size > dataOffset)
-            return false;
+            // check if entry is valid
+            if (isEntryValid(entryOffset, dataOffset, entry)) {
+                bool small = (entry.small.size & SMALL_FLAG) != 0;
+                if (!small) {
+                    // set new data offset
+                    dataOffset = getOffset(entry);
+                }
+
+                // in a sorted sector the entries with the id are consecutive
+                if (sorted && entry.id != id)
+                    break;
+
+                // check if found
+                if (entry.id == id) {
+                    // patches do not replace the element, collect them from oldest to newest
+                    if (small || getKind(entry) != PATCH) {
+                        result = 1;
+                        co_return;
+                    }
+                    if (element.patchCount < MAX_PATCH_COUNT) {
+                        int offset = sectorOffset + dataOffset;
+                        setOffset(offset, Command::READ);
+                        co_await buffer.read(PATCH_HEADER_SIZE);
+                        if (buffer.size() < PATCH_HEADER_SIZE) {
+                            // something went wrong
+                            result = -1;
+                            co_return;
+                        }
+                        auto &patch = element.patches[element.patchCount++];
+                        patch.offset = offset + PATCH_HEADER_SIZE;
+                        patch.elementOffset = buffer[0] | (buffer[1] << 8);
+                        patch.size = getSize(entry) - PATCH_HEADER_SIZE;
+                    }
+                }
+            } else if (isRangeEntry(entry) && rangeContains(entry, id)) {
+                // erased by a range entry
+                result = 1;
+                co_return;
+            }
+            entryOffset += this->entrySize;
+        }
+
+        // go to next sector
+        sectorIndex = getNextSector(sectorIndex);
+        entryOffset = this->entrySize; // skip close entry at beginning of sector
+        dataOffset = this->info.sectorSize;
+        first = false;
     }
 
-    return true;
+    // patches from newest to oldest
+    std::reverse(element.patches, element.patches + element.patchCount);
 }
 
-AwaitableCoroutine BufferStorage::detectOffsets(int sectorIndex, std::pair<int, int>& offsets) {
+BufferStorage::PoolCoroutine BufferStorage::findNewerIds(int sectorIndex, int entryOffset, int dataOffset,
+    int firstId, int &lastId, IdRange *ranges, int &count)
+{
     auto &buffer = this->buffer;
-    int sectorOffset = sectorIndex * this->info.sectorSize;
-    int entryOffset = this->entrySize;
-    int dataOffset = this->info.sectorSize;
-
-    // iterate over entries
-    while (entryOffset <= dataOffset) {
-        // read next entry
-        setOffset(sectorOffset + entryOffset, Command::READ);
-        co_await buffer.read(sizeof(Entry));
-        if (buffer.size() < int(sizeof(Entry))) {
-            // something went wrong
-            break;
-        }
-        auto &entry = buffer.value<Entry>();
+    count = 0;
 
-        // end of list is indicated by an empty entry
-        if (entry.empty())
-            break;
+    // search in the given sector behind the given entry and in all newer sectors, bloom filters don't help here as
+    // all ids in the range are of interest
+    entryOffset += this->entrySize;
+    while (sectorIndex >= 0) {
+        int sectorOffset = sectorIndex * this->info.sectorSize;
 
-        // check if entry is valid
-        if (isEntryValid(entryOffset, dataOffset, entry) && (entry.small.size & SMALL_FLAG) == 0) {
-            // set new data offset
-            dataOffset = entry.offset << this->offsetShift;
+        // get offset of last entry in allocation table
+        int lastEntryOffset;
+        auto head = getHead(sectorIndex);
+        if (head != nullptr) {
+            // open sector
+            lastEntryOffset = head->entryWriteOffset - this->entrySize;
+        } else {
+            int filterSize;
+            co_await getLastEntry(sectorOffset, lastEntryOffset, filterSize);
+            if (lastEntryOffset < 0) {
+                // something went wrong
+                count = -1;
+                co_return;
+            }
         }
-        entryOffset += this->entrySize;
-    }
 
-    // check if data is actually empty and does not contain incomplete writes
-    // check from entryOffset (behind last entry) to dataOffset (start of data of last entry)
-    int size = dataOffset - entryOffset;
-    int o = entryOffset;
-    while (size > 0) {
-        int capacity = buffer.capacity() & ~(this->info.blockSize - 1);
-        int toCheck = std::min(size, capacity);
+        // iterate over entries
+        while (entryOffset <= lastEntryOffset) {
+            setOffset(sectorOffset + entryOffset, Command::READ);
+            co_await buffer.read(this->rawEntrySize);
+            if (buffer.size() < this->rawEntrySize) {
+                // something went wrong
+                count = -1;
+                co_return;
+            }
+            Entry entry = buffer.value<Entry>();
 
-        setOffset(sectorOffset + o, Command::READ);
-        co_await buffer.read(toCheck);
+            if (isEntryValid(entryOffset, dataOffset, entry)) {
+                bool small = (entry.small.size & SMALL_FLAG) != 0;
+                if (!small) {
+                    // set new data offset
+                    dataOffset = getOffset(entry);
+                }
 
-        int read = buffer.size();
-        for (int i = 0; i < read; ++i) {
-            if (buffer[i] != 0xff) {
-                // down-align to block size
-                dataOffset = (o + i) & ~(this->info.blockSize - 1);
+                // patches do not replace the element
+                if (small || getKind(entry) != PATCH)
+                    addIdRange(ranges, count, firstId, lastId, entry.id, entry.id);
+            } else if (isRangeEntry(entry)) {
+                // erased by a range entry
+                addIdRange(ranges, count, firstId, lastId, entry.id,
+                    entry.small.data[0] | (entry.small.data[1] << 8));
             }
+            entryOffset += this->entrySize;
         }
-        size -= toCheck;
-        o += toCheck;
-    }
 
-    offsets = {entryOffset, dataOffset};
+        // go to next sector
+        sectorIndex = getNextSector(sectorIndex);
+        entryOffset = this->entrySize; // skip close entry at beginning of sector
+        dataOffset = this->info.sectorSize;
+    }
 }
 
-AwaitableCoroutine BufferStorage::getLastEntry(int sectorOffset, int &entryOffsetResult) {
-    auto &buffer = this->buffer;
+void BufferStorage::addIdRange(IdRange *ranges, int &count, int firstId, int &lastId, int first, int last) {
+    first = std::max(first, firstId);
+    last = std::min(last, lastId);
+    if (first > last)
+        return;
 
-    // read close entry (assumption is that it is present and valid)
-    {
-        setOffset(sectorOffset, Command::READ);
-        co_await buffer.read(sizeof(Entry));
-        if (buffer.size() < int(sizeof(Entry))) {
-            // something went wrong
-            entryOffsetResult = -1;
-            co_return;
-        }
-        auto &entry = buffer.value<Entry>();
+    // find first range that ends at or behind the new range (adjacent ranges get merged)
+    int i = 0;
+    while (i < count && ranges[i].last + 1 < first)
+        ++i;
 
-        // check if empty, should not happen as the sector is assumed to be closed
-        // todo: report malfunction
-        //if (entry.isEmpty())
-        //	return 0;
+    // merge with all ranges that overlap or touch the new range
+    int j = i;
+    while (j < count && ranges[j].first <= last + 1) {
+        first = std::min(first, ranges[j].first);
+        last = std::max(last, ranges[j].last);
+        ++j;
+    }
+    if (j > i) {
+        // replace the merged ranges by the new range
+        ranges[i] = {first, last};
+        std::copy(ranges + j, ranges + count, ranges + i + 1);
+        count -= j - i - 1;
+        return;
+    }
 
-        // return offset if close entry is valid
-        if (isCloseEntryValid(entry)) {
-            entryOffsetResult = entry.offset << this->offsetShift;
-            co_return;
+    // insert the new range, drop the last range and lower the last id if there are too many ranges
+    if (count == MAX_ID_RANGE_COUNT) {
+        if (i == count) {
+            lastId = first - 1;
+            return;
         }
+        --count;
+        lastId = ranges[count].first - 1;
     }
+    std::copy_backward(ranges + i, ranges + count, ranges + count + 1);
+    ranges[i] = {first, last};
+    ++count;
+}
 
-    // close entry is not valid, therefore detect last entry
-    int entryOffset = this->entrySize;
-    int validOffset = 0;
-    int dataOffset = this->info.sectorSize;
+BufferStorage::PoolCoroutine BufferStorage::checkOlder(int sectorIndex, int id, bool &contains) {
+    contains = false;
+    for (int i = 0; i < this->info.sectorCount; ++i) {
+        // also check dirty sectors as reclaimed sectors reappear as closed sectors if they were not erased before mount
+        if (this->sectors[i].state == SectorState::EMPTY || !isNewer(sectorIndex, i))
+            continue;
+        int sectorOffset = i * this->info.sectorSize;
+
+        // check bloom filter of the sector
+        int lastEntryOffset;
+        int filterSize;
+        co_await getLastEntry(sectorOffset, lastEntryOffset, filterSize);
+        if (lastEntryOffset != 0) {
+            co_await checkFilter(sectorOffset, lastEntryOffset, filterSize, id, contains);
+            if (contains)
+                break;
+        }
+    }
+}
 
-    // iterate over entries
-    while (entryOffset <= dataOffset) {
-        // read next entry
-        setOffset(sectorOffset + entryOffset, Command::READ);
-        co_await buffer.read(sizeof(Entry));
-        if (buffer.size() < int(sizeof(Entry))) {
+BufferStorage::PoolCoroutine BufferStorage::determineLiveSize(int &liveSize) {
+    // sum up the live sizes of the closed and open sectors
+    liveSize = 0;
+    for (int i = 0; i < this->info.sectorCount; ++i) {
+        auto state = this->sectors[i].state;
+        if (state != SectorState::CLOSED && state != SectorState::OPEN)
+            continue;
+        int size;
+        co_await collectSector(i, Collect::TOTAL, size);
+        if (size < 0) {
             // something went wrong
-            entryOffsetResult = -1;
+            liveSize = -1;
             co_return;
         }
-        auto &entry = buffer.value<Entry>();
+        liveSize += size;
+    }
 
-        // end of list is indicated by an empty entry
-        if (entry.empty())
-            break;
+    // remember as upper bound for checkSpace()
+    this->liveSize = liveSize;
+    this->liveProgrammedBytes = this->stats.programmedBytes - this->stats.copiedBytes;
+}
 
-        // check if entry is valid
-        if (isEntryValid(entryOffset, dataOffset, entry)) {
-            validOffset = entryOffset;
+BufferStorage::PoolCoroutine BufferStorage::checkSpace(int size, bool &fits) {
+    int capacity = getCapacity();
 
-            if (entry.size > SMALL_SIZE) {
-                // set new data offset
-                dataOffset = entry.offset << this->offsetShift;
-            }
-        }
-        entryOffset += this->entrySize;
+    // check using the upper bound
+    if (this->liveSize >= 0) {
+        int64_t liveSize = this->liveSize + (this->stats.programmedBytes - this->stats.copiedBytes
+            - this->liveProgrammedBytes);
+        fits = liveSize + size <= capacity;
+        if (fits)
+            co_return;
     }
 
-    entryOffsetResult = validOffset;
+    // determine the size as entries got outdated since it was determined, let garbage collection try on error
+    int liveSize;
+    co_await determineLiveSize(liveSize);
+    fits = liveSize < 0 || liveSize + size <= capacity;
 }
 
-Awaitable<Buffer::Events> BufferStorage::writeEntry(int id, int size, const uint8_t *data) {
+BufferStorage::PoolCoroutine BufferStorage::collectSector(int sectorIndex, Collect collect, int &liveSize) {
     auto &buffer = this->buffer;
+    int sectorOffset = sectorIndex * this->info.sectorSize;
+    bool copy = collect == Collect::COPY;
+    liveSize = 0;
 
-    // set offset and advance entry write offset
-    int offset = this->sectorOffset + this->entryWriteOffset;
-    setOffset(offset, Command::WRITE);
-    this->entryWriteOffset += this->entrySize;
-
-    // create entry
-    auto &entry = buffer.value<Entry>();
-    entry.id = id;
-    if (size > SMALL_SIZE) {
-        entry.size = size;
-        entry.offset = this->dataWriteOffset >> this->offsetShift;
-    } else {
-        // small entry: inline data
-        entry.small.size = SMALL_FLAG | size | 0x7c; // unused bits set to 1
-        std::copy(data, data + size, entry.small.data);
-        std::fill(entry.small.data + size, entry.small.data + 3, 0xff); // fill unused bytes with 0xff to reduce flash wear
+    // iterate over all entries from first to last (oldest to newest)
+    int entryOffset = this->entrySize;
+    int dataOffset = this->info.sectorSize;
+    int lastEntryOffset;
+    int filterSize;
+    co_await getLastEntry(sectorOffset, lastEntryOffset, filterSize);
+    if (lastEntryOffset < 0) {
+        // something went wrong
+        liveSize = -1;
+        co_return;
     }
-    entry.checksum = calcChecksum(entry);
 
-    // write entry
-    return buffer.write(sizeof(Entry));
-}
+    // when copying, iterate in the order of the ids if a head is still sorted so that it stays sorted and gets closed
+    // with sorted flag. The entries get selected in passes over the allocation table
+    bool sort = false;
+    for (int i = 0; i < this->headCount; ++i)
+        sort |= copy && this->heads[i].sorted;
+    EntryLocation locations[MAX_SELECT_COUNT];
+    int locationCount = 0;
+    int locationIndex = 0;
+    while (true) {
+        if (!sort) {
+            if (entryOffset > lastEntryOffset)
+                break;
+        } else {
+            if (locationIndex == locationCount) {
+                // select next entries after the last selected entry
+                int afterId = locationCount > 0 ? locations[locationCount - 1].id : -1;
+                int afterOffset = locationCount > 0 ? locations[locationCount - 1].entryOffset : 0;
+                co_await selectEntries(sectorOffset, lastEntryOffset, afterId, afterOffset, locations, locationCount);
+                if (locationCount < 0) {
+                    // something went wrong
+                    liveSize = -1;
+                    co_return;
+                }
+                if (locationCount == 0)
+                    break;
+                locationIndex = 0;
+            }
+            auto &location = locations[locationIndex++];
+            entryOffset = location.entryOffset;
+            dataOffset = location.dataOffset;
+        }
 
+        // read entry
+        setOffset(sectorOffset + entryOffset, Command::READ);
+        co_await buffer.read(this->rawEntrySize);
+        if (buffer.size() < this->rawEntrySize) {
+            // something went wrong
+            liveSize = -1;
+            co_return;
+        }
+        Entry entry = buffer.value<Entry>();
 
-Awaitable<Buffer::Events> BufferStorage::closeSector() {
-    auto &buffer = this->buffer;
+        if (isEntryValid(entryOffset, dataOffset, entry)) {
+            bool small = (entry.small.size & SMALL_FLAG) != 0;
+            int kind = small ? PLAIN : getKind(entry);
+            int size = small ? getSmallSize(entry) : getSize(entry);
+            if (!small) {
+                // set new data offset
+                dataOffset = getOffset(entry);
+            }
 
-    // create entry
-    auto &entry = buffer.value<Entry>();
-    entry.id = 0xffff;
-    entry.size = 0;
-    entry.offset = (this->entryWriteOffset - this->entrySize) >> this->offsetShift; // offset of last entry in sector, gets used by getLastEntry()
-    entry.checksum = calcChecksum(entry);
+            // check if the entry is outdated (there is a newer entry with same id)
+            Element element;
+            int newer;
+            co_await findNewer(sectorIndex, entryOffset, dataOffset, entry.id, element, newer);
+            if (newer < 0) {
+                // something went wrong
+                liveSize = -1;
+                co_return;
+            }
+            if (newer == 0) {
+                element.kind = kind;
+                element.size = size;
+                element.offset = sectorOffset + dataOffset;
+
+                // determine what to write for the entry
+                enum {NONE, FOLD, TOMBSTONE, COUNTER_VALUE, COPY} action = COPY;
+                int dataSize = small ? 0 : align(size, this->info.blockSize);
+                if (kind == PATCH && collect == Collect::TOTAL) {
+                    // patch counts with its element in an older sector which gets folded with all patches
+                    action = NONE;
+                } else if (kind == PATCH) {
+                    // patch whose element is in an older sector (only in GREEDY mode): fold element and all patches,
+                    // otherwise drop the patch as its element was already copied
+                    action = NONE;
+                    co_await findElement(entry.id, element);
+                    if (element.size < 0) {
+                        // something went wrong
+                        liveSize = -1;
+                        co_return;
+                    }
+                    if (element.offset >= 0 && element.kind == PLAIN) {
+                        action = FOLD;
+                        dataSize = align(element.size, this->info.blockSize);
+                    }
+                } else if (small && size == 0) {
+                    // deleted element: keep the entry if an older sector (only in GREEDY mode) may contain the element
+                    bool contains;
+                    co_await checkOlder(sectorIndex, entry.id, contains);
+                    action = contains ? TOMBSTONE : NONE;
+                } else if (kind == COUNTER) {
+                    // counter gets written with the current value and an empty run
+                    action = COUNTER_VALUE;
+                    dataSize = getCounterSize();
+                } else if (element.patchCount > 0) {
+                    // element has newer patches
+                    action = FOLD;
+                }
 
-    // offset of close indicator entry at start of sector (index 0)
-    int offset = this->sectorOffset;
+                if (action != NONE) {
+                    liveSize += this->entrySize + dataSize;
 
-    // use next sector
-    this->sectorIndex = this->sectorIndex + 1 == this->info.sectorCount ? 0 : this->sectorIndex + 1;
-    this->sectorOffset = this->sectorIndex * this->info.sectorSize;
-    this->entryWriteOffset = this->entrySize;
-    this->dataWriteOffset = this->info.sectorSize;
+                    if (copy) {
+                        // select the cold head if possible, otherwise the newest head which has the most space left
+                        co_await selectHead(entry.id, Placement::COLD, sectorIndex);
+                        int required = this->entrySize + dataSize;
+                        if (this->head->entryWriteOffset + required > this->head->dataWriteOffset)
+                            this->head = getNewestHead();
 
-    // write close entry at start of sector
-    setOffset(offset, Command::WRITE);
-    return buffer.write(sizeof(Entry));
-}
+                        // check if entry fits, can only fail when garbage collection of another sector was interrupted
+                        if (this->head->entryWriteOffset + required > this->head->dataWriteOffset) {
+                            liveSize = -1;
+                            co_return;
+                        }
+                    }
+                }
 
-bool BufferStorage::isCloseEntryValid(const Entry &entry) {
-    // check checksum
-    if (entry.checksum != calcChecksum(entry))
-        return false;
+                if (!copy) {
+                    // only determine the size of live entries and data
+                } else if (action == FOLD) {
+                    // fold element and patches into a new copy of the element
+                    co_await fold(entry.id, element, 0, nullptr, 0);
+                } else if (action == TOMBSTONE) {
+                    co_await writeEntry(entry.id, PLAIN, 0, nullptr);
+                } else if (action == COUNTER_VALUE) {
+                    uint32_t value;
+                    int count;
+                    co_await readCounter(element, value, count);
+                    co_await writeCounter(entry.id, value + std::max(count, 0));
+                } else if (action == COPY) {
+                    if (!small) {
+                        // not a small entry: copy data (compressed data is copied as is)
+                        int offset = this->head->dataWriteOffset - dataSize;
+                        this->head->dataWriteOffset = offset;
+                        int srcOffset = sectorOffset + dataOffset;
+                        int s = size;
+                        while (s > 0) {
+                            int capacity = buffer.capacity() & ~(this->info.blockSize - 1);
+                            int toCopy = std::min(s, capacity);
 
-    // check if index is 0xffff and length is 0
-    if (entry.id != 0xffff && entry.size != 0)
-        return false;
+                            setOffset(srcOffset, Command::READ);
+                            co_await buffer.read(toCopy);
+                            // todo: check if read successful
 
-    // check if there is at least one entry and the offset is inside the sector
-    int offset = entry.offset << this->offsetShift;
-    if (offset >= this->entrySize && offset < this->info.sectorSize)
-        return false;
+                            setOffset(this->head->sectorOffset + offset, Command::WRITE);
+                            co_await writeBuffer(toCopy);
+                            srcOffset += toCopy;
+                            offset += toCopy;
+                            s -= toCopy;
+                        }
+                    }
 
-    return true;
+                    // write entry (with inline data if small)
+                    uint8_t data[MAX_SMALL_SIZE];
+                    if (small)
+                        copySmallData(entry, data);
+                    co_await writeEntry(entry.id, kind, size, data);
+                }
+            }
+        } else if (isRangeEntry(entry)) {
+            int size;
+            co_await collectRange(sectorIndex, entryOffset, dataOffset, entry.id,
+                entry.small.data[0] | (entry.small.data[1] << 8), copy, size);
+            if (size < 0) {
+                // something went wrong
+                liveSize = -1;
+                co_return;
+            }
+            liveSize += size;
+        }
+        entryOffset += this->entrySize;
+    }
 }
 
-AwaitableCoroutine BufferStorage::eraseSector(int index) {
+BufferStorage::PoolCoroutine BufferStorage::selectEntries(int sectorOffset, int lastEntryOffset, int afterId,
+    int afterOffset, EntryLocation *locations, int &count)
+{
     auto &buffer = this->buffer;
-    int sectorOffset = index * this->info.sectorSize;
-
-    if (this->info.type < Type::FLASH_4N) {
-        // generic memory: explicitly fill with 0xff
-        int s = this->info.sectorSize;
-        int offset = sectorOffset;
-        while (s > 0) {
-            int capacity = buffer.capacity() & ~(this->info.blockSize - 1);
-            int toWrite = std::min(s, capacity);
+    count = 0;
 
-            std::fill(buffer.data(), buffer.data() + capacity, 0xff);
-            setOffset(offset, Command::WRITE);
-            co_await buffer.write(toWrite);
-            offset += toWrite;
-            s -= toWrite;
+    // iterate over all entries from first to last
+    int entryOffset = this->entrySize;
+    int dataOffset = this->info.sectorSize;
+    while (entryOffset <= lastEntryOffset) {
+        setOffset(sectorOffset + entryOffset, Command::READ);
+        co_await buffer.read(this->rawEntrySize);
+        if (buffer.size() < this->rawEntrySize) {
+            // something went wrong
+            count = -1;
+            co_return;
         }
-    } else {
-        // flash: use page erase
-        for (int offset = 0; offset < this->info.sectorSize; offset += this->info.pageSize) {
-            setOffset(sectorOffset + offset, Command::ERASE);
-            co_await buffer.erase();
-//debug::set(debug::YELLOW);
+        Entry entry = buffer.value<Entry>();
+
+        bool valid = isEntryValid(entryOffset, dataOffset, entry);
+        int id = entry.id;
+        if ((valid || isRangeEntry(entry)) && (id > afterId || (id == afterId && entryOffset > afterOffset))) {
+            // insert sorted by id (entries with the same id are already in the order of their offsets), the last
+            // location gets dropped if there are too many
+            int i = count;
+            while (i > 0 && locations[i - 1].id > id)
+                --i;
+            if (i < MAX_SELECT_COUNT) {
+                int n = std::min(count + 1, MAX_SELECT_COUNT);
+                std::copy_backward(locations + i, locations + n - 1, locations + n);
+                locations[i] = {id, entryOffset, dataOffset};
+                count = n;
+            }
+        }
+        if (valid && (entry.small.size & SMALL_FLAG) == 0) {
+            // set new data offset
+            dataOffset = getOffset(entry);
         }
+        entryOffset += this->entrySize;
     }
 }
 
-AwaitableCoroutine BufferStorage::gc(int emptySectorIndex) {
-    // get sector at tail
-    int tailSectorIndex = emptySectorIndex + 1 == this->info.sectorCount ? 0 : sectorIndex + 1;
-    int tailSectorOffset = tailSectorIndex * this->info.sectorSize;
+BufferStorage::PoolCoroutine BufferStorage::collectRange(int sectorIndex, int entryOffset, int dataOffset,
+    int firstId, int lastId, bool copy, int &liveSize)
+{
+    liveSize = 0;
 
-    // copy all entries from sector at tail to the sector at head
-    int tailEntryOffset = this->entrySize;
-    int tailDataOffset = this->info.sectorSize;
-    int tailLastEntryOffset;
-    co_await getLastEntry(tailSectorOffset, tailLastEntryOffset);
-    while (tailEntryOffset <= tailLastEntryOffset) {
-        // read entry
-        setOffset(tailSectorOffset + tailEntryOffset, Command::READ);
-        co_await buffer.read(sizeof(Entry));
-        if (buffer.size() < int(sizeof(Entry))) {
+    // the range entry is only needed as long as an older sector may contain elements in the range
+    bool older = false;
+    for (int i = 0; i < this->info.sectorCount; ++i) {
+        auto state = this->sectors[i].state;
+        if ((state == SectorState::OPEN || state == SectorState::CLOSED) && isNewer(sectorIndex, i))
+            older = true;
+    }
+    if (!older) {
+        // drop the range entry, but first erase older dirty sectors as reclaimed sectors reappear as closed sectors if
+        // they were not erased before mount
+        if (copy) {
+            for (int i = 0; i < this->info.sectorCount; ++i) {
+                auto &sector = this->sectors[i];
+                if (sector.state == SectorState::DIRTY && isNewer(sectorIndex, i)) {
+                    co_await eraseSector(i);
+                    sector.state = SectorState::EMPTY;
+                }
+            }
+        }
+        co_return;
+    }
+
+    // split the range into parts that contain no ids with newer entries, write a range entry for each part to the
+    // newest head which is newer than all entries of the erased elements. The ids with newer entries get collected in
+    // one pass over the newer entries, more passes are only needed if they form more than MAX_ID_RANGE_COUNT ranges
+    int id = firstId;
+    while (id <= lastId) {
+        IdRange ranges[MAX_ID_RANGE_COUNT];
+        int count;
+        int last = lastId;
+        co_await findNewerIds(sectorIndex, entryOffset, dataOffset, id, last, ranges, count);
+        if (count < 0) {
             // something went wrong
+            liveSize = -1;
             co_return;
         }
-        Entry tailEntry = buffer.value<Entry>();
-
-        if (isEntryValid(tailEntryOffset, tailDataOffset, tailEntry)) {
-            if (tailEntry.size > SMALL_SIZE) {
-                // set new data offset, only for verification
-                tailDataOffset = tailEntry.offset << this->offsetShift;
-            }
-
-            // check if the entry is outdated (contains a newer entry with same id)
-            int searchSectorIndex = tailSectorIndex;
-            int searchEntryOffset = tailEntryOffset + this->entrySize;
-            int searchDataOffset = tailDataOffset;
-
-            // search in all sectors
-            for (int i = 0; i < this->info.sectorCount - 1; ++i) {
-                int searchSectorOffset = searchSectorIndex * this->info.sectorSize;
-
-                // get offset of last entry in allocation table
-                int searchLastEntryOffset;
-                co_await getLastEntry(searchSectorOffset, searchLastEntryOffset);
 
-                // iterate over entries
-                while (searchEntryOffset <= searchLastEntryOffset) {
-                    setOffset(searchSectorOffset + searchEntryOffset, Command::READ);
-                    co_await buffer.read(sizeof(Entry));
-                    if (buffer.size() < int(sizeof(Entry))) {
-                        // something went wrong
+        // write a range entry for each gap between the ranges of ids with newer entries
+        for (int i = 0; i <= count; ++i) {
+            int gapLast = i < count ? ranges[i].first - 1 : last;
+            if (gapLast >= id) {
+                liveSize += this->entrySize;
+                if (copy) {
+                    // check if entry fits, can only fail when garbage collection of another sector was interrupted
+                    this->head = getNewestHead();
+                    if (this->head->entryWriteOffset + this->entrySize > this->head->dataWriteOffset) {
+                        liveSize = -1;
                         co_return;
                     }
-                    Entry &searchEntry = buffer.value<Entry>();
+                    co_await writeRangeEntry(id, gapLast);
+                }
+            }
+            if (i < count)
+                id = ranges[i].last + 1;
+        }
+        id = last + 1;
+    }
+}
 
-                    // check if entry is valid
-                    if (isEntryValid(searchEntryOffset, searchDataOffset, searchEntry)) {
-                        // check if found
-                        if (searchEntry.id == tailEntry.id)
-                            goto found;
+BufferStorage::PoolCoroutine BufferStorage::gc() {
+    // nothing to do if there are enough free sectors and no dirty sector or head gets too old
+    bool old = getOldHead() != nullptr;
+    for (int i = 0; i < this->info.sectorCount; ++i) {
+        auto &sector = this->sectors[i];
+        if (sector.state == SectorState::DIRTY && int16_t(this->sequence - sector.sequence) >= MAX_SEQUENCE_AGE)
+            old = true;
+    }
+    if (!old && getFreeCount() >= this->spareCount)
+        return {};
 
-                        if (searchEntry.size > SMALL_SIZE) {
-                            // set new data offset
-                            searchDataOffset = searchEntry.offset << this->offsetShift;
-                        }
-                    }
-                    searchEntryOffset += this->entrySize;
-                }
+    return reclaimSectors();
+}
 
-                // go to next sector
-                searchSectorIndex = searchSectorIndex + 1 == info.sectorCount ? 0 : searchSectorIndex + 1;
-                searchEntryOffset = this->entrySize; // skip close entry at beginning of sector
-                searchDataOffset = this->info.sectorSize;
+BufferStorage::PoolCoroutine BufferStorage::reclaimSectors() {
+    // erase dirty sectors that get too old so that the sequence numbers stay comparable
+    for (int i = 0; i < this->info.sectorCount; ++i) {
+        auto &sector = this->sectors[i];
+        if (sector.state == SectorState::DIRTY && int16_t(this->sequence - sector.sequence) >= MAX_SEQUENCE_AGE) {
+            co_await eraseSector(i);
+            sector.state = SectorState::EMPTY;
+        }
+    }
+
+    while (true) {
+        // reclaim sectors until there are enough free sectors left for closing the heads
+        while (getFreeCount() < this->spareCount) {
+            // find oldest sector
+            int oldest = -1;
+            for (int i = 0; i < this->info.sectorCount; ++i) {
+                if (this->sectors[i].state == SectorState::CLOSED && (oldest == -1 || isNewer(oldest, i)))
+                    oldest = i;
             }
+            if (oldest < 0)
+                co_return;
 
-            // not found: copy entry if it has size > 0
+            // select the sector to reclaim, sectors that were closed before sequence numbers were introduced get
+            // reclaimed in ring order so that they stay in front of the other sectors
+            int victim = oldest;
+            if (this->gcMode == GcMode::GREEDY
+                && int16_t(this->sequence - this->sectors[oldest].sequence) < MAX_SEQUENCE_AGE
+                && !this->sectors[oldest].legacy)
             {
-                int dataSize;
-                if ((tailEntry.small.size & SMALL_FLAG) == 0) {
-                    // not a small entry: copy data
-                    dataSize = tailEntry.size;
-                    int offset = this->dataWriteOffset - align(dataSize, this->info.blockSize);
-                    this->dataWriteOffset = offset;
-                    int tailOffset = tailSectorOffset + tailDataOffset;
-                    int s = dataSize;
-                    while (s > 0) {
-                        int capacity = buffer.capacity() & ~(this->info.blockSize - 1);
-                        int toCopy = std::min(s, capacity);
-
-                        setOffset(tailOffset, Command::READ);
-                        co_await buffer.read(toCopy);
-                        // todo: check if read successful
-
-                        setOffset(this->sectorOffset + offset, Command::WRITE);
-                        co_await buffer.write(toCopy);
-                        tailOffset += toCopy;
-                        offset += toCopy;
-                        s -= toCopy;
+                // sector with the least live data that fits into the newest head, the oldest if there is a tie
+                auto newest = getNewestHead();
+                int freeSize = newest->dataWriteOffset - newest->entryWriteOffset;
+                int minLiveSize = 0x7fffffff;
+                for (int i = 0; i < this->info.sectorCount; ++i) {
+                    if (this->sectors[i].state != SectorState::CLOSED)
+                        continue;
+                    int liveSize;
+                    co_await collectSector(i, Collect::SIZE, liveSize);
+                    this->sectors[i].liveSize = liveSize;
+                    if (liveSize < 0 || liveSize > freeSize)
+                        continue;
+                    if (liveSize < minLiveSize || (liveSize == minLiveSize && isNewer(victim, i))) {
+                        victim = i;
+                        minLiveSize = liveSize;
                     }
-                } else {
-                    // small entry
-                    dataSize = tailEntry.small.size & 3;
                 }
+            }
 
-                // write entry if not empty (with inline data if tailEntry.size <= SMALL_SIZE)
-                if (dataSize > 0)
-                    co_await writeEntry(tailEntry.id, dataSize, tailEntry.small.data);
+            // copy live entries to the heads
+            auto programmedBytes = this->stats.programmedBytes;
+            int liveSize;
+            co_await collectSector(victim, Collect::COPY, liveSize);
+            this->stats.copiedBytes += this->stats.programmedBytes - programmedBytes;
+            if (liveSize < 0) {
+                // something went wrong: keep the sector
+                co_return;
+            }
+            this->sectors[victim].liveSize = liveSize;
+            ++this->stats.reclaimedSectors;
+
+            // the sector reappears as closed sector when it gets mounted before it is erased, therefore erase it now
+            // if it is newer than a head that got copies of its entries as the copies would be outdated
+            bool erase = false;
+            for (int i = 0; i < this->headCount; ++i) {
+                if (isNewer(victim, this->heads[i].sectorIndex))
+                    erase = true;
+            }
+            if (erase) {
+                co_await eraseSector(victim);
+                this->sectors[victim].state = SectorState::EMPTY;
+            } else {
+                // the sector gets erased by eraseSectors() or when it is needed by openSector()
+                this->sectors[victim].state = SectorState::DIRTY;
             }
-found:
-            ;
         }
-        tailEntryOffset += this->entrySize;
-    }
 
-    // erase sector at tail
-    co_await eraseSector(tailSectorIndex);
+        // close a head whose sector gets too old and open a new sector for it so that the sequence numbers stay
+        // comparable, e.g. the cold head when only hot elements get written. The closed sector is the oldest, therefore
+        // its live entries get reclaimed next
+        auto head = getOldHead();
+        if (head == nullptr || getFreeCount() == 0)
+            co_return;
+        this->head = head;
+        co_await closeSector();
+    }
 }
 
 } // namespace coco
@@ -3,6 +3,8 @@
 #include "Storage.hpp"
 #include <coco/Buffer.hpp>
 #include <coco/Semaphore.hpp>
+#include <array>
+#include <span>
 
 
 namespace coco {
@@ -52,7 +54,7 @@ public:
         /// Size of a page that has to be erased at once, must be power of two
         int pageSize;
 
-        /// Size of a sector, must be a multiple of pageSize and up to 32768 * blockSize
+        /// Size of a sector, must be a multiple of pageSize and up to 32768 * blockSize (any size if wideEntries is set)
         int sectorSize;
 
         /// Number of sectors, must be at least 2
@@ -63,6 +65,142 @@ public:
 
         /// Commands for serial memory (read, write, erase)
         uint8_t commands[3];
+
+        /// Memory is mapped into the address space at address (e.g. internal flash). Then read() copies the data of
+        /// elements directly into the destination without transferring it through the buffer
+        bool mapped;
+
+        /// Use the wide allocation table entry format with 32 bit size and offset. Needed for sectors larger than
+        /// 32768 * blockSize (e.g. 128K sectors) and for elements larger than 65535 bytes. Costs 4 bytes per entry
+        bool wideEntries;
+    };
+
+    /// Thresholds for compression of elements written using writeCompressed()
+    struct Compression {
+        /// Minimum size of an element so that compression is attempted
+        int minSize = 16;
+
+        /// Minimum number of bytes that have to be saved (after alignment to blockSize), otherwise the element is stored uncompressed
+        int minSaving = 8;
+    };
+
+    /// Selection of the sector that gets reclaimed by garbage collection
+    enum class GcMode : uint8_t {
+        /// Reclaim the oldest sector (the sectors are used as a ring)
+        ROUND_ROBIN,
+
+        /// Reclaim the sector with the least live data (most garbage). Needs more reads to determine the live data of
+        /// each sector but copies less data when some elements are updated more often than others
+        GREEDY
+    };
+
+    /// Options of the storage
+    struct Options {
+        /// Thresholds for compression of elements
+        Compression compression;
+
+        /// Selection of the sector that gets reclaimed by garbage collection
+        GcMode gcMode = GcMode::ROUND_ROBIN;
+
+        /// Separate hot and cold elements into two open sectors, garbage collection moves surviving elements to the
+        /// cold sector. Needs at least 3 sectors and one additional entry per sector
+        bool hotCold = false;
+
+        /// Number of free sectors that garbage collection keeps ready for closing a sector (at least 1). Reclaimed
+        /// sectors get erased by eraseSectors() or when they are needed
+        int spareCount = 1;
+
+        /// Number of coroutine frames in a frame pool that gets allocated by the constructor so that the operations
+        /// don't allocate coroutine frames on the heap. About 8 cover the nesting depth of the coroutines and some
+        /// waiting callers, 0 for no frame pool
+        int frameCount = 0;
+    };
+
+    /// Placement of written elements if hot/cold separation is enabled
+    enum class Placement : uint8_t {
+        /// Hot if the element is rewritten while its previous version is still in an open sector, otherwise cold
+        AUTO,
+
+        /// Element gets updated frequently
+        HOT,
+
+        /// Element gets updated rarely
+        COLD
+    };
+
+    /// Request for readMany()
+    struct ReadRequest {
+        /// id of element
+        int id;
+
+        /// data to read into
+        void *data;
+
+        /// number of bytes to read
+        int size;
+
+        /// number of bytes actually read or negative on error (see enum Result), set by readMany()
+        int result;
+    };
+
+    /// Destination of the snapshot written by exportAll(), e.g. a file or a connection
+    class ExportStream {
+    public:
+        virtual ~ExportStream() = default;
+
+        /// @brief Write a part of the snapshot
+        /// @param data data to write
+        /// @param size size of data to write in bytes
+        /// @param result number of bytes written or negative on error
+        /// @return use co_await on return value to await completion
+        [[nodiscard]] virtual AwaitableCoroutine write(const void *data, int size, int &result) = 0;
+    };
+
+    /// Source of the snapshot read by importAll()
+    class ImportStream {
+    public:
+        virtual ~ImportStream() = default;
+
+        /// @brief Read a part of the snapshot
+        /// @param data data to read into
+        /// @param size number of bytes to read
+        /// @param result number of bytes actually read (less than size at the end of the snapshot) or negative on error
+        /// @return use co_await on return value to await completion
+        [[nodiscard]] virtual AwaitableCoroutine read(void *data, int size, int &result) = 0;
+    };
+
+    /// Space in the storage in bytes, including the allocation table entries of the elements
+    struct Space {
+        /// Size of the live elements that garbage collection has to keep
+        int live;
+
+        /// Size of outdated elements and unused space in closed sectors that garbage collection can reclaim
+        int garbage;
+
+        /// Size that can be written without garbage collection (open sectors and free sectors that are not spare)
+        int free;
+    };
+
+    /// Statistics about the amount of data written, e.g. to calculate the write amplification
+    struct Statistics {
+        /// Number of bytes written by the user (size of elements, patches and counters)
+        int64_t writtenBytes = 0;
+
+        /// Number of bytes programmed into the memory (data, entries and bloom filters)
+        int64_t programmedBytes = 0;
+
+        /// Number of bytes programmed by garbage collection (part of programmedBytes)
+        int64_t copiedBytes = 0;
+
+        /// Number of erased sectors
+        int erasedSectors = 0;
+
+        /// Number of sectors reclaimed by garbage collection
+        int reclaimedSectors = 0;
+
+        /// Number of coroutine frames that were allocated on the heap because they did not fit into the frame pool or
+        /// there is no frame pool
+        int heapFrames = 0;
     };
 
     /// @brief Constructor.
@@ -70,24 +208,340 @@ public:
     /// @param buffer Buffer to operate on. Header capacity must match the memory type.
     BufferStorage(const Info &info, Buffer &buffer);
 
+    /// @brief Constructor.
+    /// @param info Memory info
+    /// @param buffer Buffer to operate on. Header capacity must match the memory type.
+    /// @param options Options of the storage
+    BufferStorage(const Info &info, Buffer &buffer, const Options &options);
+
+    ~BufferStorage() override;
+
     const State &state() override;
     [[nodiscard]] AwaitableCoroutine mount(int &result) override;
+
+    /// @brief Mount the storage so that it is ready for reading as soon as the sectors and heads are known. The
+    /// recovery (check for incomplete writes and interrupted erases, garbage collection after an interrupted garbage
+    /// collection) continues in the background, the first write waits until it is complete.
+    /// @param result result, see enum Result
+    /// @return use co_await on return value to await completion
+    [[nodiscard]] AwaitableCoroutine mountLazy(int &result);
     [[nodiscard]] AwaitableCoroutine clear(int &result) override;
     [[nodiscard]] AwaitableCoroutine read(int id, void *data, int size, int &result) override;
     [[nodiscard]] AwaitableCoroutine write(int id, void const *data, int size, int &result) override;
     using Storage::read;
     using Storage::write;
 
+    /// @brief Atomically read, modify and write an element with one lookup. The element is not written if the function
+    /// leaves the data unchanged. A compressed element stays compressed (if compression pays off) and a counter stays
+    /// a counter with the new value.
+    /// @param id id of element
+    /// @param data buffer for the data of the element
+    /// @param capacity capacity of the buffer
+    /// @param function function that modifies the data (see UpdateFunction)
+    /// @param context context pointer for the function
+    /// @param result number of bytes written, the negative result of the function or negative on error (see enum Result),
+    /// NOT_SUPPORTED if the function changes the size of a counter
+    /// @return use co_await on return value to await completion
+    [[nodiscard]] AwaitableCoroutine update(int id, void *data, int capacity, UpdateFunction function, void *context,
+        int &result) override;
+    using Storage::update;
+
+    /// @brief Read multiple elements in one pass over the storage from newest to oldest entry which stops as soon as all
+    /// elements are found. Faster than calling read() for each element, e.g. when reading the configuration at startup.
+    /// @param requests ids, destinations and sizes of the elements to read, receive the results (NOT_READY for all
+    /// requests if the storage is not ready)
+    /// @param result OK or negative on error (see enum Result)
+    /// @return use co_await on return value to await completion
+    [[nodiscard]] AwaitableCoroutine readMany(std::span<ReadRequest> requests, int &result);
+
+    /// @brief Export all elements as a snapshot in one pass over the storage, e.g. for a backup before a firmware
+    /// update. The snapshot contains each element once with its patches applied and a checksum, compressed elements
+    /// stay compressed and counters are exported as their value. Other operations wait until the export is complete.
+    /// @param stream stream that receives the snapshot
+    /// @param result number of exported elements or negative on error (see enum Result or error of the stream)
+    /// @return use co_await on return value to await completion
+    [[nodiscard]] AwaitableCoroutine exportAll(ExportStream &stream, int &result);
+
+    /// @brief Clear the storage and import a snapshot created by exportAll(). The elements are packed into the sectors
+    /// one after another without garbage collection, therefore the import costs about one sequential write of the
+    /// data. The memory info may differ from the one of the exporting storage. Calling mount() is not necessary.
+    /// @param stream stream that provides the snapshot
+    /// @param result number of imported elements or negative on error (see enum Result or error of the stream),
+    /// CHECKSUM_ERROR if the snapshot is invalid. The storage is not cleared if the snapshot has an invalid header and
+    /// contains the elements imported so far on other errors
+    /// @return use co_await on return value to await completion
+    [[nodiscard]] AwaitableCoroutine importAll(ImportStream &stream, int &result);
+
+    /// @brief Write an element with a placement hint for hot/cold separation.
+    /// @param id id of element
+    /// @param data data to write
+    /// @param size size of data to write in bytes
+    /// @param placement placement of the element, ignored if hot/cold separation is not enabled
+    /// @param result number of bytes written or negative on error (see enum Result)
+    /// @return use co_await on return value to await completion
+    [[nodiscard]] AwaitableCoroutine write(int id, void const *data, int size, Placement placement, int &result);
+
+    /// @brief Write an element using run length compression. The element is stored uncompressed if compression does not
+    /// pay off according to the thresholds given to the constructor or it is larger than 65535 bytes. read() decompresses
+    /// transparently.
+    /// @param id id of element
+    /// @param data data to write
+    /// @param size size of data to write in bytes
+    /// @param result number of bytes written (uncompressed size) or negative on error (see enum Result)
+    /// @return use co_await on return value to await completion
+    [[nodiscard]] AwaitableCoroutine writeCompressed(int id, void const *data, int size, int &result);
+
+    /// @brief Patch a part of an existing element. Only the patch gets written, read() applies the patches to the element
+    /// and garbage collection folds element and patches into a new copy of the element. Compressed elements can't be
+    /// patched.
+    /// @param id id of element
+    /// @param offset offset in the element, up to 65535
+    /// @param data data to write
+    /// @param size size of data to write in bytes, offset + size must not exceed the size of the element. Nothing gets
+    /// written if the size is zero
+    /// @param result number of bytes written or negative on error (see enum Result), WRITE_SIZE_EXCEEDED if the size is
+    /// negative
+    /// @return use co_await on return value to await completion
+    [[nodiscard]] AwaitableCoroutine patch(int id, int offset, void const *data, int size, int &result);
+
+    /// @brief Increment a counter. A counter reserves a run of erased blocks and each increment programs the next block,
+    /// only when the run is exhausted a new entry is written. On generic memory (MEM types) which can be written again,
+    /// each increment clears the next bit of the run instead so that a run lasts 8 * blockSize times longer. Flash
+    /// keeps one block per increment because a block may only be programmed once (e.g. internal flash with ECC). If
+    /// the element is not a counter, a new counter starting at zero is created. Use read() to get the value of the
+    /// counter as uint32_t.
+    /// @param id id of counter
+    /// @param result OK or negative on error (see enum Result)
+    /// @return use co_await on return value to await completion
+    [[nodiscard]] AwaitableCoroutine increment(int id, int &result);
+
+    /// @brief Erase all elements in a range of ids with a single range entry, e.g. for a factory reset of a subsystem.
+    /// read() returns 0 for the erased elements and garbage collection drops their entries. Garbage collection keeps
+    /// the range entry as long as an older sector may contain erased elements.
+    /// @param firstId first id of the range
+    /// @param lastId last id of the range (inclusive)
+    /// @param result OK or negative on error (see enum Result)
+    /// @return use co_await on return value to await completion
+    [[nodiscard]] AwaitableCoroutine eraseRange(int firstId, int lastId, int &result);
+
+    /// @brief Erase the sectors that were reclaimed by garbage collection so that closing a sector does not have to wait
+    /// for an erase. Call when the application is idle, e.g. from a background coroutine on the event loop. The
+    /// semaphore is released after each sector so that reads and writes can interleave.
+    /// @param result number of erased sectors or negative on error (see enum Result)
+    /// @return use co_await on return value to await completion
+    [[nodiscard]] AwaitableCoroutine eraseSectors(int &result);
+
+    /// @brief Determine the space in the storage. A write that needs more than garbage + free bytes fails immediately
+    /// with OUT_OF_MEMORY instead of garbage collecting all sectors first.
+    /// @param space receives the space in the storage
+    /// @param result OK or negative on error (see enum Result)
+    /// @return use co_await on return value to await completion
+    [[nodiscard]] AwaitableCoroutine freeSpace(Space &space, int &result);
+
+    /// @brief Get statistics about the amount of data written since construction.
+    /// @return statistics
+    const Statistics &statistics() {return this->stats;}
+
+    /// Handler that gets notified when the changes of an operation are complete in memory (e.g. to sync a memory
+    /// mapped file). Gets called once at the end of clear(), mount(), write(), patch(), increment() and eraseRange(), not
+    /// for each transfer
+    class CommitHandler {
+    public:
+        virtual ~CommitHandler() = default;
+        virtual void commit() = 0;
+    };
+
+    /// @brief Set the handler that gets notified when an operation has written all its changes.
+    /// @param handler commit handler or nullptr
+    void setCommitHandler(CommitHandler *handler) {this->commitHandler = handler;}
+
+    /// Operations that get passed to the trace handler
+    enum class Operation : uint8_t {
+        MOUNT,
+        MOUNT_LAZY,
+        CLEAR,
+        READ,
+        WRITE,
+        WRITE_HOT,
+        WRITE_COLD,
+        WRITE_COMPRESSED,
+        PATCH,
+        INCREMENT,
+        UPDATE,
+        ERASE_SECTORS,
+        EXPORT,
+        IMPORT,
+        ERASE_RANGE
+    };
+
+    /// Handler that records the operations on the storage, e.g. to replay them with a different memory info or
+    /// configuration (see StorageTrace.hpp and test/StorageReplay.cpp). Gets called when an operation is started, readMany()
+    /// is recorded as one READ for each request
+    class TraceHandler {
+    public:
+        virtual ~TraceHandler() = default;
+
+        /// @brief Record an operation
+        /// @param operation operation
+        /// @param id id of element, 0 for operations on the whole storage
+        /// @param size size of the data to read or write (capacity for UPDATE, number of ids for ERASE_RANGE), 0 if the
+        /// operation has no data
+        virtual void trace(Operation operation, int id, int size) = 0;
+    };
+
+    /// @brief Set the handler that records the operations.
+    /// @param handler trace handler or nullptr
+    void setTraceHandler(TraceHandler *handler) {this->traceHandler = handler;}
+
     /// CRC-16/CCITT-FALSE (https://crccalc.com/?crc=12&method=crc16&datatype=ascii&outtype=0)
     static uint16_t crc16(const void *data, int size, uint16_t crc = 0xffff);
 
 protected:
-    enum SectorState {
+    template <Info INFO, int FRAME_COUNT>
+    friend class BufferStorageT;
+
+    // size of a coroutine frame in the frame pool, larger frames and frames that exceed the pool are allocated on the
+    // heap
+    static constexpr int FRAME_SIZE = 512;
+
+    // header in front of each frame that points to the storage or is nullptr if the frame is allocated on the heap
+    static constexpr int FRAME_HEADER_SIZE = __STDCPP_DEFAULT_NEW_ALIGNMENT__;
+    static_assert(FRAME_SIZE % FRAME_HEADER_SIZE == 0 && FRAME_HEADER_SIZE >= sizeof(void *));
+
+    // promise of the coroutines of BufferStorage that allocates the coroutine frames from the frame pool
+    struct Promise : AwaitableCoroutine::promise_type {
+        using Base = AwaitableCoroutine::promise_type;
+
+        // forward the final awaiter of the base promise which expects a handle of the base promise
+        struct Final {
+            decltype(std::declval<Base &>().final_suspend()) final;
+
+            bool await_ready() noexcept {return this->final.await_ready();}
+            auto await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+                return this->final.await_suspend(std::coroutine_handle<Base>::from_address(handle.address()));
+            }
+            void await_resume() noexcept {this->final.await_resume();}
+        };
+        Final final_suspend() noexcept {return {Base::final_suspend()};}
+
+        // the storage is the first argument of member coroutines
+        static void *operator new(std::size_t size, BufferStorage &storage, auto &&...) {
+            return storage.allocateFrame(size);
+        }
+        static void operator delete(void *frame, std::size_t) {
+            freeFrame(frame);
+        }
+    };
+
+    // return type of the member coroutines of BufferStorage, selects the promise that uses the frame pool
+    struct PoolCoroutine : AwaitableCoroutine {
+        using promise_type = Promise;
+
+        PoolCoroutine() = default;
+        PoolCoroutine(AwaitableCoroutine &&coroutine) : AwaitableCoroutine(std::move(coroutine)) {}
+    };
+
+    // tag for the member coroutines that implement the public coroutines so that they use the frame pool
+    struct Pool {};
+    static constexpr Pool POOL = {};
+
+    PoolCoroutine mount(Pool, int &result);
+    PoolCoroutine mountLazy(Pool, int &result);
+    PoolCoroutine clear(Pool, int &result);
+    PoolCoroutine read(Pool, int id, void *data, int size, int &result);
+    PoolCoroutine readMany(Pool, std::span<ReadRequest> requests, int &result);
+    PoolCoroutine exportAll(Pool, ExportStream &stream, int &result);
+    PoolCoroutine importAll(Pool, ImportStream &stream, int &result);
+    PoolCoroutine update(Pool, int id, void *data, int capacity, UpdateFunction function, void *context, int &result);
+    PoolCoroutine patch(Pool, int id, int offset, const void *data, int size, int &result);
+    PoolCoroutine increment(Pool, int id, int &result);
+    PoolCoroutine eraseRange(Pool, int firstId, int lastId, int &result);
+    PoolCoroutine freeSpace(Pool, Space &space, int &result);
+    PoolCoroutine eraseSectors(Pool, int &result);
+
+    // allocate a coroutine frame from the frame pool
+    void *allocateFrame(std::size_t size);
+
+    // return a coroutine frame to the frame pool of its storage
+    static void freeFrame(void *frame);
+
+    enum SectorState : uint8_t {
+        // erased sector
         EMPTY,
+
+        // sector that has to be erased before it can be used (reclaimed by garbage collection or partially erased)
+        DIRTY,
+
         OPEN,
         CLOSED
     };
 
+    // state of a sector
+    struct Sector {
+        // sequence number of the sector, stored in the close entry. The open sector is the newest sector and a closed
+        // sector without valid close entry is the newest closed sector
+        uint16_t sequence;
+
+        SectorState state;
+
+        // size of live entries and data, determined by garbage collection
+        int liveSize;
+
+        // cached last entry of a closed sector (see getLastEntry()): index of the entry, LAST_ENTRY_FILTER if the
+        // sector has a bloom filter and LAST_ENTRY_SORTED if the entries are sorted by id, or LAST_ENTRY_UNKNOWN. Only
+        // valid if the state is CLOSED
+        uint16_t lastEntry = LAST_ENTRY_UNKNOWN;
+
+        // sector was closed before sequence numbers were introduced, its sequence number is derived from its position
+        bool legacy = false;
+    };
+    static constexpr uint16_t LAST_ENTRY_UNKNOWN = 0xffff;
+    static constexpr uint16_t LAST_ENTRY_FILTER = 0x8000;
+    static constexpr uint16_t LAST_ENTRY_SORTED = 0x4000;
+    static constexpr uint16_t LAST_ENTRY_INDEX = 0x3fff;
+
+    // memory for the state of the sectors and the frame pool of BufferStorageT, it is a base class in front of
+    // BufferStorage so that it is constructed before the constructor of BufferStorage initializes it
+    template <int SECTOR_COUNT, int FRAME_COUNT>
+    struct Memory {
+        Sector sectorStates[SECTOR_COUNT];
+        alignas(FRAME_HEADER_SIZE) std::array<uint8_t, FRAME_COUNT * FRAME_SIZE> framePool;
+    };
+
+    // constructor that uses the given memory for the state of the sectors and the frame pool of frameCount frames,
+    // allocates it on the heap if nullptr
+    BufferStorage(const Info &info, Buffer &buffer, const Options &options, Sector *sectors, int frameCount,
+        uint8_t *frames);
+
+    // bloom filter of the ids in a sector
+    static constexpr int MAX_FILTER_SIZE = 64;
+
+    // open sector where entries get appended
+    struct Head {
+        // index and offset of the sector
+        int sectorIndex;
+        int sectorOffset;
+
+        // write offsets in the sector
+        int entryWriteOffset;
+        int dataWriteOffset;
+
+        // bloom filter of the ids in the sector, gets written to the sector when it is closed
+        uint8_t filter[MAX_FILTER_SIZE];
+
+        // id of the last entry and if all entries are sorted by id, gets stored in the close entry
+        int lastId;
+        bool sorted;
+    };
+
+    // heads for hot and cold elements, only the hot head is used if hot/cold separation is not enabled
+    static constexpr int HOT = 0;
+    static constexpr int COLD = 1;
+
+    // maximum size of inline data of small entries, the data behind the first 3 bytes is stored in the padding of
+    // entries when the block size is larger than 8
+    static constexpr int MAX_SMALL_SIZE = 27;
+
     // allocation table entry
     union Entry {
         struct {
@@ -107,8 +561,12 @@ protected:
             // size of data
             uint16_t size;
 #endif
-            // checksum of the entry
+            // checksum of the entry, the tag of the kind of data is xored onto it if the entry is not small
             uint16_t checksum;
+
+            // upper bits of size and offset, only present in the wide entry format
+            uint16_t sizeHigh;
+            uint16_t offsetHigh;
         };
 
         struct {
@@ -128,45 +586,343 @@ protected:
             uint8_t data[3];
 #endif
             uint16_t checksum;
-        } small;
 
-        uint32_t data[2];
+            // more inline data in the padding of the entry (or in sizeHigh and offsetHigh of the wide entry format)
+            uint8_t moreData[MAX_SMALL_SIZE - 3];
+        } small;
 
-        bool empty() {return (this->data[0] & this->data[1]) == 0xffffffff;}
+        uint32_t data[3];
     };
 
-    static uint16_t calcChecksum(const Entry &entry) {
-        return crc16(&entry, offsetof(Entry, checksum));
+    // check if an allocation table entry is not written yet
+    bool isEmpty(const Entry &entry) {
+        return (entry.data[0] & entry.data[1] & (this->info.wideEntries ? entry.data[2] : 0xffffffff)) == 0xffffffff;
     }
 
+    // checksum of an allocation table entry, covers the upper bits of size and offset in the wide entry format and
+    // the inline data in the padding of small entries
+    uint16_t calcChecksum(const Entry &entry);
+
+    // get the entry in the buffer with all bytes set to 0xff to reduce flash wear
+    Entry &initEntry();
+
+    // size and inline data of a small entry
+    static int getSmallSize(const Entry &entry);
+    static void copySmallData(const Entry &entry, uint8_t *data);
+
+    // get the kind of data of an entry that is not small from its checksum, -1 if the checksum is invalid
+    int getKind(const Entry &entry);
+
+    // set the checksum of an entry including the tag of the kind of data
+    void setChecksum(Entry &entry, int kind);
+
+    // size and offset of the data of an entry that is not small
+    int getSize(const Entry &entry);
+    int getOffset(const Entry &entry);
+
+    // set size and offset of an entry that is not small
+    void setSizeAndOffset(Entry &entry, int size, int offset);
+
+    // maximum number of patches of an element, the element gets folded when this number is reached
+    static constexpr int MAX_PATCH_COUNT = 8;
+
+    // location of a patch
+    struct Patch {
+        // offset of patch data in memory
+        int offset;
+
+        // offset in element where the patch gets applied
+        int elementOffset;
+
+        // size of patch data
+        int size;
+    };
+
+    // location of an element found by findElement()
+    struct Element {
+        // kind of data
+        int kind;
+
+        // size of data as stored or negative on error
+        int size;
+
+        // offset of data in memory or -1 if data is inline
+        int offset;
+
+        // inline data
+        uint8_t data[MAX_SMALL_SIZE];
+
+        // patches from newest to oldest
+        int patchCount;
+        Patch patches[MAX_PATCH_COUNT];
+    };
+
+    // maximum number of entries selected by selectEntries() in one pass
+    static constexpr int MAX_SELECT_COUNT = 16;
+
+    // location of an entry in a sector, sorted by id and offset
+    struct EntryLocation {
+        int id;
+        int entryOffset;
+
+        // data offset of the entry before
+        int dataOffset;
+    };
+
+    // maximum number of id ranges collected by findNewerIds() in one pass
+    static constexpr int MAX_ID_RANGE_COUNT = 16;
+
+    // range of ids (inclusive)
+    struct IdRange {
+        int first;
+        int last;
+    };
+
     void setOffset(uint32_t offset, Command command);
 
+    // get pointer to memory mapped memory
+    const uint8_t *getMapped(int offset);
+
     // check if allocation table entry is valid
     bool isEntryValid(int entryOffset, int dataOffset, const Entry &entry);
 
-    // detect the entry and data offsets for an open sector
-    AwaitableCoroutine detectOffsets(int sectorIndex, std::pair<int, int>& offsets);
+    // rotate the filters of recently written ids when the hot head gets closed
+    void rotateRecentFilters();
+
+    // notify the commit handler if the statistics show that something was programmed or erased since the last commit
+    void commit();
+
+    // record an operation if a trace handler is set
+    void trace(Operation operation, int id, int size) {
+        if (this->traceHandler != nullptr)
+            this->traceHandler->trace(operation, id, size);
+    }
+
+    // check if an entry is a valid header entry that contains the sequence number and role of an open sector
+    bool isHeaderEntry(const Entry &entry);
+
+    // check if an entry is a valid range entry that erases the elements from its id to the last id in its inline data
+    bool isRangeEntry(const Entry &entry);
+
+    // check if a range entry contains the id
+    static bool rangeContains(const Entry &entry, int id) {
+        return id >= entry.id && id <= (entry.small.data[0] | (entry.small.data[1] << 8));
+    }
+
+    // detect the entry and data offsets for an open sector from its entries and fill the bloom filter of the head
+    PoolCoroutine detectOffsets(int sectorIndex, std::pair<int, int>& offsets);
+
+    // check if the data area of an open sector is actually empty and does not contain incomplete writes, reduces the
+    // data offset if necessary
+    PoolCoroutine checkData(int sectorIndex, int entryOffset, int &dataOffset);
+
+    // detect the state of the sectors and assign the open sectors to the heads
+    PoolCoroutine detectSectors(int &result);
+
+    // do the next step or all steps of the recovery after detectSectors(): check the data of the heads and the empty
+    // sectors, then open missing heads and garbage collect
+    PoolCoroutine recover(bool all, int &result);
+
+    // do the recovery in the background after mountLazy()
+    Coroutine recoverInBackground();
+
+    // erase all sectors and open the first sectors for the heads
+    PoolCoroutine clearSectors();
+
+    // write the record of an element found by findElement() or findNewer() to a snapshot (result is OK or negative
+    // on error)
+    PoolCoroutine exportElement(ExportStream &stream, int id, const Element &element, int &result);
+
+    // read the data of an element from a snapshot and write it to the selected head after the record header was read
+    // (result is OK or negative on error)
+    PoolCoroutine importElement(ImportStream &stream, int id, int kind, int size, uint16_t crc, int &result);
+
+    // write to a snapshot, result is OK or negative on error
+    PoolCoroutine writeStream(ExportStream &stream, const void *data, int size, int &result);
+
+    // read from a snapshot, result is OK, CHECKSUM_ERROR if the snapshot ends or negative on error
+    PoolCoroutine readStream(ImportStream &stream, void *data, int size, int &result);
+
+    // find the newest entry of an element and collect its patches
+    PoolCoroutine findElement(int id, Element &element);
+
+    // read the data of an element and apply its patches (result is the size of the element or negative on error)
+    PoolCoroutine readData(const Element &element, uint8_t *dst, int size, int &result);
+
+    // write a new copy of an element with all patches and an additional patch from memory applied
+    PoolCoroutine fold(int id, const Element &element, int patchOffset, const uint8_t *patchData, int patchSize);
+
+    // read base value and number of increments in the run of a counter (negative on error)
+    PoolCoroutine readCounter(const Element &element, uint32_t &value, int &count);
+
+    // write a new counter with empty run
+    PoolCoroutine writeCounter(int id, uint32_t value);
+
+    // get size of data of a counter
+    int getCounterSize();
+
+    // get the offset of the last entry and the size of the bloom filter (0 if not present) in a closed sector, uses the cached value if available
+    PoolCoroutine getLastEntry(int sectorOffset, int &entryOffsetResult, int &filterSizeResult);
+
+    // cache the offset of the last entry, the size of the bloom filter and if the entries are sorted in a closed sector
+    void setLastEntry(Sector &sector, int entryOffset, int filterSize, bool sorted);
+
+    // check if the entries of a closed sector are known to be sorted by id (call getLastEntry() before)
+    bool isSorted(int sectorIndex);
+
+    // binary search in a closed sector whose entries are sorted by id, returns the offset of the first or last entry
+    // with the given id, 0 if not found or -1 if the sector contains invalid entries and has to be searched linearly
+    PoolCoroutine searchSorted(int sectorOffset, int lastEntryOffset, int id, bool last, int &entryOffsetResult);
+
+    // check if the bloom filter of a closed sector may contain an id (true if the sector has no bloom filter)
+    PoolCoroutine checkFilter(int sectorOffset, int lastEntryOffset, int filterSize, int id, bool &contains);
+
+    // add an id to a bloom filter
+    void addToFilter(uint8_t *filter, int id);
+
+    // check if a bloom filter may contain an id
+    bool filterContains(const uint8_t *filter, int id);
+
+    // check if a bloom filter may contain the id or a range entry
+    bool mayContain(const uint8_t *filter, int id);
+
+    // write an element, optionally compressed
+    PoolCoroutine writeElement(int id, const void *data, int size, bool compress, Placement placement,
+        int &result);
+
+    // store the data of an element, called by writeElement() and update() after acquiring the semaphore (result is
+    // the size or negative on error)
+    PoolCoroutine storeElement(int id, const uint8_t *src, int size, bool compress, Placement placement,
+        int &result);
+
+    // store a counter with the given value and empty run, called by update() after acquiring the semaphore (result is
+    // the size or negative on error)
+    PoolCoroutine storeCounter(int id, uint32_t value, int &result);
+
+    // check if an element found by findElement() has the given data, compressed data gets decompressed for the
+    // comparison (the result is false if the element has patches)
+    PoolCoroutine hasData(const Element &element, const uint8_t *data, int size, bool &result);
 
-    // get the offset of the last entry in a closed sector
-    AwaitableCoroutine getLastEntry(int sectorOffset, int &entryOffsetResult);
+    // get the head of a sector or nullptr if the sector is not open
+    Head *getHead(int sectorIndex);
+
+    // get a head whose sector gets too old for comparing sequence numbers or nullptr if there is none
+    Head *getOldHead();
+
+    // get the head with the newest sector
+    Head *getNewestHead();
+
+    // select the head for writing an entry of an element. The preferred head is used if no newer sector than the
+    // head (except the excluded sector) may contain the element, otherwise the newest head. Completes without
+    // coroutine frame if no bloom filter has to be read
+    PoolCoroutine selectHead(int id, Placement placement, int excludeSectorIndex);
+
+    // select the given head if no newer sector than the head (except the excluded sector) may contain the element
+    PoolCoroutine selectHeadIfNotNewer(Head *head, int id, int excludeSectorIndex);
+
+    // open a new sector for the selected head
+    PoolCoroutine openSector();
 
     // write an entry (without data unless size is up to 2)
-    Awaitable<Buffer::Events> writeEntry(int id, int size, const uint8_t *data);
+    Awaitable<Buffer::Events> writeEntry(int id, int kind, int size, const uint8_t *data);
+
+    // write a range entry to the current head
+    Awaitable<Buffer::Events> writeRangeEntry(int firstId, int lastId);
 
-    // close the current sector
-    Awaitable<Buffer::Events> closeSector();
+    // close the sector of the selected head and open a new sector for it
+    PoolCoroutine closeSector();
 
     // check if closing allocation table entry is valid
     bool isCloseEntryValid(const Entry &entry);
 
     // erase a sector
-    AwaitableCoroutine eraseSector(int index);
+    PoolCoroutine eraseSector(int index);
+
+    // write the buffer and count the programmed bytes
+    Awaitable<Buffer::Events> writeBuffer(int size);
+
+    // check if a sector is newer than another sector
+    bool isNewer(int sectorIndex1, int sectorIndex2);
+
+    // get the next older non-empty sector or -1 if the sector is the oldest
+    int getPreviousSector(int sectorIndex);
+
+    // get the next newer non-empty sector or -1 if the sector is the newest
+    int getNextSector(int sectorIndex);
+
+    // get the newest non-empty sector
+    int getNewestSector();
+
+    // get a sector in the given state, searching in ring order after the given sector (-1 if none)
+    int getSector(int sectorIndex, SectorState state);
+
+    // get the number of empty and dirty sectors
+    int getFreeCount();
+
+    // check if a sector is completely erased
+    PoolCoroutine checkErased(int sectorIndex, bool &erased);
+
+    // check if there is a newer entry of an element than the given entry and collect the newer patches (result is 1 if
+    // a newer entry exists, 0 if not and negative on error)
+    PoolCoroutine findNewer(int sectorIndex, int entryOffset, int dataOffset, int id, Element &element, int &result);
+
+    // collect the ids from the first id up to the last id that have newer entries than the given entry as sorted ranges
+    // in one pass over the newer entries. If there are more than MAX_ID_RANGE_COUNT ranges, the last id gets lowered so
+    // that the ranges cover all ids with newer entries up to the last id (count is negative on error)
+    PoolCoroutine findNewerIds(int sectorIndex, int entryOffset, int dataOffset, int firstId, int &lastId,
+        IdRange *ranges, int &count);
+
+    // add a range of ids clipped to the first and last id to sorted ranges, lowers the last id when the maximum number
+    // of ranges is exceeded
+    static void addIdRange(IdRange *ranges, int &count, int firstId, int &lastId, int first, int last);
+
+    // check if a sector that is older than the given sector may contain an id (including dirty sectors)
+    PoolCoroutine checkOlder(int sectorIndex, int id, bool &contains);
+
+    // size of the sectors that are not kept free for closing a head, all live entries and data have to fit into it
+    int getCapacity() {
+        return (this->info.sectorCount - this->spareCount) * (this->info.sectorSize - this->firstEntryOffset);
+    }
+
+    // determine the size of the live entries and data in all sectors (negative on error)
+    PoolCoroutine determineLiveSize(int &liveSize);
+
+    // check if the given size fits into the storage when all garbage gets reclaimed, determines the size of the live
+    // entries and data only if the upper bound does not fit
+    PoolCoroutine checkSpace(int size, bool &fits);
+
+    // what collectSector() does with the live entries of a sector
+    enum class Collect {
+        // determine the size that gets copied
+        SIZE,
+
+        // determine the size as part of the total size of all sectors, patches count with their element
+        TOTAL,
+
+        // copy the live entries
+        COPY
+    };
+
+    // copy the live entries of a closed sector to the current sector or only determine their size including the
+    // entries (negative on error). The entries get copied in the order of their ids if a head is still sorted
+    PoolCoroutine collectSector(int sectorIndex, Collect collect, int &liveSize);
+
+    // select the next entries and range entries of a closed sector in the order of their ids after the given id and
+    // entry offset, in one pass over the allocation table (count is negative on error)
+    PoolCoroutine selectEntries(int sectorOffset, int lastEntryOffset, int afterId, int afterOffset,
+        EntryLocation *locations, int &count);
 
-    // copy an entry in the given sector to the current sector
-    void copyEntry(int sector, Entry &entry);
+    // copy the parts of a range entry that are not outdated by newer entries to the newest head or only determine their
+    // size (negative on error), drops the range entry if no older sector may contain elements in the range
+    PoolCoroutine collectRange(int sectorIndex, int entryOffset, int dataOffset, int firstId, int lastId, bool copy,
+        int &liveSize);
 
-    // garbage collect
-    AwaitableCoroutine gc(int emptySectorIndex);
+    // garbage collect closed sectors until the number of free sectors reaches the number of spare sectors. Completes
+    // without coroutine frame if there is nothing to do
+    PoolCoroutine gc();
+
+    // erase dirty sectors that get too old and reclaim closed sectors
+    PoolCoroutine reclaimSectors();
 
 
     // memory info
@@ -175,23 +931,120 @@ protected:
     // buffer for reading/writing on memory
     Buffer &buffer;
 
-    // size of allocation table entry (Entry) aligned to flash block size
+    // compression thresholds
+    Compression compression;
+
+    // selection of the sector that gets reclaimed by garbage collection
+    GcMode gcMode;
+
+    // number of free sectors that garbage collection keeps ready
+    int spareCount;
+
+    // size of allocation table entry that gets read and written (8 bytes or 12 bytes in the wide entry format, more if
+    // small entries store inline data in the padding)
+    int rawEntrySize;
+
+    // size of allocation table entry aligned to flash block size
     int entrySize;
 
+    // maximum size of inline data of small entries
+    int smallSize;
+
     // shift of offset allocation table entry (Entry) according to info.blockSize
     int offsetShift;
 
+    // number of blocks in the run of a counter
+    int counterRunLength;
+
+    // increments clear one bit of the run instead of programming a block (memory that can be written again)
+    bool counterBits;
+
+    // size of bloom filters and shift for the hash functions
+    int filterSize;
+    int filterShift;
+
     State stat = State::NOT_MOUNTED;
 
-    // current sector
-    int sectorIndex = 0;
-    int sectorOffset = 0;
+    // state of all sectors
+    Sector *sectors;
+
+    // last assigned sequence number
+    uint16_t sequence = 0;
+
+    // statistics
+    Statistics stats;
+
+    // size of the live entries and data when it was last determined (negative if unknown) and the number of bytes
+    // programmed other than by garbage collection at that time. The live size grows at most by the bytes programmed
+    // since then, therefore both give an upper bound
+    int liveSize = -1;
+    int64_t liveProgrammedBytes = 0;
+
+    // offset of the first entry in a sector (behind the close entry and the header entry if hot/cold separation is
+    // enabled)
+    int firstEntryOffset;
+
+    // index of the next sector to check during the recovery after mounting, sectorCount for the last step and -1 if
+    // the recovery is complete
+    int recoveryIndex = -1;
 
-    // write offsets in current sector
-    int entryWriteOffset;
-    int dataWriteOffset;
+    // heads where entries get appended and the selected head
+    int headCount;
+    Head heads[2];
+    Head *head = &heads[HOT];
+
+    // bloom filters of the ids written during the lifetime of the current and the previous hot sector, elements that
+    // get rewritten within this time are hot
+    uint8_t recentFilters[2][MAX_FILTER_SIZE];
 
     Semaphore semaphore;
+
+    // pool of coroutine frames and list of free frames
+    uint8_t *frames;
+    uint8_t *freeFrames;
+
+    // state of the sectors and frame pool were allocated on the heap by the constructor
+    bool allocated;
+
+    // handler that gets notified when an operation has written all its changes
+    CommitHandler *commitHandler = nullptr;
+
+    // statistics at the last commit
+    int64_t committedBytes = 0;
+    int committedSectors = 0;
+
+    // handler that records the operations
+    TraceHandler *traceHandler = nullptr;
+};
+
+/// @brief BufferStorage with memory info known at compile time, e.g. constexpr BufferStorage::Info info{...};
+/// BufferStorageT<info> storage(buffer);
+/// The memory info gets checked at compile time and the state of the sectors and the frame pool are part of the object
+/// instead of being allocated on the heap. The algorithms are shared with BufferStorage and use the memory info at
+/// runtime, folding it into constants saves only about 5% of the duration of scans even when transfers cost nothing
+/// (see StorageBenchmark) because each entry needs a transfer.
+/// @tparam INFO Memory info
+/// @tparam FRAME_COUNT Number of coroutine frames in the frame pool, 0 for no frame pool
+template <BufferStorage::Info INFO, int FRAME_COUNT = 0>
+class BufferStorageT : protected BufferStorage::Memory<INFO.sectorCount, FRAME_COUNT>, public BufferStorage {
+public:
+    static_assert(INFO.blockSize >= 1 && (INFO.blockSize & (INFO.blockSize - 1)) == 0,
+        "blockSize must be a power of two");
+    static_assert(INFO.pageSize >= 1 && (INFO.pageSize & (INFO.pageSize - 1)) == 0,
+        "pageSize must be a power of two");
+    static_assert(INFO.sectorSize >= 1 && INFO.sectorSize % INFO.pageSize == 0,
+        "sectorSize must be a multiple of pageSize");
+    static_assert(INFO.wideEntries || INFO.sectorSize <= 32768 * INFO.blockSize,
+        "sectorSize must be up to 32768 * blockSize or wideEntries must be set");
+    static_assert(INFO.sectorCount >= 2, "sectorCount must be at least 2");
+
+    /// @brief Constructor.
+    /// @param buffer Buffer to operate on. Header capacity must match the memory type.
+    /// @param options Options of the storage, frameCount is given by FRAME_COUNT
+    BufferStorageT(Buffer &buffer, const Options &options = {})
+        : BufferStorage(INFO, buffer, options, this->sectorStates, FRAME_COUNT, this->framePool.data())
+    {
+    }
 };
 
 } // namespace coco
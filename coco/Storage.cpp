@@ -6,4 +6,22 @@ namespace coco {
 Storage::~Storage() {
 }
 
+AwaitableCoroutine Storage::update(int id, void *data, int capacity, UpdateFunction function, void *context,
+    int &result)
+{
+    co_await read(id, data, capacity, result);
+    if (result < 0)
+        co_return;
+    int size = function(context, data, result);
+    if (size < 0) {
+        result = size;
+        co_return;
+    }
+    if (size > capacity) {
+        result = WRITE_SIZE_EXCEEDED;
+        co_return;
+    }
+    co_await write(id, data, size, result);
+}
+
 } // namespace coco
@@ -3,6 +3,8 @@
 #include <coco/ArrayBuffer.hpp>
 #include <coco/Coroutine.hpp>
 #include <coco/ContainerConcept.hpp>
+#include <cstring>
+#include <type_traits>
 
 
 namespace coco {
@@ -40,9 +42,20 @@ public:
         OUT_OF_MEMORY = -5,
 
         /// Memory is not usable, e.g. not connected or end of life of flash memory
-        FATAL_ERROR = -6
+        FATAL_ERROR = -6,
+
+        /// Operation is not supported for the element, e.g. patching a compressed element
+        NOT_SUPPORTED = -7,
+
+        /// Element was not written because it does not have the expected value (see compareAndSwap())
+        UNEXPECTED_VALUE = -8
     };
 
+    /// Function for update(), gets the current data of the element (size is 0 if the element does not exist, only up
+    /// to capacity bytes are valid if size is larger), modifies it in place and returns the new size or a negative
+    /// result to leave the element unchanged
+    using UpdateFunction = int (*)(void *context, void *data, int size);
+
 
     virtual ~Storage();
 
@@ -129,6 +142,74 @@ public:
     template <typename T> requires (ContainerConcept<T> && !ArrayConcept<T>)
     [[nodiscard]] AwaitableCoroutine write(int id, const T &container, int &result) = delete;
 
+    /// @brief Atomically read, modify and write an element. The default implementation calls read() and write(), an
+    /// implementation should do it in one operation so that no other operation can interleave.
+    /// @param id id of element
+    /// @param data buffer for the data of the element
+    /// @param capacity capacity of the buffer
+    /// @param function function that modifies the data (see UpdateFunction)
+    /// @param context context pointer for the function
+    /// @param result number of bytes written, the negative result of the function or negative on error (see enum Result)
+    /// @return use co_await on return value to await completion
+    [[nodiscard]] virtual AwaitableCoroutine update(int id, void *data, int capacity, UpdateFunction function,
+        void *context, int &result);
+
+    /// @brief Convenience wrapper for update() that takes a function object (e.g. lambda) with signature
+    /// int (void *data, int size). The function object must stay valid until completion
+    template <typename F>
+    [[nodiscard]] AwaitableCoroutine update(int id, void *data, int capacity, F &&function, int &result) {
+        using Function = std::remove_cvref_t<F>;
+        return update(id, data, capacity, [](void *context, void *data, int size) {
+            return (*reinterpret_cast<Function *>(context))(data, size);
+        }, const_cast<Function *>(&function), result);
+    }
+
+    /// @brief Atomically replace the value of an element if it has the expected value. Similar to
+    /// std::atomic::compare_exchange_strong(), the current value is returned in expected if it is not the expected value
+    /// @param id id of element
+    /// @param expected expected value, receives the current value if it is not the expected value
+    /// @param desired new value
+    /// @param result number of bytes written, UNEXPECTED_VALUE or negative on error (see enum Result)
+    /// @return use co_await on return value to await completion
+    template <typename T>
+    [[nodiscard]] AwaitableCoroutine compareAndSwap(int id, T &expected, const T &desired, int &result) {
+        T current;
+        auto function = [&expected, &desired](void *data, int size) {
+            if (size != sizeof(T) || std::memcmp(data, &expected, sizeof(T)) != 0) {
+                if (size == sizeof(T))
+                    std::memcpy(&expected, data, sizeof(T));
+                return int(UNEXPECTED_VALUE);
+            }
+            std::memcpy(data, &desired, sizeof(T));
+            return int(sizeof(T));
+        };
+        co_await update(id, &current, sizeof(T), function, result);
+    }
+
+    /// @brief Atomically add a value to an integer element, a missing element counts as zero
+    /// @param id id of element
+    /// @param value value to add
+    /// @param previous receives the value before the addition
+    /// @param result number of bytes written or negative on error (see enum Result), NOT_SUPPORTED if the element has
+    /// a different size
+    /// @return use co_await on return value to await completion
+    template <typename T> requires (std::is_integral_v<T>)
+    [[nodiscard]] AwaitableCoroutine fetchAdd(int id, T value, T &previous, int &result) {
+        T current;
+        auto function = [value, &previous](void *data, int size) {
+            if (size != 0 && size != sizeof(T))
+                return int(NOT_SUPPORTED);
+            T v = 0;
+            if (size != 0)
+                std::memcpy(&v, data, sizeof(T));
+            previous = v;
+            v += value;
+            std::memcpy(data, &v, sizeof(T));
+            return int(sizeof(T));
+        };
+        co_await update(id, &current, sizeof(T), function, result);
+    }
+
     /// @brief Erase an element, equivalent to writing data of length zero
     /// @param id id of element
     /// @return use co_await on return value to await completion
@@ -0,0 +1,74 @@
+#pragma once
+
+#include "BufferStorage.hpp"
+#include <coco/Loop.hpp>
+
+
+namespace coco {
+
+/// @brief Record of an operation in a trace of a BufferStorage, 12 bytes in native byte order.
+/// A trace is an array of records, e.g. a file that can be replayed using test/StorageReplay.cpp
+struct TraceRecord {
+    /// Time when the operation was started in milliseconds since start of the recording
+    uint32_t time;
+
+    /// Size of data to read or write (see BufferStorage::TraceHandler)
+    uint32_t size;
+
+    /// id of element
+    uint16_t id;
+
+    /// Operation
+    BufferStorage::Operation operation;
+
+    uint8_t reserved = 0;
+};
+static_assert(sizeof(TraceRecord) == 12);
+
+/// @brief Trace handler that keeps the newest records in a ring buffer in RAM.
+/// Usage: TraceRing<256> trace(loop); storage.setTraceHandler(&trace);
+/// @tparam N Number of records in the ring buffer
+template <int N>
+class TraceRing : public BufferStorage::TraceHandler {
+public:
+    /// @brief Constructor.
+    /// @param loop Event loop that provides the time stamps
+    TraceRing(Loop &loop) : loop(loop), start(loop.now()) {}
+
+    void trace(BufferStorage::Operation operation, int id, int size) override {
+        auto &record = this->records[this->count % N];
+        record.time = uint32_t((this->loop.now() - this->start) / 1ms);
+        record.size = size;
+        record.id = id;
+        record.operation = operation;
+        ++this->count;
+    }
+
+    /// @brief Get the number of records in the ring buffer.
+    /// @return number of records
+    int size() const {return this->count < N ? this->count : N;}
+
+    /// @brief Get a record.
+    /// @param index index of record from oldest (0) to newest (size() - 1)
+    /// @return record
+    const TraceRecord &operator [](int index) const {
+        return this->records[(this->count - size() + index) % N];
+    }
+
+    /// @brief Get the number of operations that were recorded, including the records that were overwritten.
+    /// @return total number of records
+    uint32_t totalCount() const {return this->count;}
+
+    /// @brief Remove all records.
+    ///
+    void clear() {this->count = 0;}
+
+protected:
+    Loop &loop;
+    decltype(std::declval<Loop &>().now()) start;
+
+    uint32_t count = 0;
+    TraceRecord records[N];
+};
+
+} // namespace coco
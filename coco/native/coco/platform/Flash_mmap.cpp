@@ -0,0 +1,141 @@
+#include "Flash_mmap.hpp"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cassert>
+
+
+namespace coco {
+
+Flash_mmap::Flash_mmap(const char *fileName, int size, int pageSize, int blockSize)
+    : size(size), pageSize(pageSize), blockSize(blockSize), dirtyBegin(size)
+{
+    this->file = open(fileName, O_RDWR | O_CREAT, 0644);
+    if (this->file < 0)
+        return;
+
+    // extend the file to the size of the flash, the new part is erased (0xff)
+    struct stat st;
+    if (fstat(this->file, &st) != 0 || (st.st_size < size && ftruncate(this->file, size) != 0)) {
+        close(this->file);
+        this->file = -1;
+        return;
+    }
+    int oldSize = std::min(int(st.st_size), size);
+
+    auto data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, this->file, 0);
+    if (data == MAP_FAILED) {
+        close(this->file);
+        this->file = -1;
+        return;
+    }
+    this->data = reinterpret_cast<uint8_t *>(data);
+    if (oldSize < size) {
+        std::fill(this->data + oldSize, this->data + size, 0xff);
+        touch(oldSize, size - oldSize);
+    }
+}
+
+Flash_mmap::~Flash_mmap() {
+    if (this->data == nullptr)
+        return;
+    sync();
+    munmap(this->data, this->size);
+    close(this->file);
+}
+
+void Flash_mmap::sync() {
+    flush(true);
+}
+
+void Flash_mmap::commit() {
+    flush(false);
+}
+
+void Flash_mmap::flush(bool sync) {
+    if (this->dirtyBegin < this->dirtyEnd) {
+        // msync() needs an address aligned to the system page size
+        int pageMask = int(sysconf(_SC_PAGESIZE)) - 1;
+        int begin = this->dirtyBegin & ~pageMask;
+        int size = this->dirtyEnd - begin;
+        if (sync) {
+            msync(this->data + begin, size, MS_SYNC);
+        } else {
+#ifdef __linux__
+            // start writeback of the dirty pages without waiting
+            sync_file_range(this->file, begin, size, SYNC_FILE_RANGE_WRITE);
+#else
+            msync(this->data + begin, size, MS_ASYNC);
+#endif
+        }
+        this->dirtyBegin = this->size;
+        this->dirtyEnd = 0;
+    }
+}
+
+void Flash_mmap::touch(int offset, int size) {
+    this->dirtyBegin = std::min(this->dirtyBegin, offset);
+    this->dirtyEnd = std::max(this->dirtyEnd, offset + size);
+}
+
+
+// Buffer
+
+Flash_mmap::Buffer::Buffer(int size, Flash_mmap &device)
+    : coco::Buffer(new uint8_t[size], size, 4), device(device)
+{
+}
+
+Flash_mmap::Buffer::~Buffer() {
+    delete [] this->p.data;
+}
+
+bool Flash_mmap::Buffer::start(Op op) {
+    auto &device = this->device;
+
+    // get address from header
+    int address = this->header<uint32_t>();
+    int size = this->p.size;
+
+    // all transfers fail if the file could not be mapped
+    if (device.data == nullptr) {
+        setReady(0);
+        return true;
+    }
+
+    // copy from/to the mapping, the transfer is complete immediately
+    switch (op) {
+    case Op::READ:
+        size = std::max(std::min(size, device.size - address), 0);
+        std::copy(device.data + address, device.data + address + size, this->p.data);
+        break;
+    case Op::WRITE:
+        assert(address % device.blockSize == 0);
+        size = std::max(std::min(size, device.size - address), 0);
+        std::copy(this->p.data, this->p.data + size, device.data + address);
+        device.touch(address, size);
+        break;
+    case Op::ERASE:
+        address &= ~(device.pageSize - 1);
+        if (address >= 0 && address + device.pageSize <= device.size) {
+            std::fill(device.data + address, device.data + address + device.pageSize, 0xff);
+            device.touch(address, device.pageSize);
+        }
+        size = 0;
+        break;
+    default:
+        assert(false);
+        return false;
+    }
+    setReady(size);
+    return true;
+}
+
+bool Flash_mmap::Buffer::cancel() {
+    // transfers complete immediately
+    return false;
+}
+
+} // namespace coco
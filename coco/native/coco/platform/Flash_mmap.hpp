@@ -0,0 +1,73 @@
+#pragma once
+
+#include <coco/Buffer.hpp>
+#include <coco/BufferStorage.hpp>
+
+
+namespace coco {
+
+/**
+    Flash emulation on a memory mapped file for running BufferStorage on a host (e.g. Linux gateway).
+    Reads, writes and erases are copies from and to the mapping which complete immediately without system call. When
+    BufferStorage commits an operation, the modified pages get scheduled for writing to the file (set the Flash_mmap as
+    commit handler of the storage). sync() writes them and waits until they are written.
+    Use with BufferStorage::Type::MEM_4N or BufferStorage::Type::FLASH_4N (header is 4 address bytes).
+    If the file can't be opened or mapped, valid() returns false and all transfers complete with zero size so that
+    mount() of the storage fails
+*/
+class Flash_mmap : public BufferStorage::CommitHandler {
+public:
+    /// @brief Constructor. Opens or creates the file and maps it into memory, a new file is filled with 0xff (erased).
+    /// @param fileName name of the file
+    /// @param size size of the emulated flash
+    /// @param pageSize size of a page that gets erased at once
+    /// @param blockSize size of a block that gets written at once
+    Flash_mmap(const char *fileName, int size, int pageSize, int blockSize);
+    ~Flash_mmap() override;
+
+    /// @brief Check if the file was opened and mapped into memory.
+    /// @return true if valid
+    bool valid() const {return this->data != nullptr;}
+
+    /// @brief Write the modified pages of the mapping to the file and wait until they are written.
+    void sync();
+
+    /// @brief Commit handler for BufferStorage, schedules the modified pages for writing to the file. On Linux the
+    /// writeback gets started using sync_file_range() as msync() with MS_ASYNC does nothing there, other systems use
+    /// msync() with MS_ASYNC.
+    void commit() override;
+
+    /**
+        Buffer for transferring data to/from the memory mapped file
+    */
+    class Buffer : public coco::Buffer {
+    public:
+        Buffer(int size, Flash_mmap &device);
+        ~Buffer() override;
+
+        bool start(Op op) override;
+        bool cancel() override;
+
+    protected:
+        Flash_mmap &device;
+    };
+
+protected:
+    // mark a range as modified
+    void touch(int offset, int size);
+
+    // write the modified pages to the file, wait until they are written if sync is true
+    void flush(bool sync);
+
+    int file;
+    uint8_t *data = nullptr;
+    int size;
+    int pageSize;
+    int blockSize;
+
+    // range of modified bytes that are not written to the file yet
+    int dirtyBegin;
+    int dirtyEnd = 0;
+};
+
+} // namespace coco
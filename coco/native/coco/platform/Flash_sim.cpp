@@ -0,0 +1,92 @@
+#include "Flash_sim.hpp"
+#include <algorithm>
+#include <cassert>
+
+
+namespace coco {
+
+Flash_sim::Flash_sim(int size, int pageSize, int blockSize, BufferStorage::Type type, const Timing &timing)
+    : data(new uint8_t[size]), size(size), pageSize(pageSize), blockSize(blockSize), type(type), timing(timing)
+{
+    assert(size <= 65536 || type == BufferStorage::Type::MEM_4N || type == BufferStorage::Type::FLASH_4N);
+    std::fill(this->data, this->data + size, 0xff);
+}
+
+Flash_sim::~Flash_sim() {
+    delete [] this->data;
+}
+
+
+// Buffer
+
+Flash_sim::Buffer::Buffer(int size, Flash_sim &device)
+    : coco::Buffer(new uint8_t[size], size,
+        device.type == BufferStorage::Type::MEM_4N || device.type == BufferStorage::Type::FLASH_4N ? 4 : 3)
+    , device(device)
+{
+}
+
+Flash_sim::Buffer::~Buffer() {
+    delete [] this->p.data;
+}
+
+bool Flash_sim::Buffer::start(Op op) {
+    auto &device = this->device;
+    auto &timing = device.timing;
+
+    // get address from header
+    int address;
+    int headerSize;
+    if (device.type == BufferStorage::Type::MEM_4N || device.type == BufferStorage::Type::FLASH_4N) {
+        address = this->header<uint32_t>();
+        headerSize = 4;
+    } else {
+        // command byte and 2 address bytes in big endian byte order, the command byte is not checked
+        const uint8_t *header = this->headerData();
+        address = (header[1] << 8) | header[2];
+        headerSize = 3;
+    }
+    int size = this->p.size;
+    bool flash = device.type == BufferStorage::Type::FLASH_4N || device.type == BufferStorage::Type::FLASH_1C2B;
+
+    // copy from/to the memory, the transfer is complete immediately and its duration is added to the virtual time
+    switch (op) {
+    case Op::READ:
+        size = std::max(std::min(size, device.size - address), 0);
+        std::copy(device.data + address, device.data + address + size, this->p.data);
+        device.t.read += timing.transaction + int64_t(headerSize + size) * timing.readByte;
+        break;
+    case Op::WRITE:
+        assert(address % device.blockSize == 0);
+        size = std::max(std::min(size, device.size - address), 0);
+        if (flash) {
+            // programming can only clear bits
+            for (int i = 0; i < size; ++i)
+                device.data[address + i] &= this->p.data[i];
+        } else {
+            std::copy(this->p.data, this->p.data + size, device.data + address);
+        }
+        device.t.program += timing.transaction + int64_t(headerSize) * timing.readByte
+            + int64_t(size) * timing.programByte;
+        break;
+    case Op::ERASE:
+        address &= ~(device.pageSize - 1);
+        if (address >= 0 && address + device.pageSize <= device.size)
+            std::fill(device.data + address, device.data + address + device.pageSize, 0xff);
+        device.t.erase += timing.transaction + int64_t(headerSize) * timing.readByte + timing.pageErase;
+        size = 0;
+        break;
+    default:
+        assert(false);
+        return false;
+    }
+    setReady(size);
+    return true;
+}
+
+bool Flash_sim::Buffer::cancel() {
+    // transfers complete immediately
+    return false;
+}
+
+} // namespace coco
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <coco/Buffer.hpp>
+#include <coco/BufferStorage.hpp>
+
+
+namespace coco {
+
+/**
+    Flash simulation in memory with a timing model for benchmarking BufferStorage on a host. Transfers complete
+    immediately, the time they would take on the device is added to a virtual time so that the costs of storage
+    algorithms (e.g. garbage collection, mount) can be evaluated quickly and deterministically.
+    Supports the header formats of all memory types of BufferStorage (4 address bytes in native byte order, or 1
+    command byte and 2 address bytes in big endian byte order). Programming flash can only clear bits, generic memory
+    gets overwritten
+*/
+class Flash_sim {
+public:
+    /// Timing model, all times in nanoseconds
+    struct Timing {
+        /// Overhead of each transfer, e.g. command, address and chip select on a serial bus
+        int transaction;
+
+        /// Time to read a byte, also used for the header bytes of each transfer
+        int readByte;
+
+        /// Time to program a byte
+        int programByte;
+
+        /// Time to erase a page
+        int pageErase;
+    };
+
+    /// Timing of typical internal flash of a microcontroller (e.g. STM32G4: 82us per 8 bytes, 22ms per 2K page)
+    static constexpr Timing INTERNAL_FLASH = {100, 10, 10250, 22000000};
+
+    /// Timing of typical serial NOR flash at 8MHz SPI clock (e.g. W25Q: 0.7ms per 256 byte page program, 45ms per
+    /// 4K sector erase)
+    static constexpr Timing SERIAL_NOR_FLASH = {5000, 1000, 3750, 45000000};
+
+    /// Virtual time spent in transfers in nanoseconds
+    struct Time {
+        int64_t read = 0;
+        int64_t program = 0;
+        int64_t erase = 0;
+
+        int64_t total() const {return this->read + this->program + this->erase;}
+    };
+
+    /// @brief Constructor. The memory is initially erased (0xff).
+    /// @param size size of the simulated flash, up to 65536 for memory types with 2 address bytes
+    /// @param pageSize size of a page that gets erased at once
+    /// @param blockSize size of a block that gets written at once
+    /// @param type memory type that determines the header format and if programming can only clear bits
+    /// @param timing timing model
+    Flash_sim(int size, int pageSize, int blockSize, BufferStorage::Type type, const Timing &timing);
+    ~Flash_sim();
+
+    /// @brief Get the virtual time spent in transfers since construction or the last call to resetTime().
+    /// @return virtual time
+    const Time &time() const {return this->t;}
+
+    /// @brief Reset the virtual time.
+    ///
+    void resetTime() {this->t = {};}
+
+    /**
+        Buffer for transferring data to/from the simulated flash
+    */
+    class Buffer : public coco::Buffer {
+    public:
+        Buffer(int size, Flash_sim &device);
+        ~Buffer() override;
+
+        bool start(Op op) override;
+        bool cancel() override;
+
+    protected:
+        Flash_sim &device;
+    };
+
+protected:
+    uint8_t *data;
+    int size;
+    int pageSize;
+    int blockSize;
+    BufferStorage::Type type;
+    Timing timing;
+
+    Time t;
+};
+
+} // namespace coco
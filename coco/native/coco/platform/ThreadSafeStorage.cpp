@@ -0,0 +1,111 @@
+#include "ThreadSafeStorage.hpp"
+#include <algorithm>
+
+
+namespace coco {
+
+ThreadSafeStorage::ThreadSafeStorage(Loop &loop, Storage &storage, Milliseconds<> minPollInterval,
+    Milliseconds<> maxPollInterval)
+    : shared(new Shared{loop, storage, minPollInterval, maxPollInterval})
+{
+    process(this->shared);
+}
+
+ThreadSafeStorage::~ThreadSafeStorage() {
+    // process() completes the requests that were not executed with NOT_READY on the loop thread
+    this->shared->stop.store(true, std::memory_order_release);
+}
+
+std::future<int> ThreadSafeStorage::read(int id, void *data, int size) {
+    auto request = new Request{nullptr, Op::READ, id, data, size, {}, {}, {}};
+    auto future = request->promise.get_future();
+    post(request);
+    return future;
+}
+
+void ThreadSafeStorage::read(int id, void *data, int size, Callback callback) {
+    post(new Request{nullptr, Op::READ, id, data, size, {}, {}, std::move(callback)});
+}
+
+std::future<int> ThreadSafeStorage::write(int id, const void *data, int size) {
+    auto d = reinterpret_cast<const uint8_t *>(data);
+    auto request = new Request{nullptr, Op::WRITE, id, nullptr, size, {d, d + size}, {}, {}};
+    auto future = request->promise.get_future();
+    post(request);
+    return future;
+}
+
+void ThreadSafeStorage::write(int id, const void *data, int size, Callback callback) {
+    auto d = reinterpret_cast<const uint8_t *>(data);
+    post(new Request{nullptr, Op::WRITE, id, nullptr, size, {d, d + size}, {}, std::move(callback)});
+}
+
+void ThreadSafeStorage::post(Request *request) {
+    // push onto the queue, the consumer reverses the order
+    auto &queue = this->shared->queue;
+    request->next = queue.load(std::memory_order_relaxed);
+    while (!queue.compare_exchange_weak(request->next, request, std::memory_order_release,
+        std::memory_order_relaxed))
+    {
+    }
+}
+
+Coroutine ThreadSafeStorage::process(std::shared_ptr<Shared> shared) {
+    auto pollInterval = shared->minPollInterval;
+    while (true) {
+        // take all queued requests at once, all requests posted before the destructor are in the queue when stop is set
+        bool stop = shared->stop.load(std::memory_order_acquire);
+        auto request = shared->queue.exchange(nullptr, std::memory_order_acquire);
+        if (request == nullptr) {
+            if (stop)
+                co_return;
+
+            // wait for new requests, the interval gets longer while the queue stays empty
+            co_await shared->loop.sleep(pollInterval);
+            pollInterval = std::min(pollInterval * 2, shared->maxPollInterval);
+            continue;
+        }
+        pollInterval = shared->minPollInterval;
+
+        // reverse to the order in which the requests were posted
+        Request *batch = nullptr;
+        while (request != nullptr) {
+            auto next = request->next;
+            request->next = batch;
+            batch = request;
+            request = next;
+        }
+
+        // execute the batch, the requests that are left when the front end gets destroyed get NOT_READY
+        while (batch != nullptr) {
+            request = batch;
+            int result;
+            if (shared->stop.load(std::memory_order_acquire)) {
+                result = Storage::NOT_READY;
+            } else if (request->op == Op::READ) {
+                co_await shared->storage.read(request->id, request->data, request->size, result);
+            } else if (isOverwritten(request)) {
+                // combine with the later write
+                result = request->size;
+            } else {
+                co_await shared->storage.write(request->id, request->writeData.data(), request->size, result);
+            }
+            if (request->callback)
+                request->callback(result);
+            else
+                request->promise.set_value(result);
+            batch = request->next;
+            delete request;
+        }
+    }
+}
+
+bool ThreadSafeStorage::isOverwritten(Request *request) {
+    for (auto r = request->next; r != nullptr; r = r->next) {
+        if (r->id == request->id)
+            return r->op == Op::WRITE;
+    }
+    return false;
+}
+
+} // namespace coco
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <coco/Loop.hpp>
+#include <coco/Storage.hpp>
+#include <atomic>
+#include <functional>
+#include <future>
+#include <memory>
+#include <vector>
+
+
+namespace coco {
+
+/**
+    Thread safe front end for a Storage for native multi-threaded use. Any thread can post requests which get queued
+    in a lock-free multi producer single consumer queue and get executed on the loop of the storage. All requests that
+    are queued when the loop picks them up are executed as one batch in which consecutive writes to the same id are
+    combined, i.e. only the last one gets written. The result of a request is delivered through a future or a callback
+    (which gets called on the loop thread). When the front end gets destroyed, the requests that were not executed yet
+    get completed with Storage::NOT_READY on the loop thread. Only the storage operation in progress (if any) gets
+    finished, therefore the storage must live until the loop has finished it.
+*/
+class ThreadSafeStorage {
+public:
+    using Callback = std::function<void (int result)>;
+
+    /// @brief Constructor.
+    /// @param loop event loop on which the storage is used
+    /// @param storage storage that must be mounted before requests get posted
+    /// @param minPollInterval interval in which the loop checks for new requests when the queue became empty
+    /// @param maxPollInterval the interval doubles up to this value while the queue stays empty
+    ThreadSafeStorage(Loop &loop, Storage &storage, Milliseconds<> minPollInterval = 1ms,
+        Milliseconds<> maxPollInterval = 32ms);
+    ~ThreadSafeStorage();
+
+    /// @brief Read an element, can be called from any thread.
+    /// @param id id of element
+    /// @param data data to read into, must stay valid until the result is available
+    /// @param size number of bytes to read
+    /// @return future that receives the number of bytes read or negative on error (see Storage::Result)
+    std::future<int> read(int id, void *data, int size);
+    void read(int id, void *data, int size, Callback callback);
+
+    /// @brief Write an element, can be called from any thread. The data gets copied.
+    /// @param id id of element
+    /// @param data data to write
+    /// @param size size of data to write in bytes
+    /// @return future that receives the number of bytes written or negative on error (see Storage::Result)
+    std::future<int> write(int id, const void *data, int size);
+    void write(int id, const void *data, int size, Callback callback);
+
+    /// @brief Erase an element, can be called from any thread.
+    /// @param id id of element
+    /// @return future that receives the result (see Storage::Result)
+    std::future<int> erase(int id) {return write(id, nullptr, 0);}
+    void erase(int id, Callback callback) {write(id, nullptr, 0, std::move(callback));}
+
+protected:
+    enum class Op {
+        READ,
+        WRITE
+    };
+
+    struct Request {
+        // next request in the queue
+        Request *next;
+
+        Op op;
+        int id;
+
+        // destination of read or size of write
+        void *data;
+        int size;
+
+        // copy of the data to write
+        std::vector<uint8_t> writeData;
+
+        // receives the result if no callback is given
+        std::promise<int> promise;
+        Callback callback;
+    };
+
+    // state that is shared with process() which finishes after the front end is destroyed
+    struct Shared {
+        Loop &loop;
+        Storage &storage;
+        Milliseconds<> minPollInterval;
+        Milliseconds<> maxPollInterval;
+
+        // queue of posted requests in reverse order
+        std::atomic<Request *> queue = nullptr;
+
+        // set by the destructor, process() completes the remaining requests and returns
+        std::atomic<bool> stop = false;
+    };
+
+    // add a request to the queue (lock-free)
+    void post(Request *request);
+
+    // wait for requests and execute them on the loop until the front end is destroyed
+    static Coroutine process(std::shared_ptr<Shared> shared);
+
+    // check if a write request gets overwritten by a later write in the same batch before the id is used again
+    static bool isOverwritten(Request *request);
+
+    std::shared_ptr<Shared> shared;
+};
+
+} // namespace coco
@@ -0,0 +1,200 @@
+#include <coco/BufferStorage.hpp>
+#include <coco/debug.hpp>
+#include <coco/PseudoRandom.hpp>
+#include <coco/StreamOperators.hpp>
+#include <StorageTest.hpp>
+#ifdef NATIVE
+#include <iostream>
+#endif
+
+
+using namespace coco;
+
+/*
+    Benchmark for the write amplification of the garbage collection modes with and without hot/cold separation.
+    Workload: a set of cold elements that get rewritten rarely and a few hot elements that get rewritten all the time
+
+    Benchmark for the duration of scans through the allocation tables of all sectors with memory info given at runtime
+    (BufferStorage) and at compile time (BufferStorageT), both with a frame pool of the same size
+*/
+
+// size of sectors used by the benchmark
+constexpr int SECTOR_SIZE = 2048;
+
+// number and size of cold elements
+constexpr int COLD_COUNT = 48;
+constexpr int COLD_SIZE = 100;
+
+// number and size of hot elements
+constexpr int HOT_COUNT = 8;
+constexpr int HOT_SIZE = 100;
+
+// number of writes, each COLD_INTERVAL'th write is a cold element
+constexpr int WRITE_COUNT = 5000;
+constexpr int COLD_INTERVAL = 10;
+
+// number of rounds of reading all cold elements and the same number of missing elements
+constexpr int SCAN_COUNT = 20;
+
+// memory info with small sectors so that there are enough sectors to choose from
+constexpr BufferStorage::Info benchmarkInfo = [] {
+    BufferStorage::Info info = storageInfo;
+    info.sectorSize = std::max(storageInfo.pageSize, SECTOR_SIZE);
+    info.sectorCount = storageInfo.sectorSize * storageInfo.sectorCount / info.sectorSize;
+    return info;
+}();
+
+
+AwaitableCoroutine benchmark(Loop &loop, Buffer &flashBuffer, BufferStorage::GcMode gcMode, bool hotCold,
+    int &result)
+{
+    BufferStorage::Options options;
+    options.gcMode = gcMode;
+    options.hotCold = hotCold;
+    options.frameCount = 8;
+    BufferStorage storage(benchmarkInfo, flashBuffer, options);
+
+    // random generator for selecting elements
+    KissRandom random;
+
+    uint8_t buffer[128];
+
+    co_await storage.clear(result);
+    if (result != Storage::OK) {
+        debug::out << "Error: Clear\n";
+        co_return;
+    }
+
+    // write cold elements
+    for (int i = 0; i < COLD_COUNT; ++i) {
+        int id = 100 + i;
+        std::fill(buffer, buffer + COLD_SIZE, uint8_t(id));
+        co_await storage.write(id, buffer, COLD_SIZE, result);
+        if (result != COLD_SIZE) {
+            debug::out << "Error: Write cold (" << dec(i) << ")\n";
+            co_return;
+        }
+    }
+
+    // rewrite elements
+    for (int i = 0; i < WRITE_COUNT; ++i) {
+        int id;
+        int size;
+        if (i % COLD_INTERVAL == 0) {
+            id = 100 + random.draw() % COLD_COUNT;
+            size = COLD_SIZE;
+            std::fill(buffer, buffer + size, uint8_t(id));
+        } else {
+            id = 10 + random.draw() % HOT_COUNT;
+            size = HOT_SIZE;
+            std::fill(buffer, buffer + size, uint8_t(i));
+        }
+        co_await storage.write(id, buffer, size, result);
+        if (result != size) {
+            debug::out << "Error: Write (" << dec(i) << ")\n";
+            co_return;
+        }
+    }
+
+    // check cold elements
+    for (int i = 0; i < COLD_COUNT; ++i) {
+        int id = 100 + i;
+        co_await storage.read(id, buffer, result);
+        if (result != COLD_SIZE || buffer[0] != uint8_t(id) || buffer[COLD_SIZE - 1] != uint8_t(id)) {
+            debug::out << "Error: Check cold (" << dec(i) << ")\n";
+            result = Storage::FATAL_ERROR;
+            co_return;
+        }
+    }
+
+    // report write amplification (programmed bytes / written bytes)
+    auto &statistics = storage.statistics();
+    debug::out << (gcMode == BufferStorage::GcMode::GREEDY ? "Greedy" : "Round robin")
+        << (hotCold ? ", hot/cold" : "") << ":\n";
+    debug::out << "  Written: " << dec(int(statistics.writtenBytes)) << '\n';
+    debug::out << "  Programmed: " << dec(int(statistics.programmedBytes)) << '\n';
+    debug::out << "  Copied by GC: " << dec(int(statistics.copiedBytes)) << '\n';
+    debug::out << "  Erased sectors: " << dec(statistics.erasedSectors) << '\n';
+    debug::out << "  Heap frames: " << dec(statistics.heapFrames) << '\n';
+    int wa = int(statistics.programmedBytes * 100 / statistics.writtenBytes);
+    debug::out << "  Write amplification: " << dec(wa / 100) << '.' << dec(wa / 10 % 10) << dec(wa % 10) << '\n';
+    result = Storage::OK;
+}
+
+AwaitableCoroutine scan(Loop &loop, BufferStorage &storage, const char *name, int &result) {
+    uint8_t buffer[128];
+
+    // fill the storage with cold elements and garbage of hot elements
+    co_await storage.clear(result);
+    if (result != Storage::OK) {
+        debug::out << "Error: Clear\n";
+        co_return;
+    }
+    for (int i = 0; i < COLD_COUNT * COLD_INTERVAL; ++i) {
+        int id = i % COLD_INTERVAL == 0 ? 100 + i / COLD_INTERVAL : 10 + i % HOT_COUNT;
+        std::fill(buffer, buffer + COLD_SIZE, uint8_t(id));
+        co_await storage.write(id, buffer, COLD_SIZE, result);
+        if (result != COLD_SIZE) {
+            debug::out << "Error: Write (" << dec(i) << ")\n";
+            co_return;
+        }
+    }
+
+    // read cold elements (found in old sectors) and missing elements (scan of all sectors)
+    auto start = loop.now();
+    for (int j = 0; j < SCAN_COUNT; ++j) {
+        for (int i = 0; i < COLD_COUNT; ++i) {
+            int id = 100 + i;
+            co_await storage.read(id, buffer, result);
+            if (result != COLD_SIZE || buffer[0] != uint8_t(id)) {
+                debug::out << "Error: Check cold (" << dec(i) << ")\n";
+                result = Storage::FATAL_ERROR;
+                co_return;
+            }
+            co_await storage.read(1000 + i, buffer, result);
+            if (result != 0) {
+                debug::out << "Error: Check missing (" << dec(i) << ")\n";
+                result = Storage::FATAL_ERROR;
+                co_return;
+            }
+        }
+    }
+    auto end = loop.now();
+    debug::out << name << ":\n";
+    debug::out << "  Scan duration: " << dec(int((end - start) / 1us)) << "us\n";
+    result = Storage::OK;
+}
+
+Coroutine test(Loop &loop, Buffer &flashBuffer) {
+    int result = Storage::OK;
+    for (int hotCold = 0; hotCold < 2 && result == Storage::OK; ++hotCold) {
+        co_await benchmark(loop, flashBuffer, BufferStorage::GcMode::ROUND_ROBIN, hotCold != 0, result);
+        if (result == Storage::OK)
+            co_await benchmark(loop, flashBuffer, BufferStorage::GcMode::GREEDY, hotCold != 0, result);
+    }
+    if (result == Storage::OK) {
+        BufferStorage::Options options;
+        options.frameCount = 8;
+        BufferStorage storage(benchmarkInfo, flashBuffer, options);
+        co_await scan(loop, storage, "BufferStorage", result);
+    }
+    if (result == Storage::OK) {
+        BufferStorageT<benchmarkInfo, 8> storage(flashBuffer);
+        co_await scan(loop, storage, "BufferStorageT", result);
+    }
+    if (result == Storage::OK)
+        debug::out << "Success!\n";
+
+#ifdef NATIVE
+    loop.exit();
+#endif
+}
+
+int main() {
+    debug::init();
+    Drivers drivers;
+
+    test(drivers.loop, drivers.buffer);
+
+    drivers.loop.run();
+}
@@ -0,0 +1,306 @@
+#include <coco/BufferStorage.hpp>
+#include <coco/StorageTrace.hpp>
+#include <coco/platform/Flash_sim.hpp>
+#include <StorageTest.hpp>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+
+using namespace coco;
+
+/*
+    Replay of a trace that was recorded using a trace handler (see StorageTrace.hpp) on a storage with the given memory
+    info and configuration. Reports latency, write amplification and garbage collection statistics so that the sector
+    size and count can be tuned for a real workload. The latency is the virtual time of a simulated flash (Flash_sim)
+    and therefore deterministic. The data of the elements is generated, only the size is taken from the trace, patches
+    are applied at offset 0. The storage gets cleared before the replay.
+
+    Usage: StorageReplay <trace file> [options]
+        --block-size <n>      Size of a block that has to be written at once
+        --page-size <n>       Size of a page that has to be erased at once
+        --sector-size <n>     Size of a sector
+        --sector-count <n>    Number of sectors
+        --flash               Flash with page erase instead of generic memory
+        --serial              Serial memory with command byte and 2 address bytes (e.g. SPI flash, up to 64K)
+        --timing <name>       Timing model of the simulated flash: internal (default) or nor
+        --wide                Wide allocation table entry format
+        --buffer <n>          Capacity of the buffer
+        --greedy              Greedy garbage collection
+        --hot-cold            Hot/cold separation
+        --spare <n>           Number of spare sectors
+    The defaults are taken from StorageTest.hpp
+*/
+
+// test data, contains runs of zeros so that it can be compressed
+uint8_t value(int id, int j) {
+    return (j & 16) == 0 ? uint8_t(id + j) : 0;
+}
+
+// names of the operations
+const char *operationNames[] = {"mount", "mountLazy", "clear", "read", "write", "write hot", "write cold",
+    "writeCompressed", "patch", "increment", "update", "eraseSectors", "exportAll", "importAll", "eraseRange"};
+constexpr int OPERATION_COUNT = std::size(operationNames);
+
+// stream that keeps the snapshot of exportAll() for the next importAll()
+class SnapshotStream : public BufferStorage::ExportStream, public BufferStorage::ImportStream {
+public:
+    AwaitableCoroutine write(const void *data, int size, int &result) override {
+        auto d = reinterpret_cast<const uint8_t *>(data);
+        this->snapshot.insert(this->snapshot.end(), d, d + size);
+        result = size;
+        co_return;
+    }
+
+    AwaitableCoroutine read(void *data, int size, int &result) override {
+        result = std::min(size, int(this->snapshot.size() - this->position));
+        std::copy(this->snapshot.begin() + this->position, this->snapshot.begin() + this->position + result,
+            reinterpret_cast<uint8_t *>(data));
+        this->position += result;
+        co_return;
+    }
+
+    std::vector<uint8_t> snapshot;
+    size_t position = 0;
+};
+
+// latency of an operation
+struct Latency {
+    int count = 0;
+    int errors = 0;
+    int64_t total = 0;
+    int64_t max = 0;
+};
+
+Coroutine replay(Loop &loop, Flash_sim &flash, BufferStorage &storage, const std::vector<TraceRecord> &trace) {
+    std::vector<uint8_t> data;
+    std::vector<int> sizes(65536);
+    Latency latencies[OPERATION_COUNT];
+    SnapshotStream stream;
+
+    int result;
+    co_await storage.clear(result);
+    if (result != Storage::OK) {
+        std::cout << "Error: Clear" << std::endl;
+        loop.exit();
+        co_return;
+    }
+    auto statistics = storage.statistics();
+
+    for (auto &record : trace) {
+        int operation = int(record.operation);
+        int id = record.id;
+        int size = record.size;
+        if (operation >= OPERATION_COUNT)
+            continue;
+        if (int(data.size()) < size)
+            data.resize(size);
+
+        // generate data for write operations
+        if (record.operation >= BufferStorage::Operation::WRITE && record.operation <= BufferStorage::Operation::PATCH) {
+            for (int j = 0; j < size; ++j)
+                data[j] = value(id, j);
+        }
+
+        auto start = flash.time().total();
+        switch (record.operation) {
+        case BufferStorage::Operation::MOUNT:
+            co_await storage.mount(result);
+            break;
+        case BufferStorage::Operation::MOUNT_LAZY:
+            co_await storage.mountLazy(result);
+            break;
+        case BufferStorage::Operation::CLEAR:
+            co_await storage.clear(result);
+            std::fill(sizes.begin(), sizes.end(), 0);
+            break;
+        case BufferStorage::Operation::READ:
+            co_await storage.read(id, data.data(), size, result);
+            break;
+        case BufferStorage::Operation::WRITE:
+            co_await storage.write(id, data.data(), size, result);
+            break;
+        case BufferStorage::Operation::WRITE_HOT:
+            co_await storage.write(id, data.data(), size, BufferStorage::Placement::HOT, result);
+            break;
+        case BufferStorage::Operation::WRITE_COLD:
+            co_await storage.write(id, data.data(), size, BufferStorage::Placement::COLD, result);
+            break;
+        case BufferStorage::Operation::WRITE_COMPRESSED:
+            co_await storage.writeCompressed(id, data.data(), size, result);
+            break;
+        case BufferStorage::Operation::PATCH:
+            size = std::min(size, sizes[id]);
+            co_await storage.patch(id, 0, data.data(), size, result);
+            break;
+        case BufferStorage::Operation::INCREMENT:
+            co_await storage.increment(id, result);
+            break;
+        case BufferStorage::Operation::UPDATE:
+            // modify the first byte of the element
+            co_await storage.update(id, data.data(), size, [size](void *data, int s) {
+                s = s == 0 ? size : std::min(s, size);
+                if (s > 0)
+                    ++*reinterpret_cast<uint8_t *>(data);
+                return s;
+            }, result);
+            break;
+        case BufferStorage::Operation::ERASE_SECTORS:
+            co_await storage.eraseSectors(result);
+            break;
+        case BufferStorage::Operation::EXPORT:
+            stream.snapshot.clear();
+            co_await storage.exportAll(stream, result);
+            break;
+        case BufferStorage::Operation::IMPORT:
+            stream.position = 0;
+            co_await storage.importAll(stream, result);
+            break;
+        case BufferStorage::Operation::ERASE_RANGE:
+            co_await storage.eraseRange(id, std::min(id + size - 1, 0xffff), result);
+            if (result >= 0)
+                std::fill(sizes.begin() + id, sizes.begin() + std::min(id + size, 65536), 0);
+            break;
+        }
+        auto end = flash.time().total();
+
+        // update sizes of elements for patches
+        if (result >= 0) {
+            if (record.operation >= BufferStorage::Operation::WRITE
+                && record.operation <= BufferStorage::Operation::WRITE_COMPRESSED)
+            {
+                sizes[id] = size;
+            } else if (record.operation == BufferStorage::Operation::INCREMENT) {
+                sizes[id] = 0;
+            }
+        }
+
+        auto &latency = latencies[operation];
+        int64_t duration = (end - start) / 1000;
+        ++latency.count;
+        if (result < 0)
+            ++latency.errors;
+        latency.total += duration;
+        latency.max = std::max(latency.max, duration);
+    }
+
+    // report latency of the operations
+    std::cout << "Replayed " << trace.size() << " operations of "
+        << (trace.empty() ? 0 : trace.back().time - trace.front().time) << "ms" << std::endl;
+    std::cout << std::left << std::setw(16) << "Operation" << std::right << std::setw(10) << "Count"
+        << std::setw(8) << "Errors" << std::setw(12) << "Avg (us)" << std::setw(12) << "Max (us)" << std::endl;
+    for (int i = 0; i < OPERATION_COUNT; ++i) {
+        auto &latency = latencies[i];
+        if (latency.count == 0)
+            continue;
+        std::cout << std::left << std::setw(16) << operationNames[i] << std::right << std::setw(10) << latency.count
+            << std::setw(8) << latency.errors << std::setw(12) << latency.total / latency.count
+            << std::setw(12) << latency.max << std::endl;
+    }
+
+    // report statistics of the replay (without the initial clear)
+    auto &s = storage.statistics();
+    int64_t written = s.writtenBytes - statistics.writtenBytes;
+    int64_t programmed = s.programmedBytes - statistics.programmedBytes;
+    std::cout << "Written: " << written << std::endl;
+    std::cout << "Programmed: " << programmed << std::endl;
+    std::cout << "Copied by GC: " << s.copiedBytes - statistics.copiedBytes << std::endl;
+    std::cout << "Reclaimed sectors: " << s.reclaimedSectors - statistics.reclaimedSectors << std::endl;
+    std::cout << "Erased sectors: " << s.erasedSectors - statistics.erasedSectors << std::endl;
+    std::cout << "Heap frames: " << s.heapFrames - statistics.heapFrames << std::endl;
+    auto &time = flash.time();
+    std::cout << "Virtual time (read/program/erase): " << time.read / 1000000 << "ms/" << time.program / 1000000
+        << "ms/" << time.erase / 1000000 << "ms" << std::endl;
+    if (written > 0) {
+        std::cout << "Write amplification: " << std::fixed << std::setprecision(2) << double(programmed) / written
+            << std::endl;
+    }
+
+    loop.exit();
+}
+
+int main(int argc, const char **argv) {
+    if (argc < 2) {
+        std::cout << "Usage: StorageReplay <trace file> [options]" << std::endl;
+        return 1;
+    }
+
+    // read trace
+    std::ifstream file(argv[1], std::ios::binary);
+    if (!file) {
+        std::cout << "Error: Can't open " << argv[1] << std::endl;
+        return 1;
+    }
+    std::vector<TraceRecord> trace;
+    TraceRecord record;
+    while (file.read(reinterpret_cast<char *>(&record), sizeof(TraceRecord)))
+        trace.push_back(record);
+
+    // parse options, the defaults are taken from StorageTest.hpp
+    BufferStorage::Info info = storageInfo;
+    int bufferCapacity = 256;
+    BufferStorage::Options options;
+    bool flash = false;
+    bool serial = false;
+    Flash_sim::Timing timing = Flash_sim::INTERNAL_FLASH;
+    for (int i = 2; i < argc; ++i) {
+        std::string option = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (option == "--block-size" && hasValue) {
+            info.blockSize = std::stoi(argv[++i]);
+        } else if (option == "--page-size" && hasValue) {
+            info.pageSize = std::stoi(argv[++i]);
+        } else if (option == "--sector-size" && hasValue) {
+            info.sectorSize = std::stoi(argv[++i]);
+        } else if (option == "--sector-count" && hasValue) {
+            info.sectorCount = std::stoi(argv[++i]);
+        } else if (option == "--flash") {
+            flash = true;
+        } else if (option == "--serial") {
+            serial = true;
+        } else if (option == "--timing" && hasValue) {
+            std::string name = argv[++i];
+            if (name == "nor") {
+                timing = Flash_sim::SERIAL_NOR_FLASH;
+            } else if (name != "internal") {
+                std::cout << "Error: Unknown timing " << name << std::endl;
+                return 1;
+            }
+        } else if (option == "--wide") {
+            info.wideEntries = true;
+        } else if (option == "--buffer" && hasValue) {
+            bufferCapacity = std::stoi(argv[++i]);
+        } else if (option == "--greedy") {
+            options.gcMode = BufferStorage::GcMode::GREEDY;
+        } else if (option == "--hot-cold") {
+            options.hotCold = true;
+        } else if (option == "--spare" && hasValue) {
+            options.spareCount = std::stoi(argv[++i]);
+        } else {
+            std::cout << "Error: Unknown option " << option << std::endl;
+            return 1;
+        }
+    }
+    info.type = serial ? (flash ? BufferStorage::Type::FLASH_1C2B : BufferStorage::Type::MEM_1C2B)
+        : (flash ? BufferStorage::Type::FLASH_4N : BufferStorage::Type::MEM_4N);
+    if (serial) {
+        // commands of typical SPI flash: read, page program, 4K sector erase
+        info.commands[0] = 0x03;
+        info.commands[1] = 0x02;
+        info.commands[2] = 0x20;
+    }
+    std::cout << "Block size: " << info.blockSize << ", page size: " << info.pageSize << ", sector size: "
+        << info.sectorSize << ", sector count: " << info.sectorCount << std::endl;
+
+    Loop_native loop;
+    Flash_sim device{info.sectorSize * info.sectorCount, info.pageSize, info.blockSize, info.type, timing};
+    Flash_sim::Buffer buffer{bufferCapacity, device};
+    BufferStorage storage(info, buffer, options);
+
+    replay(loop, device, storage, trace);
+
+    loop.run();
+    return 0;
+}
@@ -1,15 +1,103 @@
 #include <coco/BufferStorage.hpp>
+#include <coco/BufferLog.hpp>
+#include <coco/StorageTrace.hpp>
 #include <coco/debug.hpp>
 #include <coco/PseudoRandom.hpp>
 #include <coco/StreamOperators.hpp>
 #include <StorageTest.hpp>
 #ifdef NATIVE
+#include <coco/platform/Flash_sim.hpp>
 #include <iostream>
+#include <vector>
+#endif
+#if defined(NATIVE) && !defined(_WIN32)
+#include <coco/platform/Flash_mmap.hpp>
+#include <coco/platform/ThreadSafeStorage.hpp>
+#include <thread>
 #endif
 
 
 using namespace coco;
 
+// test data, contains runs of zeros so that it can be compressed
+uint8_t value(int id, int j) {
+    return (j & 16) == 0 ? uint8_t(id + j) : 0;
+}
+
+// memory info with at least 3 sectors (if the memory is large enough) for testing the options of the storage
+constexpr BufferStorage::Info optionsInfo = [] {
+    BufferStorage::Info info = storageInfo;
+    info.sectorSize = std::max(storageInfo.pageSize, storageInfo.sectorSize * storageInfo.sectorCount / 4);
+    info.sectorCount = storageInfo.sectorSize * storageInfo.sectorCount / info.sectorSize;
+    return info;
+}();
+
+#ifdef NATIVE
+// stream that keeps a snapshot of the storage in memory
+class SnapshotStream : public BufferStorage::ExportStream, public BufferStorage::ImportStream {
+public:
+    AwaitableCoroutine write(const void *data, int size, int &result) override {
+        auto d = reinterpret_cast<const uint8_t *>(data);
+        this->snapshot.insert(this->snapshot.end(), d, d + size);
+        result = size;
+        co_return;
+    }
+
+    AwaitableCoroutine read(void *data, int size, int &result) override {
+        result = std::min(size, int(this->snapshot.size() - this->position));
+        std::copy(this->snapshot.begin() + this->position, this->snapshot.begin() + this->position + result,
+            reinterpret_cast<uint8_t *>(data));
+        this->position += result;
+        co_return;
+    }
+
+    std::vector<uint8_t> snapshot;
+    size_t position = 0;
+};
+
+// write a sector in the format before sequence numbers were introduced: entries of 8 bytes behind the close entry,
+// data of 16 bytes for each element from the end of the sector and a close entry with id 0xffff
+AwaitableCoroutine writeLegacySector(Buffer &buffer, const BufferStorage::Info &info, int sectorIndex, int count,
+    int version, bool close)
+{
+    int entrySize = (8 + info.blockSize - 1) & ~(info.blockSize - 1);
+    int offsetShift = 0;
+    for (int i = 1; i < info.blockSize; i <<= 1)
+        ++offsetShift;
+    uint32_t sectorOffset = info.address + sectorIndex * info.sectorSize;
+    int entryOffset = entrySize;
+    int dataOffset = info.sectorSize;
+    for (int id = 1; id <= count; ++id) {
+        // data
+        dataOffset -= 16;
+        for (int j = 0; j < 16; ++j)
+            buffer.data()[j] = value(id + version, j);
+        buffer.header<uint32_t>() = sectorOffset + dataOffset;
+        co_await buffer.write(16);
+
+        // entry: id, size, offset and checksum over the first 6 bytes
+        auto entry = reinterpret_cast<uint16_t *>(buffer.data());
+        entry[0] = id;
+        entry[1] = 16;
+        entry[2] = dataOffset >> offsetShift;
+        entry[3] = BufferStorage::crc16(entry, 6);
+        buffer.header<uint32_t>() = sectorOffset + entryOffset;
+        co_await buffer.write(8);
+        entryOffset += entrySize;
+    }
+    if (close) {
+        // close entry at the start of the sector with the offset of the last entry
+        auto entry = reinterpret_cast<uint16_t *>(buffer.data());
+        entry[0] = 0xffff;
+        entry[1] = 0;
+        entry[2] = (entryOffset - entrySize) >> offsetShift;
+        entry[3] = BufferStorage::crc16(entry, 6);
+        buffer.header<uint32_t>() = sectorOffset;
+        co_await buffer.write(8);
+    }
+}
+#endif
+
 Coroutine test(Loop &loop, Buffer &flashBuffer) {
     BufferStorage storage(storageInfo, flashBuffer);
 
@@ -20,6 +108,13 @@ Coroutine test(Loop &loop, Buffer &flashBuffer) {
     // table of currently stored elements
     int sizes[64] = {}; // initialize with zero
     uint8_t buffer[128];
+    uint8_t manyBuffers[8][128];
+
+    // expected value of counter with id 1
+    uint32_t counter = 0;
+
+    // expected value of element with id 2 that gets modified atomically
+    uint32_t atomicValue = 0;
 
     // determine capacity (number of entries of size 128 that fit into the storage)
     int capacity = std::min(((storageInfo.sectorCount - 1) * (storageInfo.sectorSize - 8)) / (128 + 8), int(std::size(sizes))) - 1;
@@ -80,6 +175,77 @@ Coroutine test(Loop &loop, Buffer &flashBuffer) {
             co_return;
         }
 
+        // patch a random element every second time: patch with inverted data, check and patch back
+        index = random.draw() % capacity;
+        if (i % 2 == 0 && sizes[index] > 0) {
+            int size = sizes[index];
+            int id = index + 5;
+            int offset = random.draw() % size;
+            int patchSize = std::min(int(random.draw() % 16) + 1, size - offset);
+            for (int j = 0; j < patchSize; ++j) {
+                buffer[j] = ~(id + offset + j);
+            }
+            co_await storage.patch(id, offset, buffer, patchSize, result);
+            if (result != patchSize) {
+                // fail
+                debug::out << "Error: Patch (" << dec(i) << ")\n";
+#ifndef NATIVE
+                debug::set(debug::YELLOW);
+#endif
+                co_return;
+            }
+            co_await storage.read(id, buffer, result);
+            for (int j = 0; j < size; ++j) {
+                uint8_t v = id + j;
+                if (j >= offset && j < offset + patchSize)
+                    v = ~v;
+                if (result != size || buffer[j] != v) {
+                    // fail
+                    debug::out << "Error: Check patch (" << dec(i) << ")\n";
+#ifndef NATIVE
+                    debug::set(debug::CYAN);
+#endif
+                    co_return;
+                }
+            }
+            for (int j = 0; j < patchSize; ++j) {
+                buffer[j] = id + offset + j;
+            }
+            co_await storage.patch(id, offset, buffer, patchSize, result);
+            if (result != patchSize) {
+                // fail
+                debug::out << "Error: Patch back (" << dec(i) << ")\n";
+#ifndef NATIVE
+                debug::set(debug::YELLOW);
+#endif
+                co_return;
+            }
+        }
+
+        // increment counter
+        co_await storage.increment(1, result);
+        ++counter;
+        if (result != Storage::OK) {
+            // fail
+            debug::out << "Error: Increment (" << dec(i) << ")\n";
+#ifndef NATIVE
+            debug::set(debug::YELLOW);
+#endif
+            co_return;
+        }
+
+        // erase reclaimed sectors every fourth time, the other times they get erased when they are needed
+        if (i % 4 == 0) {
+            co_await storage.eraseSectors(result);
+            if (result < 0) {
+                // fail
+                debug::out << "Error: Erase sectors (" << dec(i) << ")\n";
+#ifndef NATIVE
+                debug::set(debug::YELLOW);
+#endif
+                co_return;
+            }
+        }
 
         // check if everything is correctly stored
         for (int index = 0; index < capacity; ++index) {
@@ -113,6 +279,100 @@ Coroutine test(Loop &loop, Buffer &flashBuffer) {
             }
         }
 
+        // read some elements at once and check them
+        {
+            BufferStorage::ReadRequest requests[8];
+            int first = random.draw() % capacity;
+            for (int j = 0; j < 8; ++j) {
+                int index = (first + j) % capacity;
+                requests[j] = {index + 5, manyBuffers[j], 128, 0};
+            }
+            co_await storage.readMany(requests, result);
+            for (int j = 0; j < 8; ++j) {
+                auto &request = requests[j];
+                int size = sizes[request.id - 5];
+                bool ok = result == Storage::OK && request.result == size;
+                for (int k = 0; k < size && ok; ++k)
+                    ok = manyBuffers[j][k] == uint8_t(request.id + k);
+                if (!ok) {
+                    // fail
+                    debug::out << "Error: Read many (" << dec(i) << '/' << dec(request.id) << ")\n";
+#ifndef NATIVE
+                    debug::set(debug::CYAN);
+#endif
+                    co_return;
+                }
+            }
+        }
+
+        // check counter
+        uint32_t c;
+        co_await storage.read(1, c, result);
+        if (result != 4 || c != counter) {
+            // fail
+            debug::out << "Error: Check counter (" << dec(i) << ")\n";
+#ifndef NATIVE
+            debug::set(debug::MAGENTA);
+#endif
+            co_return;
+        }
+
+        // add to element with id 2 atomically, then compare and swap with a wrong and the correct expected value
+        {
+            uint32_t previous;
+            co_await storage.fetchAdd(2, uint32_t(3), previous, result);
+            bool ok = result == 4 && previous == atomicValue;
+            atomicValue += 3;
+            uint32_t expected = atomicValue + 1;
+            co_await storage.compareAndSwap(2, expected, uint32_t(i), result);
+            ok = ok && result == Storage::UNEXPECTED_VALUE && expected == atomicValue;
+            if (i % 2 == 0) {
+                co_await storage.compareAndSwap(2, expected, uint32_t(i), result);
+                ok = ok && result == 4;
+                atomicValue = i;
+            }
+
+            // add to the counter from time to time, it stays a counter so that the next increment only programs a block
+            // of its run, and a compare and swap that leaves it unchanged writes nothing
+            if (i % 100 == 50) {
+                co_await storage.fetchAdd(1, uint32_t(5), previous, result);
+                ok = ok && result == 4 && previous == counter;
+                counter += 5;
+                auto programmedBytes = storage.statistics().programmedBytes;
+                co_await storage.increment(1, result);
+                ++counter;
+                ok = ok && result == Storage::OK
+                    && storage.statistics().programmedBytes - programmedBytes == uint32_t(storageInfo.blockSize);
+                expected = counter;
+                programmedBytes = storage.statistics().programmedBytes;
+                co_await storage.compareAndSwap(1, expected, counter, result);
+                ok = ok && result == 4 && storage.statistics().programmedBytes == programmedBytes;
+            }
+            if (!ok) {
+                // fail
+                debug::out << "Error: Atomic update (" << dec(i) << ")\n";
+#ifndef NATIVE
+                debug::set(debug::YELLOW);
+#endif
+                co_return;
+            }
+        }
+
+#ifdef NATIVE
+        // export and import all elements from time to time, the checks after mounting check the imported elements
+        if (i % 1000 == 999) {
+            SnapshotStream stream;
+            int count;
+            co_await storage.exportAll(stream, count);
+            co_await storage.importAll(stream, result);
+            if (count <= 0 || result != count) {
+                // fail
+                debug::out << "Error: Export/import (" << dec(i) << ")\n";
+                co_return;
+            }
+        }
+#endif
+
         // mount storage and check again if everything is correctly stored
         co_await storage.mount(result);
         if (result != Storage::OK) {
@@ -154,9 +414,991 @@ Coroutine test(Loop &loop, Buffer &flashBuffer) {
             }
         }
 
+        co_await storage.read(1, c, result);
+        if (result != 4 || c != counter) {
+            // fail
+            debug::out << "Error: Check counter 2 (" << dec(i) << ")\n";
+#ifndef NATIVE
+            debug::set(debug::MAGENTA);
+#endif
+            co_return;
+        }
+        co_await storage.read(2, c, result);
+        if (result != 4 || c != atomicValue) {
+            // fail
+            debug::out << "Error: Check atomic update (" << dec(i) << ")\n";
+#ifndef NATIVE
+            debug::set(debug::MAGENTA);
+#endif
+            co_return;
+        }
+
         //co_await loop.sleep(200ms);
     }
 
+    // mount lazily and issue a read and a write (every second time) while the mount is still in progress so that they
+    // get queued in front of the recovery. The write finishes the recovery, otherwise it continues in the background
+    // while all elements get checked
+    for (int round = 0; round < 8; ++round) {
+        int index = round % (capacity - 1);
+        int id = index + 5;
+        int size = round % 2 == 0 ? (round * 37 + 11) % 129 : sizes[index];
+        for (int j = 0; j < size; ++j) {
+            buffer[j] = id + j;
+        }
+        int mountResult;
+        int readResult;
+        int writeResult = size;
+        auto mounting = storage.mountLazy(mountResult);
+        auto reading = storage.read(id + 1, manyBuffers[0], 128, readResult);
+        AwaitableCoroutine writing;
+        if (round % 2 == 0)
+            writing = storage.write(id, buffer, size, writeResult);
+        co_await mounting;
+        co_await reading;
+        co_await writing;
+        bool ok = mountResult == Storage::OK && readResult == sizes[index + 1] && writeResult == size;
+        for (int j = 0; j < readResult && ok; ++j)
+            ok = manyBuffers[0][j] == uint8_t(id + 1 + j);
+        sizes[index] = size;
+
+        // check all elements, after the last round using a mount that does the complete recovery
+        if (round == 7)
+            co_await storage.mount(result);
+        for (int index = 0; index < capacity && ok; ++index) {
+            int size = sizes[index];
+            int id = index + 5;
+            co_await storage.read(id, buffer, result);
+            ok = result == size;
+            for (int j = 0; j < size && ok; ++j)
+                ok = buffer[j] == uint8_t(id + j);
+        }
+        if (!ok) {
+            // fail
+            debug::out << "Error: Lazy mount (" << dec(round) << ")\n";
+#ifndef NATIVE
+            debug::set(debug::CYAN);
+#endif
+            co_return;
+        }
+    }
+
+    // write elements compressed, check that compression saves memory and that the elements read back after mounting
+    co_await storage.clear(result);
+    {
+        // write the same data uncompressed and compressed right after clearing so that no sector gets closed
+        for (int j = 0; j < 128; ++j) {
+            buffer[j] = value(3, j);
+        }
+        auto programmedBytes = storage.statistics().programmedBytes;
+        co_await storage.write(3, buffer, 128, result);
+        int plainSize = int(storage.statistics().programmedBytes - programmedBytes);
+        programmedBytes = storage.statistics().programmedBytes;
+        co_await storage.writeCompressed(4, buffer, 128, result);
+        int compressedSize = int(storage.statistics().programmedBytes - programmedBytes);
+
+        // compressed elements can't be patched
+        int patchResult;
+        co_await storage.patch(4, 0, buffer, 1, patchResult);
+
+        // an update that leaves the compressed element unchanged writes nothing, a changed element stays compressed
+        int updateResult;
+        programmedBytes = storage.statistics().programmedBytes;
+        co_await storage.update(4, buffer, 128, [](void *data, int size) {return size;}, updateResult);
+        if (updateResult != 128 || storage.statistics().programmedBytes != programmedBytes)
+            patchResult = Storage::FATAL_ERROR;
+        co_await storage.update(4, buffer, 128, [](void *data, int size) {
+            reinterpret_cast<uint8_t *>(data)[0] ^= 1;
+            return size;
+        }, updateResult);
+        if (updateResult != 128 || storage.statistics().programmedBytes - programmedBytes >= plainSize)
+            patchResult = Storage::FATAL_ERROR;
+        co_await storage.read(4, buffer, updateResult);
+        if (updateResult != 128 || buffer[0] != (value(3, 0) ^ 1) || buffer[127] != value(3, 127))
+            patchResult = Storage::FATAL_ERROR;
+        co_await storage.update(4, buffer, 128, [](void *data, int size) {
+            reinterpret_cast<uint8_t *>(data)[0] ^= 1;
+            return size;
+        }, updateResult);
+
+        // an empty patch writes nothing
+        int emptyResult;
+        programmedBytes = storage.statistics().programmedBytes;
+        co_await storage.patch(3, 0, buffer, 0, emptyResult);
+        if (emptyResult != 0 || storage.statistics().programmedBytes != programmedBytes)
+            patchResult = Storage::FATAL_ERROR;
+        if (result != 128 || compressedSize >= plainSize || patchResult != Storage::NOT_SUPPORTED) {
+            // fail
+            debug::out << "Error: Compression\n";
+#ifndef NATIVE
+            debug::set(debug::YELLOW);
+#endif
+            co_return;
+        }
+
+        for (int index = 0; index < capacity; ++index) {
+            int size = (index * 9) % 129;
+            int id = index + 5;
+            for (int j = 0; j < size; ++j) {
+                buffer[j] = value(id, j);
+            }
+            co_await storage.writeCompressed(id, buffer, size, result);
+            sizes[index] = size;
+            if (result != size) {
+                // fail
+                debug::out << "Error: Write compressed (" << dec(index) << ")\n";
+#ifndef NATIVE
+                debug::set(debug::YELLOW);
+#endif
+                co_return;
+            }
+        }
+
+        // mount storage and check if everything is correctly stored
+        co_await storage.mount(result);
+        for (int index = -2; index < capacity; ++index) {
+            int size = index < 0 ? 128 : sizes[index];
+            int id = index + 5;
+            co_await storage.read(id, buffer, result);
+            bool ok = result == size;
+            for (int j = 0; j < size && ok; ++j)
+                ok = buffer[j] == value(index < 0 ? 3 : id, j);
+            if (!ok) {
+                // fail
+                debug::out << "Error: Check compressed (" << dec(index) << ")\n";
+#ifndef NATIVE
+                debug::set(debug::CYAN);
+#endif
+                co_return;
+            }
+        }
+
+#ifdef NATIVE
+        // element that is larger than 8191 bytes if the sectors are large enough
+        int largeSize = 9000;
+        if (storageInfo.sectorSize >= 16384) {
+            std::vector<uint8_t> large(largeSize);
+            for (int j = 0; j < largeSize; ++j) {
+                large[j] = value(3, j);
+            }
+            co_await storage.write(3, large.data(), largeSize, result);
+            bool ok = result == largeSize;
+            co_await storage.mount(result);
+            std::fill(large.begin(), large.end(), 0);
+            co_await storage.read(3, large.data(), largeSize, result);
+            ok = ok && result == largeSize;
+            for (int j = 0; j < largeSize && ok; ++j)
+                ok = large[j] == value(3, j);
+            if (!ok) {
+                // fail
+                debug::out << "Error: Large element\n";
+                co_return;
+            }
+        }
+#endif
+    }
+
+    // write all elements in the order of their ids several times so that the sectors have their entries sorted by id
+    // and get searched using binary search
+    co_await storage.clear(result);
+    for (int round = 0; round < 4; ++round) {
+        for (int index = 0; index < capacity; ++index) {
+            int size = (index * 7 + round * 13) % 129;
+            int id = index + 5;
+            for (int j = 0; j < size; ++j) {
+                buffer[j] = value(id, j);
+            }
+            co_await storage.write(id, buffer, size, result);
+            sizes[index] = size;
+            if (result != size) {
+                // fail
+                debug::out << "Error: Sorted write (" << dec(round) << '/' << dec(index) << ")\n";
+#ifndef NATIVE
+                debug::set(debug::YELLOW);
+#endif
+                co_return;
+            }
+        }
+
+        // mount storage and check if everything is correctly stored
+        co_await storage.mount(result);
+        for (int index = 0; index < capacity; ++index) {
+            int size = sizes[index];
+            int id = index + 5;
+            co_await storage.read(id, buffer, result);
+            bool ok = result == size;
+            for (int j = 0; j < size && ok; ++j)
+                ok = buffer[j] == value(id, j);
+            if (!ok) {
+                // fail
+                debug::out << "Error: Check sorted (" << dec(round) << '/' << dec(index) << ")\n";
+#ifndef NATIVE
+                debug::set(debug::CYAN);
+#endif
+                co_return;
+            }
+        }
+    }
+
+#ifdef NATIVE
+    // write elements in random order of their ids, then rewrite an element with a larger id until garbage collection
+    // has copied the elements into a new sector in the order of their ids and the sector got closed. Reading the
+    // elements uses binary search in this sector which is checked by counting the reads of simulated flash
+    {
+        constexpr BufferStorage::Info info{0, 8, 1024, 1024, 4, BufferStorage::Type::MEM_4N, {}, false, false};
+        Flash_sim simFlash(info.sectorSize * info.sectorCount, info.pageSize, info.blockSize, info.type, {1, 0, 0, 0});
+        Flash_sim::Buffer simBuffer(256, simFlash);
+        BufferStorage simStorage(info, simBuffer);
+        co_await simStorage.clear(result);
+        bool ok = result == Storage::OK;
+        for (int i = 0; i < 48 && ok; ++i) {
+            int id = 100 + i * 19 % 48;
+            std::fill(buffer, buffer + 8, uint8_t(id));
+            co_await simStorage.write(id, buffer, 8, result);
+            ok = result == 8;
+        }
+        for (int i = 0; i < 100 && ok && simStorage.statistics().reclaimedSectors < 2; ++i) {
+            co_await simStorage.write(1000, buffer, 100, result);
+            ok = result == 100;
+        }
+        simFlash.resetTime();
+        for (int i = 0; i < 48 && ok; ++i) {
+            int id = 100 + i;
+            co_await simStorage.read(id, buffer, result);
+            ok = result == 8 && buffer[0] == uint8_t(id) && buffer[7] == uint8_t(id);
+        }
+
+        // with linear search it takes about 28 reads per element (timing is one unit per transfer)
+        if (!ok || simFlash.time().read >= 48 * 12) {
+            // fail
+            debug::out << "Error: Sorted compaction\n";
+            co_return;
+        }
+    }
+#endif
+
+#ifdef NATIVE
+    // fill simulated flash with elements in random order of their ids, then read missing elements before and after
+    // mounting. The bloom filters of the sectors let the lookups skip the sectors which is checked by counting the reads
+    {
+        constexpr BufferStorage::Info info{0, 8, 1024, 1024, 4, BufferStorage::Type::MEM_4N, {}, false, false};
+        Flash_sim simFlash(info.sectorSize * info.sectorCount, info.pageSize, info.blockSize, info.type, {1, 0, 0, 0});
+        Flash_sim::Buffer simBuffer(256, simFlash);
+        BufferStorage simStorage(info, simBuffer);
+        co_await simStorage.clear(result);
+        bool ok = result == Storage::OK;
+        for (int i = 0; i < 80 && ok; ++i) {
+            int id = 100 + i * 37 % 80;
+            std::fill(buffer, buffer + 20, uint8_t(id));
+            co_await simStorage.write(id, buffer, 20, result);
+            ok = result == 20;
+        }
+        for (int round = 0; round < 2 && ok; ++round) {
+            if (round == 1) {
+                co_await simStorage.mount(result);
+                ok = result == Storage::OK;
+            }
+            simFlash.resetTime();
+            for (int i = 0; i < 48 && ok; ++i) {
+                co_await simStorage.read(2000 + i, buffer, result);
+                ok = result == 0;
+            }
+
+            // it takes about 14 reads per missing element, without bloom filters about 65
+            ok = ok && simFlash.time().read < 48 * 24;
+        }
+        if (!ok) {
+            // fail
+            debug::out << "Error: Bloom filter\n";
+            co_return;
+        }
+    }
+#endif
+
+#ifdef NATIVE
+    // increment a counter on flash where each increment programs a block of the run and on generic memory where each
+    // increment clears a bit of the run. Both program one byte per increment, but on generic memory a run lasts 8
+    // times longer so that the bytes of new counters drop from about 590 to 66 for 3000 increments
+    {
+        int programmedBytes[2];
+        bool ok = true;
+        for (int mem = 0; mem < 2 && ok; ++mem) {
+            auto type = mem == 0 ? BufferStorage::Type::FLASH_4N : BufferStorage::Type::MEM_4N;
+            BufferStorage::Info info{0, 1, 1024, 1024, 4, type, {}, false, false};
+            Flash_sim simFlash(info.sectorSize * info.sectorCount, info.pageSize, info.blockSize, info.type, {});
+            Flash_sim::Buffer simBuffer(256, simFlash);
+            BufferStorage simStorage(info, simBuffer);
+            co_await simStorage.clear(result);
+            ok = result == Storage::OK;
+            for (int i = 0; i < 3000 && ok; ++i) {
+                co_await simStorage.increment(10, result);
+                ok = result == Storage::OK;
+            }
+            programmedBytes[mem] = simStorage.statistics().programmedBytes;
+            co_await simStorage.mount(result);
+            uint32_t value = 0;
+            co_await simStorage.read(10, value, result);
+            ok = ok && result == 4 && value == 3000;
+        }
+        if (!ok || (programmedBytes[1] - 3000) * 4 >= programmedBytes[0] - 3000) {
+            // fail
+            debug::out << "Error: Counter bits\n";
+            co_return;
+        }
+    }
+#endif
+
+#ifdef NATIVE
+    // write and read elements without frame pool, with a frame pool that gets exhausted by nested coroutines and with
+    // a frame pool that is large enough. Frames that don't fit into the pool are allocated on the heap
+    {
+        constexpr BufferStorage::Info info{0, 8, 1024, 1024, 4, BufferStorage::Type::MEM_4N, {}, false, false};
+        int heapFrames[3];
+        bool ok = true;
+        for (int pool = 0; pool < 3 && ok; ++pool) {
+            Flash_sim simFlash(info.sectorSize * info.sectorCount, info.pageSize, info.blockSize, info.type, {});
+            Flash_sim::Buffer simBuffer(256, simFlash);
+            BufferStorage::Options options;
+            options.frameCount = pool == 0 ? 0 : (pool == 1 ? 1 : 16);
+            BufferStorage simStorage(info, simBuffer, options);
+            co_await simStorage.clear(result);
+            ok = result == Storage::OK;
+            for (int i = 0; i < 20 && ok; ++i) {
+                std::fill(buffer, buffer + 8, uint8_t(i));
+                co_await simStorage.write(100 + i, buffer, 8, result);
+                ok = result == 8;
+            }
+            for (int i = 0; i < 20 && ok; ++i) {
+                co_await simStorage.read(100 + i, buffer, result);
+                ok = result == 8 && buffer[0] == uint8_t(i) && buffer[7] == uint8_t(i);
+            }
+            heapFrames[pool] = simStorage.statistics().heapFrames;
+        }
+        // each of the 41 operations allocates at least one frame
+        if (!ok || heapFrames[0] < 41 || heapFrames[1] <= 0 || heapFrames[1] >= heapFrames[0] || heapFrames[2] != 0) {
+            // fail
+            debug::out << "Error: Frame pool\n";
+            co_return;
+        }
+    }
+#endif
+
+#ifdef NATIVE
+    // check the virtual time of simulated flash after a read, a program and an erase, and that programming flash only
+    // clears bits while generic memory gets overwritten
+    for (auto type : {BufferStorage::Type::FLASH_4N, BufferStorage::Type::MEM_4N}) {
+        Flash_sim simFlash(4096, 1024, 8, type, {100, 10, 1000, 50000});
+        Flash_sim::Buffer simBuffer(64, simFlash);
+        simBuffer.header<uint32_t>() = 1024;
+        co_await simBuffer.read(16);
+        bool ok = simBuffer.size() == 16 && simBuffer.data()[0] == 0xff && simFlash.time().read == 100 + (4 + 16) * 10;
+        std::fill(simBuffer.data(), simBuffer.data() + 8, 0xf0);
+        co_await simBuffer.write(8);
+        ok = ok && simFlash.time().program == 100 + 4 * 10 + 8 * 1000;
+        std::fill(simBuffer.data(), simBuffer.data() + 8, 0x3c);
+        co_await simBuffer.write(8);
+        co_await simBuffer.read(8);
+        ok = ok && simBuffer.data()[0] == (type == BufferStorage::Type::FLASH_4N ? 0x30 : 0x3c);
+        simBuffer.header<uint32_t>() = 1024 + 100;
+        co_await simBuffer.erase();
+        simBuffer.header<uint32_t>() = 1024;
+        co_await simBuffer.read(8);
+        ok = ok && simBuffer.data()[0] == 0xff && simFlash.time().erase == 100 + 4 * 10 + 50000
+            && simFlash.time().total() == simFlash.time().read + simFlash.time().program + simFlash.time().erase;
+        simFlash.resetTime();
+        if (!ok || simFlash.time().total() != 0) {
+            // fail
+            debug::out << "Error: Flash simulation\n";
+            co_return;
+        }
+    }
+#endif
+
+    // record more operations than the ring buffer holds, the ring buffer keeps the newest in order from oldest to newest
+    {
+        TraceRing<8> ring(loop);
+        storage.setTraceHandler(&ring);
+        for (int i = 0; i < 10; ++i) {
+            co_await storage.write(200 + i, buffer, i, result);
+        }
+        co_await storage.read(200, buffer, 16, result);
+        co_await storage.increment(210, result);
+        storage.setTraceHandler(nullptr);
+        co_await storage.read(201, buffer, 16, result);
+        bool ok = ring.size() == 8 && ring.totalCount() == 12;
+        for (int i = 0; i < 6 && ok; ++i) {
+            auto &record = ring[i];
+            ok = record.operation == BufferStorage::Operation::WRITE && record.id == 204 + i && record.size == uint32_t(4 + i)
+                && (i == 0 || record.time >= ring[i - 1].time);
+        }
+        ok = ok && ring[6].operation == BufferStorage::Operation::READ && ring[6].id == 200 && ring[6].size == 16
+            && ring[7].operation == BufferStorage::Operation::INCREMENT && ring[7].id == 210;
+        ring.clear();
+        ok = ok && ring.size() == 0;
+        co_await storage.eraseRange(200, 210, result);
+        if (!ok || result != Storage::OK) {
+            // fail
+            debug::out << "Error: Trace ring\n";
+#ifndef NATIVE
+            debug::set(debug::YELLOW);
+#endif
+            co_return;
+        }
+    }
+
+    // erase a range of elements with a single range entry, then rewrite an element in the range and the elements
+    // outside of the range so that garbage collection has to keep the range entry or drop the erased elements
+    {
+        int firstIndex = capacity / 4;
+        int lastIndex = capacity * 3 / 4;
+        co_await storage.eraseRange(firstIndex + 5, lastIndex + 5, result);
+        if (result != Storage::OK) {
+            // fail
+            debug::out << "Error: Erase range\n";
+#ifndef NATIVE
+            debug::set(debug::YELLOW);
+#endif
+            co_return;
+        }
+        for (int index = firstIndex; index <= lastIndex; ++index)
+            sizes[index] = 0;
+
+        for (int round = 0; round < 4; ++round) {
+            for (int index = 0; index < capacity; ++index) {
+                if (index >= firstIndex && index <= lastIndex && index != firstIndex + round)
+                    continue;
+                int size = (index * 11 + round * 5) % 129;
+                int id = index + 5;
+                for (int j = 0; j < size; ++j) {
+                    buffer[j] = value(id, j);
+                }
+                co_await storage.write(id, buffer, size, result);
+                sizes[index] = size;
+                if (result != size) {
+                    // fail
+                    debug::out << "Error: Range write (" << dec(round) << '/' << dec(index) << ")\n";
+#ifndef NATIVE
+                    debug::set(debug::YELLOW);
+#endif
+                    co_return;
+                }
+            }
+
+            // mount storage and check if the erased elements stay erased
+            co_await storage.mount(result);
+            for (int index = 0; index < capacity; ++index) {
+                int size = sizes[index];
+                int id = index + 5;
+                co_await storage.read(id, buffer, result);
+                bool ok = result == size;
+                for (int j = 0; j < size && ok; ++j)
+                    ok = buffer[j] == value(id, j);
+                if (!ok) {
+                    // fail
+                    debug::out << "Error: Check range (" << dec(round) << '/' << dec(index) << ")\n";
+#ifndef NATIVE
+                    debug::set(debug::CYAN);
+#endif
+                    co_return;
+                }
+            }
+        }
+    }
+
+    // erase a wide range of ids and rewrite every second of the previously written ids in it, so that the ids with
+    // newer entries form more ranges than garbage collection collects in one pass over the newer entries
+    {
+        for (int pass = 0; pass < 2; ++pass) {
+            for (int id = 1000; id < 3000; id += 32) {
+                if (pass == 1 && id % 64 != 1000 % 64)
+                    continue;
+                buffer[0] = id;
+                buffer[1] = pass;
+                co_await storage.write(id, buffer, 2, result);
+                if (result != 2) {
+                    // fail
+                    debug::out << "Error: Wide range write (" << dec(id) << ")\n";
+#ifndef NATIVE
+                    debug::set(debug::YELLOW);
+#endif
+                    co_return;
+                }
+            }
+            if (pass == 0) {
+                co_await storage.eraseRange(1000, 2999, result);
+                if (result != Storage::OK) {
+                    // fail
+                    debug::out << "Error: Erase wide range\n";
+#ifndef NATIVE
+                    debug::set(debug::YELLOW);
+#endif
+                    co_return;
+                }
+            }
+        }
+
+        // rewrite the other elements so that garbage collection has to copy the range entry, then check after mounting
+        for (int round = 0; round < 4; ++round) {
+            for (int index = 0; index < capacity; ++index) {
+                int size = (index * 7 + round * 3) % 129;
+                int id = index + 5;
+                for (int j = 0; j < size; ++j) {
+                    buffer[j] = value(id, j);
+                }
+                co_await storage.write(id, buffer, size, result);
+                sizes[index] = size;
+                if (result != size) {
+                    // fail
+                    debug::out << "Error: Wide range rewrite (" << dec(round) << '/' << dec(index) << ")\n";
+#ifndef NATIVE
+                    debug::set(debug::YELLOW);
+#endif
+                    co_return;
+                }
+            }
+            co_await storage.mount(result);
+            for (int id = 1000; id < 3000; id += 16) {
+                int size = id % 64 == 1000 % 64 ? 2 : 0;
+                co_await storage.read(id, buffer, result);
+                if (result != size || (size == 2 && (buffer[0] != uint8_t(id) || buffer[1] != 1))) {
+                    // fail
+                    debug::out << "Error: Check wide range (" << dec(round) << '/' << dec(id) << ")\n";
+#ifndef NATIVE
+                    debug::set(debug::CYAN);
+#endif
+                    co_return;
+                }
+            }
+        }
+
+        // erase the range again so that the following tests start without these elements
+        co_await storage.eraseRange(1000, 2999, result);
+    }
+
+    // fill the storage with new elements of decreasing size until it is full, then check that a write that needs more
+    // than the garbage and free space fails immediately without programming anything
+    {
+        int id = capacity + 5;
+        for (int size : {128, 32, 8}) {
+            while (true) {
+                co_await storage.write(id, manyBuffers, size, result);
+                if (result == Storage::OUT_OF_MEMORY)
+                    break;
+                if (result != size) {
+                    // fail
+                    debug::out << "Error: Fill (" << dec(id) << ")\n";
+#ifndef NATIVE
+                    debug::set(debug::YELLOW);
+#endif
+                    co_return;
+                }
+                ++id;
+            }
+        }
+
+        BufferStorage::Space space;
+        co_await storage.freeSpace(space, result);
+        if (result != Storage::OK || space.live <= 0 || space.garbage < 0 || space.free < 0) {
+            // fail
+            debug::out << "Error: Free space\n";
+#ifndef NATIVE
+            debug::set(debug::YELLOW);
+#endif
+            co_return;
+        }
+        int size = space.garbage + space.free;
+        if (size <= int(sizeof(manyBuffers))) {
+            auto programmedBytes = storage.statistics().programmedBytes;
+            co_await storage.write(id, manyBuffers, size, result);
+            if (result != Storage::OUT_OF_MEMORY || storage.statistics().programmedBytes != programmedBytes) {
+                // fail
+                debug::out << "Error: Fail fast\n";
+#ifndef NATIVE
+                debug::set(debug::YELLOW);
+#endif
+                co_return;
+            }
+        }
+
+        // mount storage and check if the other elements are unchanged
+        co_await storage.mount(result);
+        for (int index = 0; index < capacity; ++index) {
+            int size = sizes[index];
+            int id = index + 5;
+            co_await storage.read(id, buffer, result);
+            bool ok = result == size;
+            for (int j = 0; j < size && ok; ++j)
+                ok = buffer[j] == value(id, j);
+            if (!ok) {
+                // fail
+                debug::out << "Error: Check after fill (" << dec(index) << ")\n";
+#ifndef NATIVE
+                debug::set(debug::CYAN);
+#endif
+                co_return;
+            }
+        }
+    }
+
+    // append records to a log on the same memory until the oldest records get dropped, then read them back
+    {
+        BufferLog log(storageInfo, flashBuffer);
+        co_await log.clear(result);
+        int count = storageInfo.sectorCount * storageInfo.sectorSize / 20;
+        for (int i = 0; i < count; ++i) {
+            int size = 4 + i % 64;
+            buffer[0] = i;
+            buffer[1] = i >> 8;
+            for (int j = 2; j < size; ++j) {
+                buffer[j] = value(i, j);
+            }
+            co_await log.append(buffer, size, result);
+            if (result != size) {
+                // fail
+                debug::out << "Error: Log append (" << dec(i) << ")\n";
+#ifndef NATIVE
+                debug::set(debug::YELLOW);
+#endif
+                co_return;
+            }
+        }
+
+        // read all records after mount (twice, the second time after truncating all but the newest sector)
+        for (int k = 0; k < 2; ++k) {
+            co_await log.mount(result);
+            int first = -1;
+            int last = -1;
+            auto cursor = log.begin();
+            while (result == Storage::OK) {
+                co_await log.readFrom(cursor, buffer, sizeof(buffer), result);
+                if (result <= 0)
+                    break;
+                int i = buffer[0] | (buffer[1] << 8);
+                bool ok = result == 4 + i % 64 && (last == -1 || i == last + 1);
+                for (int j = 2; j < result && ok; ++j)
+                    ok = buffer[j] == value(i, j);
+                if (!ok) {
+                    result = Storage::CHECKSUM_ERROR;
+                    break;
+                }
+                if (first == -1)
+                    first = i;
+                last = i;
+                result = Storage::OK;
+            }
+            if (result != 0 || first <= 0 || last != count - 1 || cursor != log.end()) {
+                // fail
+                debug::out << "Error: Log read (" << dec(k) << ")\n";
+#ifndef NATIVE
+                debug::set(debug::CYAN);
+#endif
+                co_return;
+            }
+            co_await log.truncateBefore(log.end(), result);
+        }
+    }
+
+    // write elements using the options of the storage on at least 3 sectors, the elements with the lowest ids get
+    // written more often so that the sectors have different amounts of garbage, check all elements after mounting
+    for (int config = 0; config < 4 && optionsInfo.sectorCount >= 3; ++config) {
+        BufferStorage::Info info = optionsInfo;
+        BufferStorage::Options options;
+        switch (config) {
+        case 0:
+            // greedy garbage collection
+            options.gcMode = BufferStorage::GcMode::GREEDY;
+            break;
+        case 1:
+            // hot/cold separation, the elements with the highest ids are placed into the cold sector
+            options.hotCold = true;
+            break;
+        case 2:
+            // two spare sectors, the reclaimed sectors get erased by eraseSectors() from time to time
+            options.spareCount = 2;
+            break;
+        case 3:
+            // wide entry format
+            info.wideEntries = true;
+            break;
+        }
+        BufferStorage optionsStorage(info, flashBuffer, options);
+        co_await optionsStorage.clear(result);
+        int optionSizes[16] = {};
+        int versions[16] = {};
+        int count = info.sectorCount * info.sectorSize / 8;
+        for (int i = 0; i < count; ++i) {
+            int index = random.draw() % 4 != 0 ? random.draw() % 4 : random.draw() % 16;
+            int id = index + 5;
+            int size = random.draw() % 65;
+            for (int j = 0; j < size; ++j) {
+                buffer[j] = value(id + i, j);
+            }
+            auto placement = index >= 12 ? BufferStorage::Placement::COLD : BufferStorage::Placement::AUTO;
+            co_await optionsStorage.write(id, buffer, size, placement, result);
+            optionSizes[index] = size;
+            versions[index] = i;
+            if (result != size) {
+                // fail
+                debug::out << "Error: Options write (" << dec(config) << '/' << dec(i) << ")\n";
+#ifndef NATIVE
+                debug::set(debug::YELLOW);
+#endif
+                co_return;
+            }
+
+            // erase reclaimed sectors from time to time
+            if (i % 64 == 31) {
+                co_await optionsStorage.eraseSectors(result);
+                if (result < 0) {
+                    // fail
+                    debug::out << "Error: Options erase (" << dec(config) << '/' << dec(i) << ")\n";
+#ifndef NATIVE
+                    debug::set(debug::YELLOW);
+#endif
+                    co_return;
+                }
+            }
+
+            // mount and check all elements from time to time
+            if (i % 64 == 63 || i == count - 1) {
+                co_await optionsStorage.mount(result);
+                bool ok = result == Storage::OK;
+                for (int index = 0; index < 16 && ok; ++index) {
+                    int size = optionSizes[index];
+                    int id = index + 5;
+                    co_await optionsStorage.read(id, buffer, result);
+                    ok = result == size;
+                    for (int j = 0; j < size && ok; ++j)
+                        ok = buffer[j] == value(id + versions[index], j);
+                }
+                if (!ok || (i == count - 1 && optionsStorage.statistics().reclaimedSectors == 0)) {
+                    // fail
+                    debug::out << "Error: Options check (" << dec(config) << '/' << dec(i) << ")\n";
+#ifndef NATIVE
+                    debug::set(debug::CYAN);
+#endif
+                    co_return;
+                }
+            }
+        }
+    }
+
+#ifdef NATIVE
+    // write hot elements for more sector closes than sequence numbers can compare while no cold element gets written,
+    // the cold head gets closed when it gets too old so that an element in it does not get newer than its rewrites
+    {
+        BufferStorage::Info info = storageInfo;
+        info.sectorSize = std::max(storageInfo.pageSize, 1024);
+        info.sectorCount = 4;
+        BufferStorage::Options options;
+        options.hotCold = true;
+        BufferStorage ageStorage(info, flashBuffer, options);
+        co_await ageStorage.clear(result);
+
+        // the first version of element 5 goes to the cold head
+        buffer[0] = 0;
+        co_await ageStorage.write(5, buffer, 1, BufferStorage::Placement::COLD, result);
+        bool ok = result == 1;
+        int size = info.sectorSize / 3;
+        for (int i = 1; ok && ageStorage.statistics().reclaimedSectors < 0x9000; ++i) {
+            std::fill(buffer, buffer + size, uint8_t(i));
+            co_await ageStorage.write(6, buffer, size, BufferStorage::Placement::HOT, result);
+            ok = result == size;
+
+            // rewrite element 5 from time to time
+            if (i % 16 == 0) {
+                buffer[0] = i >> 4;
+                co_await ageStorage.write(5, buffer, 1, BufferStorage::Placement::HOT, result);
+                ok = ok && result == 1;
+            }
+            co_await ageStorage.read(5, buffer, result);
+            ok = ok && result == 1 && buffer[0] == uint8_t(i >> 4);
+        }
+        if (!ok) {
+            // fail
+            debug::out << "Error: Sequence age\n";
+            co_return;
+        }
+    }
+#endif
+
+#if defined(NATIVE) && !defined(_WIN32)
+    // write elements to a memory mapped file and sync it, then map the file again, mount and check the elements. A file
+    // that can't be created is reported by valid() and mount() fails
+    {
+        constexpr BufferStorage::Info info{0, 8, 1024, 1024, 4, BufferStorage::Type::MEM_4N, {}, false, false};
+        const char *fileName = "mmapTest.bin";
+        std::remove(fileName);
+        bool ok = true;
+        for (int round = 0; round < 2 && ok; ++round) {
+            Flash_mmap mmapFlash(fileName, info.sectorSize * info.sectorCount, info.pageSize, info.blockSize);
+            Flash_mmap::Buffer mmapBuffer(256, mmapFlash);
+            BufferStorage mmapStorage(info, mmapBuffer);
+            mmapStorage.setCommitHandler(&mmapFlash);
+            ok = mmapFlash.valid();
+            if (round == 0) {
+                co_await mmapStorage.clear(result);
+                ok = ok && result == Storage::OK;
+                for (int i = 0; i < 40 && ok; ++i) {
+                    int id = 100 + i % 20;
+                    int size = 10 + i;
+                    for (int j = 0; j < size; ++j) {
+                        buffer[j] = value(id + i, j);
+                    }
+                    co_await mmapStorage.write(id, buffer, size, result);
+                    ok = result == size;
+                }
+                mmapFlash.sync();
+            } else {
+                co_await mmapStorage.mount(result);
+                ok = ok && result == Storage::OK;
+                for (int i = 20; i < 40 && ok; ++i) {
+                    int id = 100 + i % 20;
+                    int size = 10 + i;
+                    co_await mmapStorage.read(id, buffer, result);
+                    ok = result == size;
+                    for (int j = 0; j < size && ok; ++j)
+                        ok = buffer[j] == value(id + i, j);
+                }
+            }
+        }
+        std::remove(fileName);
+        {
+            Flash_mmap mmapFlash("nonexistent/mmapTest.bin", info.sectorSize * info.sectorCount, info.pageSize,
+                info.blockSize);
+            Flash_mmap::Buffer mmapBuffer(256, mmapFlash);
+            BufferStorage mmapStorage(info, mmapBuffer);
+            co_await mmapStorage.mount(result);
+            ok = ok && !mmapFlash.valid() && result != Storage::OK;
+        }
+        if (!ok) {
+            // fail
+            debug::out << "Error: Memory mapped file\n";
+            co_return;
+        }
+    }
+#endif
+
+#if defined(NATIVE) && !defined(_WIN32)
+    // post requests to the thread safe front end from the loop thread and from another thread
+    co_await storage.clear(result);
+    {
+        ThreadSafeStorage threadSafe(loop, storage);
+
+        // two writes to the same id in one batch get combined, a read in the same batch gets the last data
+        for (int j = 0; j < 100; ++j) {
+            manyBuffers[0][j] = value(3, j);
+            manyBuffers[1][j] = value(4, j);
+        }
+        auto programmedBytes = storage.statistics().programmedBytes;
+        auto write1 = threadSafe.write(3, manyBuffers[0], 100);
+        auto write2 = threadSafe.write(3, manyBuffers[1], 100);
+        int readResult = -1;
+        threadSafe.read(3, buffer, 128, [&readResult](int result) {readResult = result;});
+        auto erase = threadSafe.erase(5);
+        while (readResult == -1 || erase.wait_for(0s) != std::future_status::ready)
+            co_await loop.sleep(1ms);
+        bool ok = write1.get() == 100 && write2.get() == 100 && readResult == 100 && erase.get() == Storage::OK
+            && storage.statistics().programmedBytes - programmedBytes < 200;
+        for (int j = 0; j < 100 && ok; ++j)
+            ok = buffer[j] == value(4, j);
+
+        // another thread writes elements several times and reads them back while the loop executes the requests
+        std::atomic<bool> threadOk = false;
+        std::atomic<bool> finished = false;
+        std::thread thread([&threadSafe, &threadOk, &finished] {
+            std::vector<std::future<int>> writes;
+            uint8_t data[32];
+            for (int round = 0; round < 20; ++round) {
+                for (int id = 10; id < 18; ++id) {
+                    for (int j = 0; j < 32; ++j)
+                        data[j] = value(id + round, j);
+                    writes.push_back(threadSafe.write(id, data, 32));
+                }
+            }
+            bool ok = true;
+            for (auto &write : writes)
+                ok = write.get() == 32 && ok;
+            for (int id = 10; id < 18 && ok; ++id) {
+                ok = threadSafe.read(id, data, 32).get() == 32;
+                for (int j = 0; j < 32 && ok; ++j)
+                    ok = data[j] == value(id + 19, j);
+            }
+            threadOk = ok;
+            finished = true;
+        });
+        while (!finished)
+            co_await loop.sleep(1ms);
+        thread.join();
+        ok = ok && threadOk;
+
+        // a request that is pending when the front end gets destroyed completes with NOT_READY
+        std::future<int> pending;
+        {
+            ThreadSafeStorage stopped(loop, storage);
+            pending = stopped.write(3, manyBuffers[0], 100);
+        }
+        while (pending.wait_for(0s) != std::future_status::ready)
+            co_await loop.sleep(1ms);
+        ok = ok && pending.get() == Storage::NOT_READY;
+        if (!ok) {
+            // fail
+            debug::out << "Error: Thread safe storage\n";
+            co_return;
+        }
+    }
+
+    // let process() of the destroyed front ends return (maximum poll interval is 32ms)
+    co_await loop.sleep(50ms);
+#endif
+
+#ifdef NATIVE
+    // mount an image in the format before sequence numbers were introduced, the sectors are used as a ring where the
+    // oldest closed sector is behind the empty sector: 3 (oldest), 0, 1 (open), 2 (empty)
+    {
+        BufferStorage::Info info = storageInfo;
+        info.sectorCount = 4;
+        info.sectorSize = storageInfo.sectorSize * storageInfo.sectorCount / info.sectorCount;
+        info.wideEntries = false;
+        BufferStorage legacy(info, flashBuffer);
+        co_await legacy.clear(result);
+        co_await writeLegacySector(flashBuffer, info, 3, 6, 0, true);
+        co_await writeLegacySector(flashBuffer, info, 0, 3, 1, true);
+        co_await writeLegacySector(flashBuffer, info, 1, 1, 2, false);
+        int versions[] = {2, 1, 1, 0, 0, 0};
+        int legacySizes[] = {16, 16, 16, 16, 16, 16};
+
+        // check after mount, then overwrite the elements so that garbage collection reclaims the legacy sectors
+        for (int round = 0; round < 4; ++round) {
+            co_await legacy.mount(result);
+            bool ok = result == Storage::OK;
+            for (int id = 1; id <= 6 && ok; ++id) {
+                int size = legacySizes[id - 1];
+                co_await legacy.read(id, buffer, result);
+                ok = result == size;
+                for (int j = 0; j < size && ok; ++j)
+                    ok = buffer[j] == value(id + versions[id - 1], j);
+            }
+            if (!ok) {
+                // fail
+                debug::out << "Error: Legacy format (" << dec(round) << ")\n";
+                co_return;
+            }
+
+            for (int i = 0; i < 40; ++i) {
+                int id = (i + round) % 6 + 1;
+                int size = 64 + (i * 13) % 65;
+                int version = ++versions[id - 1];
+                for (int j = 0; j < size; ++j) {
+                    buffer[j] = value(id + version, j);
+                }
+                co_await legacy.write(id, buffer, size, result);
+                legacySizes[id - 1] = size;
+            }
+        }
+    }
+#endif
+
     // success
     debug::out << "Success!\n";
 
@@ -14,13 +14,16 @@ using namespace coco;
 constexpr int BLOCK_SIZE = 8;
 constexpr int PAGE_SIZE = 2048;
 
-const BufferStorage::Info storageInfo {
+constexpr BufferStorage::Info storageInfo {
     0, // address
     BLOCK_SIZE,
     PAGE_SIZE,
     8192, // sector size
     2, // sector count
-    BufferStorage::Type::MEM_4N
+    BufferStorage::Type::MEM_4N,
+    {}, // commands
+    false, // memory mapped
+    false // wide entries
 };
 
 
@@ -14,7 +14,10 @@ const BufferStorage::Info storageInfo{
     flash::PAGE_SIZE,
     8192, // sector size
     2, // sector count
-    BufferStorage::Type::FLASH_4N
+    BufferStorage::Type::FLASH_4N,
+    {}, // commands
+    true, // memory mapped
+    false // wide entries
 };
 
 